@@ -0,0 +1,242 @@
+//---------------------------------------------------------------------
+// ANNOT_.CXX: native readers for slide annotation files.
+//
+// Author: Vlad Popovici
+//---------------------------------------------------------------------
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#include <boost/python.hpp>
+#include <numpy/ndarrayobject.h>
+#include <expat.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace bp = boost::python;
+
+
+// NDPA_PARSER
+// State of the SAX-style parser for Hamamatsu's NDPA files. The expected
+// structure is
+//
+//  <annotations>
+//      <ndpviewstate id="...">         <- annotation object (depth 2)
+//          <title>...</title>
+//          ...
+//          <annotation type="freehand" ...>
+//              <pointlist>             <- one ring
+//                  <point><x>...</x><y>...</y></point>
+//                  ...
+//              </pointlist>
+//          </annotation>
+//      </ndpviewstate>
+//      ...
+//  </annotations>
+//
+// All rings are appended to a single coordinate buffer. The rings of an
+// annotation object are assigned to its title when the object is closed (the
+// title may appear anywhere in the object) and are dropped at that point if
+// the title is not among the requested ones.
+struct NdpaParser
+{
+    XML_Parser parser;
+    int depth;
+
+    bool in_title, in_pointlist, in_point;
+    int in_coord;                   // 0: none, 1: <x>, 2: <y>
+    std::string text;               // character data of the current element
+
+    std::string title;              // title of the current annotation object
+    std::size_t obj_first_ring;     // first ring of the current object
+    long long px, py;               // current point
+
+    const std::set<std::string>* filter;
+    std::vector<std::string> titles;
+    std::map<std::string, long long> title_index;
+    std::vector<long long> ring_title;
+    std::vector<long long> ring_offsets;
+    std::vector<long long> xy;
+
+    NdpaParser(const std::set<std::string>* f)
+        : depth(0), in_title(false), in_pointlist(false), in_point(false),
+          in_coord(0), obj_first_ring(0), px(0), py(0), filter(f), ring_offsets(1, 0)
+    {
+        parser = XML_ParserCreate(NULL);
+        XML_SetUserData(parser, this);
+        XML_SetElementHandler(parser, start_element, end_element);
+        XML_SetCharacterDataHandler(parser, char_data);
+    }
+
+    ~NdpaParser()
+    {
+        XML_ParserFree(parser);
+    }
+
+    void begin_object()
+    {
+        title.clear();
+        obj_first_ring = ring_title.size();
+    }
+
+    void end_object()
+    {
+        if (filter && filter->find(title) == filter->end()) {
+            // drop the rings of this object
+            ring_title.resize(obj_first_ring);
+            ring_offsets.resize(obj_first_ring + 1);
+            xy.resize(2 * ring_offsets.back());
+            return;
+        }
+
+        std::map<std::string, long long>::const_iterator it = title_index.find(title);
+        long long idx;
+        if (it == title_index.end()) {
+            idx = static_cast<long long>(titles.size());
+            title_index[title] = idx;
+            titles.push_back(title);
+        } else {
+            idx = it->second;
+        }
+        std::fill(ring_title.begin() + obj_first_ring, ring_title.end(), idx);
+    }
+
+    static void XMLCALL start_element(void* data, const XML_Char* name, const XML_Char** attr)
+    {
+        NdpaParser* p = static_cast<NdpaParser*>(data);
+        ++p->depth;
+
+        if (p->depth == 2) {
+            p->begin_object();
+        } else if (p->depth == 3 && std::strcmp(name, "title") == 0) {
+            p->in_title = true;
+            p->text.clear();
+        } else if (std::strcmp(name, "pointlist") == 0) {
+            p->in_pointlist = true;
+        } else if (p->in_pointlist && std::strcmp(name, "point") == 0) {
+            p->in_point = true;
+            p->px = p->py = 0;
+        } else if (p->in_point && (std::strcmp(name, "x") == 0 || std::strcmp(name, "y") == 0)) {
+            p->in_coord = name[0] == 'x' ? 1 : 2;
+            p->text.clear();
+        }
+    }
+
+    static void XMLCALL end_element(void* data, const XML_Char* name)
+    {
+        NdpaParser* p = static_cast<NdpaParser*>(data);
+
+        if (p->depth == 2) {
+            p->end_object();
+        } else if (p->in_title && p->depth == 3) {
+            p->in_title = false;
+            p->title = p->text;
+        } else if (p->in_coord) {
+            long long v = std::strtoll(p->text.c_str(), NULL, 10);
+            if (p->in_coord == 1) p->px = v; else p->py = v;
+            p->in_coord = 0;
+        } else if (p->in_point && std::strcmp(name, "point") == 0) {
+            p->xy.push_back(p->px);
+            p->xy.push_back(p->py);
+            p->in_point = false;
+        } else if (p->in_pointlist && std::strcmp(name, "pointlist") == 0) {
+            p->ring_title.push_back(-1);
+            p->ring_offsets.push_back(static_cast<long long>(p->xy.size() / 2));
+            p->in_pointlist = false;
+        }
+
+        --p->depth;
+    }
+
+    static void XMLCALL char_data(void* data, const XML_Char* s, int len)
+    {
+        NdpaParser* p = static_cast<NdpaParser*>(data);
+        if (p->in_title || p->in_coord)
+            p->text.append(s, len);
+    }
+};
+
+
+template <typename T>
+PyObject* vector_to_array(const std::vector<T>& v, int type_num, npy_intp ncols=1)
+{
+    npy_intp dims[2] = {static_cast<npy_intp>(v.size()) / ncols, ncols};
+    PyObject* arr = PyArray_SimpleNew(ncols == 1 ? 1 : 2, dims, type_num);
+    if (!v.empty())
+        std::memcpy(PyArray_DATA((PyArrayObject*)arr), &v[0], v.size() * sizeof(T));
+    return arr;
+}
+
+
+// NDPA_READ
+// Read all annotations from an NDPA file in a single streaming pass (the XML
+// document is never built in memory).
+//
+// Args:
+//  filename (string)
+//  title_filter (list of strings or None): if not None, only the annotation
+//      objects with these titles are kept
+//  R (list): receives, in order,
+//      titles: list of the (unique) titles of the annotation objects kept
+//      ring_title: int64 array, for each ring the index of its title in titles
+//      ring_offsets: int64 array, the k-th ring is xy[ring_offsets[k]:ring_offsets[k+1]]
+//      xy: (n x 2) int64 array of point coordinates (slide coordinates)
+//
+// Returns:
+//  the number of rings read
+// -1: cannot open file
+// -2: XML parse error
+//
+int ndpa_read(const std::string& filename, bp::object title_filter, bp::list R)
+{
+    std::set<std::string> filter;
+    bool use_filter = !title_filter.is_none();
+    if (use_filter) {
+        for (long k = 0; k < bp::len(title_filter); ++k)
+            filter.insert(bp::extract<std::string>(title_filter[k]));
+    }
+
+    FILE* fp = std::fopen(filename.c_str(), "rb");
+    if (!fp)
+        // cannot open file
+        return -1;
+
+    NdpaParser p(use_filter ? &filter : 0);
+    std::vector<char> buf(1 << 20);
+    bool ok = true;
+    for (;;) {
+        std::size_t n = std::fread(&buf[0], 1, buf.size(), fp);
+        bool done = n < buf.size();
+        if (XML_Parse(p.parser, &buf[0], static_cast<int>(n), done) == XML_STATUS_ERROR) {
+            ok = false;
+            break;
+        }
+        if (done) break;
+    }
+    std::fclose(fp);
+
+    if (!ok)
+        // XML parse error
+        return -2;
+
+    bp::list titles;
+    for (std::size_t k = 0; k < p.titles.size(); ++k)
+        titles.append(p.titles[k]);
+
+    R.append(titles);
+    R.append(bp::object(bp::handle<>(vector_to_array(p.ring_title, NPY_INT64))));
+    R.append(bp::object(bp::handle<>(vector_to_array(p.ring_offsets, NPY_INT64))));
+    R.append(bp::object(bp::handle<>(vector_to_array(p.xy, NPY_INT64, 2))));
+
+    return static_cast<int>(p.ring_title.size());
+}
+
+
+BOOST_PYTHON_MODULE(annot_)
+{
+    import_array();
+    bp::def("ndpa_read_", ndpa_read);
+}
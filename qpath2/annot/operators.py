@@ -12,53 +12,55 @@ __all__ = ['poly_annot_inside']
 
 import vigra
 import numpy as np
-from ..compgeom import simple_polygon_intersection, rect_inside_polygon
-from ..masks import add_region, apply_mask
+from ..compgeom import polygon_intersection
+from ..masks import add_region, masked_points, apply_mask
 
 
 ##-
-def poly_annot_inside(img, roi, ann, outside_value=0):
+def poly_annot_inside(img, roi, ann, outside_value=0, fill_rule='evenodd'):
     """Keep only the pixels inside annotated regions, all the rest being set to
     a given value (default 0). Changes are operated in situ, in the specified ROI,
-    to all channels.
+    to all channels. The annotations need not be simple polygons (e.g.
+    free-hand ones, crossing themselves): they are repaired while being
+    clipped to the ROI (see compgeom.polygon_intersection).
 
     Args:
         img (vigra.VigraArray): an input image (ROI)
         roi (tuple): (x0, y0, x1, y1) coordinates of the ROI within the original image
         ann (dict): a dictionary of polygons - one polygon per annotated region
         outside_value (img.dtype): a value to set outside the regions.
+        fill_rule (str): 'evenodd' or 'nonzero' - the rule deciding which parts
+            of a self-intersecting annotation are inside (see
+            compgeom.polygon_repair)
 
     Returns:
         vigra.VigraArray
     """
     x0, y0, x1, y1 = roi
-    r = np.array([[x0, y0], [x1, y1]])
-    roi_mask = vigra.VigraArray((img.width, img.height), dtype=img.dtype, axistags=vigra.AxisTags('xy'))
+    r = np.array([[x0, y0], [x1, y0], [x1, y1], [x0, y1]], dtype=np.float64)
+    roi_mask = vigra.VigraArray((img.width, img.height), dtype=np.uint8, axistags=vigra.AxisTags('xy'))
     roi_mask.fill(0)
 
     for a in ann:
-        P = np.array(ann[a])
+        P = np.array(ann[a], dtype=np.float64)
 
-        if rect_inside_polygon([x0, y0], [x1, y1], P):
-            # the ROI is inside the annotated region, nothing to change
-            return img
+        # the intersection is a list of polygons with holes: each is
+        # translated such that (x0,y0) -> (0,0) (from ROI) and added to the
+        # ROI mask, without its holes
+        for rings in polygon_intersection(r, P, fill_rule):
+            part = np.zeros((img.height, img.width), dtype=np.uint8)
+            add_region(part, rings[0] - [x0, y0])
+            for q in rings[1:]:
+                c, rr = masked_points(q - [x0, y0], part.shape)
+                part[rr, c] = 0
+            roi_mask[part.T > 0] = 1
 
-        intr = simple_polygon_intersection(r, P)
-        if len(intr) > 0:
-            # add the intersection to the ROI mask
-            #-translate the intersections such that (x0,y0) -> (0,0) (from ROI)
-            #-update the mask
-            for q in intr:  # for each part of the intersection
-                q -= [x0, y0]
-                add_region(roi_mask, q)
-        # else nothing to do
-    apply_mask(img, roi_mask)  # sets to 0 all pixels outside the annotated region
+    if np.all(roi_mask):
+        # the ROI is inside the annotated regions, nothing to change
+        return img
 
-    roi_mask = 1 - roi_mask  # invert the mask
-    roi_mask *= outside_value
-    ch_iter = img.channelIter()
-    for c in ch_iter:
-        c += roi_mask  # pixels previously set to 0 now get +outside_value
+    # set all pixels outside the annotated region to outside_value (a single pass)
+    apply_mask(img, roi_mask, fill=outside_value)
 
     return img
 ##-
\ No newline at end of file
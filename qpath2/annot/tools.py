@@ -8,51 +8,131 @@
 # QPATH2.ANNOT.TOOLS - tools for handling various proprietary annotations.
 #
 
-__all__ = ['ndpa2xy', 'ndpa_read_single', 'ndpa_read']
+__all__ = ['ndpa2xy', 'xy2ndpa', 'ndpa_read_single', 'ndpa_read', 'ndpa_read_flat']
 
 import numpy as np
 from qpath2.core import Error
-import xml.etree.ElementTree as ET
+from qpath2.annot.annot_ import ndpa_read_
 
 ##-
-def ndpa2xy(ndpa_pts, level, wsi_params):
+def _ndpa_affine(level, wsi_params):
+    """Parameters of the affine map from NDPA (slide) coordinates, in nanometers
+    relative to the slide centre, to pixel coordinates at a given level:
+        x_px = (x_nm - x_offset) * sx + tx, and similarly for y.
+    """
+    if wsi_params['vendor'] != 'hamamatsu':
+        raise Error('vendor mismatch')
+    if level < 0 or level >= wsi_params['level_count']:
+        raise Error('level out of bounds')
+
+    d = float(wsi_params['levels'][level]['downsample_factor'])
+    s = np.array([1.0 / (1000.0 * wsi_params['x_mpp'] * d),
+                  1.0 / (1000.0 * wsi_params['y_mpp'] * d)])
+    o = np.array([wsi_params['x_offset'], wsi_params['y_offset']], dtype=np.float64)
+    # the origin of the NDPA coordinates is the centre of the level-0 image:
+    t = np.array([(wsi_params['levels'][0]['x_size'] // 2) / d,
+                  (wsi_params['levels'][0]['y_size'] // 2) / d])
+
+    return o, s, t
+##-
+
+
+##-
+def ndpa2xy(ndpa_pts, level, wsi_params, as_type=np.int64):
     """Convert a set of points from Hamamatsu's annotation file (.ndpa)
-    to (x,y) image coordinates.
+    to (x,y) image coordinates. The conversion is vectorized, so whole
+    annotation sets (e.g. the coordinate buffer returned by ndpa_read_flat)
+    can be converted in one call.
 
     Args:
-        ndpa_pts (list): a list of (x,y)  wsi coordinates
-        level (int): magnification level (0: maximum magnification, 1: half of
-            the maximum magnification, etc.)
+        ndpa_pts (list or numpy.array): a list of (x,y) wsi coordinates or a
+            (n x 2) array
+        level (int): magnification level (0: maximum magnification, 1: the next
+            one, etc.); the level's downsample factor is used for scaling
         wsi_params (dict): a structure holding the parameters describing the
-            whole slide image (WSI)
+            whole slide image (WSI), e.g. WSIInfo.info
+        as_type: numpy.int64 (default; coordinates truncated to integer pixels)
+            or numpy.float64 (sub-pixel coordinates)
 
     Returns:
         a numpy.array (n x 2), with (x, y) coordinates by rows
     """
-    if wsi_params['vendor'] != 'hamamatsu':
-        raise Error('vendor mismatch')
-    if level > wsi_params['level_count']:
-        raise Error('level out of bounds')
-
-    d = 2**level
-    xy_coords = list()
-    for p in ndpa_pts:
-        x, y = p
-        x -= wsi_params['x_offset']
-        y -= wsi_params['y_offset']
-        x /= (1000 * wsi_params['x_mpp'])
-        y /= (1000 * wsi_params['y_mpp'])
-        x = long((x + wsi_params['levels'][0]['x_size'] / 2) / d)  # in pixels, relative to UL corner
-        y = long((y + wsi_params['levels'][0]['y_size'] / 2) / d)
+    o, s, t = _ndpa_affine(level, wsi_params)
 
-        xy_coords.append([x, y])
-
-    xy = np.array(xy_coords, dtype=np.int64)
+    xy = np.asarray(ndpa_pts, dtype=np.float64).reshape((-1, 2))
+    xy = (xy - o) * s + t
 
     if np.any(xy < 0):
         raise Error('negative coordinates')
 
-    return xy
+    if np.dtype(as_type).kind in 'iu':
+        return xy.astype(as_type)  # truncation, as for positive coordinates
+
+    return xy.astype(as_type, copy=False)
+##-
+
+
+##-
+def xy2ndpa(xy, level, wsi_params, as_type=np.int64):
+    """Convert a set of (x,y) image coordinates at a given level to Hamamatsu's
+    annotation (.ndpa) coordinates (nanometers, relative to the slide centre).
+    This is the inverse of ndpa2xy.
+
+    Args:
+        xy (list or numpy.array): a list of (x,y) image coordinates or a
+            (n x 2) array
+        level (int): magnification level of the image coordinates
+        wsi_params (dict): a structure holding the parameters describing the
+            whole slide image (WSI), e.g. WSIInfo.info
+        as_type: numpy.int64 (default, NDPA files store integer coordinates;
+            values are rounded) or numpy.float64
+
+    Returns:
+        a numpy.array (n x 2), with (x, y) coordinates by rows
+    """
+    o, s, t = _ndpa_affine(level, wsi_params)
+
+    pts = (np.asarray(xy, dtype=np.float64).reshape((-1, 2)) - t) / s + o
+
+    if np.dtype(as_type).kind in 'iu':
+        return np.rint(pts).astype(as_type)
+
+    return pts.astype(as_type, copy=False)
+##-
+
+
+##-
+def ndpa_read_flat(ndpa_file, titles=None):
+    """Read the annotations from an NDPA file in flat layout, in a single
+    streaming pass over the file.
+
+    Args:
+        ndpa_file (str): annotation file name
+        titles (list): if not None, only the annotation objects with these
+            titles are read
+
+    Returns:
+        (titles, ring_title, ring_offsets, xy) where
+        titles (list): the (unique) titles of the annotation objects read
+        ring_title (numpy.array): int64, for each ring (point list) the index
+            of its annotation object's title in titles
+        ring_offsets (numpy.array): int64, the k-th ring has the points
+            xy[ring_offsets[k]:ring_offsets[k+1]]
+        xy (numpy.array): (n x 2) int64 point coordinates, in slide
+            coordinate system
+
+    See also:
+        ndpa_read, ndpa_read_single, ndpa2xy
+    """
+    r = []
+    n = ndpa_read_(ndpa_file, titles, r)
+
+    if n == -1:
+        raise Error('cannot open ' + ndpa_file)
+    elif n == -2:
+        raise Error('cannot parse ' + ndpa_file)
+
+    return tuple(r)
 ##-
 
 
@@ -74,30 +154,13 @@ def ndpa_read_single(ndpa_file, ann_title):
     See also:
         ndap_read
     """
+    _, _, ring_offsets, xy = ndpa_read_flat(ndpa_file, [ann_title])
 
-    xml_file = ET.parse(ndpa_file)
-    xml_root = xml_file.getroot()
-
-    xy_coords = []
-
-    for ann in list(xml_root):
-        name = ann.find('title').text
-        if not name == ann_title:
-            continue
-        p = ann.find('annotation')
-        if p is None:
-            continue
-
-        p = p.find('pointlist')
-        if p is None:
-            continue
-
-        xy_coords.append([(long(pts.find('x').text), long(pts.find('y').text)) for pts in list(p)])
-
-    if len(xy_coords) == 0:
-        xy_coords = None
+    if len(ring_offsets) == 1:
+        return None
 
-    return xy_coords
+    return [[tuple(_p) for _p in xy[i:j].tolist()]
+            for i, j in zip(ring_offsets[:-1], ring_offsets[1:])]
 ##-
 
 
@@ -115,25 +178,12 @@ def ndpa_read(ndpa_file):
     See also:
         ndpa_read_single
     """
+    titles, ring_title, ring_offsets, xy = ndpa_read_flat(ndpa_file)
 
-    xml_file = ET.parse(ndpa_file)
-    xml_root = xml_file.getroot()
-
-    annot = dict()
-
-    for ann in list(xml_root):
-        name = ann.find('title').text
-        annot[name] = []
-
-        p = ann.find('annotation')
-        if p is None:
-            continue
-
-        p = p.find('pointlist')
-        if p is None:
-            continue
-
-        annot[name].append([(long(pts.find('x').text), long(pts.find('y').text)) for pts in list(p)])
+    annot = dict([(_t, []) for _t in titles])
+    for k in range(len(ring_title)):
+        annot[titles[ring_title[k]]].append(
+            [tuple(_p) for _p in xy[ring_offsets[k]:ring_offsets[k+1]].tolist()])
 
     return annot
-##-
\ No newline at end of file
+##-
@@ -8,14 +8,28 @@
 // Author: Vlad Popovici
 //----------------------------------------------------------------------
 
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
 #include <boost/python.hpp>
+#include <numpy/ndarrayobject.h>
 #include <CGAL/Exact_predicates_exact_constructions_kernel.h>
+#include <CGAL/Exact_predicates_inexact_constructions_kernel.h>
 #include <CGAL/Boolean_set_operations_2.h>
 #include <CGAL/Polygon_2.h>
 #include <CGAL/Polygon_with_holes_2.h>
 #include <CGAL/Polygon_set_2.h>
 #include <CGAL/Polygon_2_algorithms.h>
+#include <CGAL/convex_hull_2.h>
+#include <CGAL/min_quadrilateral_2.h>
+#include <CGAL/Arr_segment_traits_2.h>
+#include <CGAL/Arr_curve_data_traits_2.h>
+#include <CGAL/Arr_extended_dcel.h>
+#include <CGAL/Arrangement_2.h>
+#include <algorithm>
+#include <functional>
+#include <limits>
 #include <list>
+#include <queue>
+#include <vector>
 
 
 namespace py = boost::python;
@@ -26,6 +40,333 @@ typedef CGAL::Polygon_2<Kernel>                           Polygon_2;
 typedef CGAL::Polygon_with_holes_2<Kernel>                Polygon_with_holes_2;
 typedef CGAL::Polygon_set_2<Kernel>                       Polygon_set_2;
 
+// Predicates-only computations (hulls, orientation tests) do not need exact
+// constructions and run much faster with the inexact-constructions kernel.
+typedef CGAL::Exact_predicates_inexact_constructions_kernel IKernel;
+typedef IKernel::Point_2                                    IPoint_2;
+
+// Arrangement of segments used for polygon repair: each curve carries the
+// signed number of input edges running along it (+1 for an edge directed
+// lexicographically left-to-right, -1 otherwise; overlapping edges add up)
+// and each face carries a flag telling whether it is inside the repaired
+// polygon.
+typedef CGAL::Arr_segment_traits_2<Kernel>                Segment_traits_2;
+typedef CGAL::Arr_curve_data_traits_2<Segment_traits_2, int,
+                                      std::plus<int> >    Winding_traits_2;
+typedef Winding_traits_2::Curve_2                         Winding_segment_2;
+typedef CGAL::Arr_face_extended_dcel<Winding_traits_2, int> Winding_dcel;
+typedef CGAL::Arrangement_2<Winding_traits_2, Winding_dcel> Winding_arrangement_2;
+
+enum FillRule {
+    FILL_EVEN_ODD = 0,
+    FILL_NONZERO = 1
+};
+
+
+// POINTS_FROM_ARRAY
+// Read a (n x 2) numpy.ndarray of coordinates (any numeric type) into a vector
+// of points. Returns false if the object cannot be interpreted as such an array.
+//
+template <typename P>
+bool points_from_array(PyObject* obj, std::vector<P>& pts)
+{
+    PyArrayObject* arr = (PyArrayObject*)PyArray_FROMANY(obj, NPY_FLOAT64, 2, 2,
+                                                         NPY_ARRAY_IN_ARRAY);
+    if (!arr) {
+        PyErr_Clear();
+        return false;
+    }
+    if (PyArray_DIM(arr, 1) != 2) {
+        Py_DECREF(arr);
+        return false;
+    }
+
+    npy_intp n = PyArray_DIM(arr, 0);
+    const double* xy = (const double*)PyArray_DATA(arr);
+    pts.clear();
+    pts.reserve(n);
+    for (npy_intp k = 0; k < n; ++k)
+        pts.push_back(P(xy[2*k], xy[2*k+1]));
+
+    Py_DECREF(arr);
+    return true;
+}
+
+
+// POINTS_TO_ARRAY
+// Store a range of points as a new (n x 2) numpy.ndarray of doubles.
+//
+template <typename Iterator>
+PyObject* points_to_array(Iterator first, Iterator last)
+{
+    npy_intp dims[2] = {static_cast<npy_intp>(std::distance(first, last)), 2};
+    PyObject* arr = PyArray_SimpleNew(2, dims, NPY_FLOAT64);
+    double* xy = (double*)PyArray_DATA((PyArrayObject*)arr);
+    for (; first != last; ++first) {
+        *xy++ = CGAL::to_double(first->x());
+        *xy++ = CGAL::to_double(first->y());
+    }
+    return arr;
+}
+
+
+// OFFSETS_FROM_ARRAY
+// Read the ring offsets of a batch of polygons in flat layout: polygon k has
+// the vertices xy[offsets[k]:offsets[k+1]]. Returns false if the offsets are
+// not a non-decreasing 1-d array with offsets[0] == 0 and offsets[-1] == n_points.
+//
+bool offsets_from_array(PyObject* obj, std::size_t n_points, std::vector<npy_int64>& offsets)
+{
+    PyArrayObject* arr = (PyArrayObject*)PyArray_FROMANY(obj, NPY_INT64, 1, 1,
+                                                         NPY_ARRAY_IN_ARRAY);
+    if (!arr) {
+        PyErr_Clear();
+        return false;
+    }
+
+    const npy_int64* o = (const npy_int64*)PyArray_DATA(arr);
+    offsets.assign(o, o + PyArray_DIM(arr, 0));
+    Py_DECREF(arr);
+
+    if (offsets.empty() || offsets.front() != 0 ||
+        offsets.back() != static_cast<npy_int64>(n_points))
+        return false;
+    for (std::size_t k = 1; k < offsets.size(); ++k)
+        if (offsets[k] < offsets[k-1]) return false;
+
+    return true;
+}
+
+
+// POLYGONS_WITH_HOLES_TO_FLAT
+// Store a list of polygons with holes in flat layout: three numpy.ndarrays,
+// xy (n x 2, the vertices of all rings), ring_offsets (the vertices of the
+// k-th ring are xy[ring_offsets[k]:ring_offsets[k+1]]) and polygon_offsets
+// (the rings of the j-th polygon are polygon_offsets[j]...polygon_offsets[j+1]-1,
+// the first one being the outer boundary, the others its holes), are appended
+// to the list R.
+//
+void polygons_with_holes_to_flat(const std::list<Polygon_with_holes_2>& P, py::list R)
+{
+    std::vector<const Polygon_2*> rings;
+    std::vector<npy_int64> poly_off(1, 0);
+
+    for (std::list<Polygon_with_holes_2>::const_iterator it = P.begin(); it != P.end(); ++it) {
+        rings.push_back(&it->outer_boundary());
+        for (Polygon_with_holes_2::Hole_const_iterator hit = it->holes_begin();
+             hit != it->holes_end(); ++hit)
+            rings.push_back(&*hit);
+        poly_off.push_back(static_cast<npy_int64>(rings.size()));
+    }
+
+    npy_intp n_rings = static_cast<npy_intp>(rings.size()) + 1;
+    npy_intp n_polys = static_cast<npy_intp>(poly_off.size());
+    PyObject* ring_offsets = PyArray_SimpleNew(1, &n_rings, NPY_INT64);
+    PyObject* polygon_offsets = PyArray_SimpleNew(1, &n_polys, NPY_INT64);
+    npy_int64* ro = (npy_int64*)PyArray_DATA((PyArrayObject*)ring_offsets);
+    std::copy(poly_off.begin(), poly_off.end(),
+              (npy_int64*)PyArray_DATA((PyArrayObject*)polygon_offsets));
+
+    ro[0] = 0;
+    for (std::size_t k = 0; k < rings.size(); ++k)
+        ro[k+1] = ro[k] + static_cast<npy_int64>(rings[k]->size());
+
+    npy_intp dims[2] = {static_cast<npy_intp>(ro[rings.size()]), 2};
+    PyObject* xy = PyArray_SimpleNew(2, dims, NPY_FLOAT64);
+    double* pxy = (double*)PyArray_DATA((PyArrayObject*)xy);
+    for (std::size_t k = 0; k < rings.size(); ++k) {
+        for (Polygon_2::Vertex_const_iterator vit = rings[k]->vertices_begin();
+             vit != rings[k]->vertices_end(); ++vit) {
+            *pxy++ = CGAL::to_double(vit->x());
+            *pxy++ = CGAL::to_double(vit->y());
+        }
+    }
+
+    R.append(py::object(py::handle<>(xy)));
+    R.append(py::object(py::handle<>(ring_offsets)));
+    R.append(py::object(py::handle<>(polygon_offsets)));
+}
+
+
+// CCB_TO_POLYGON
+// Collect the vertices along a connected component of a face boundary.
+//
+template <typename Circulator>
+Polygon_2 ccb_to_polygon(Circulator first)
+{
+    Polygon_2 P;
+    Circulator curr = first;
+    do {
+        P.push_back(curr->source()->point());
+    } while (++curr != first);
+
+    return P;
+}
+
+
+// REPAIR_POLYGON
+// Split a (possibly self-intersecting) ring into simple polygons with holes.
+//
+// The edges of the ring are inserted into an arrangement, which computes all
+// self-intersections and overlaps in a single sweep. The winding number of each
+// face is then propagated from the unbounded face (winding number 0) across
+// the edges, and the fill rule decides which faces are inside. Edges having
+// inside (or outside) faces on both sides are dropped, and the boundaries of
+// the remaining inside faces form the result. Holes are oriented clockwise,
+// outer boundaries counterclockwise.
+//
+void repair_polygon(const std::vector<Point_2>& ring, int fill_rule,
+                    std::list<Polygon_with_holes_2>& res)
+{
+    std::vector<Winding_segment_2> edges;
+    std::size_t n = ring.size();
+
+    edges.reserve(n);
+    for (std::size_t k = 0; k < n; ++k) {
+        const Point_2& p = ring[k];
+        const Point_2& q = ring[(k + 1) % n];
+        CGAL::Comparison_result c = CGAL::compare_xy(p, q);
+        if (c == CGAL::EQUAL) continue;  // repeated vertex
+        edges.push_back(Winding_segment_2(Segment_traits_2::Curve_2(p, q),
+                                          c == CGAL::SMALLER ? 1 : -1));
+    }
+
+    Winding_arrangement_2 arr;
+    CGAL::insert(arr, edges.begin(), edges.end());
+
+    // propagate winding numbers (breadth-first over the faces), using the
+    // face data to store them
+    const int unvisited = std::numeric_limits<int>::min();
+    for (Winding_arrangement_2::Face_iterator fit = arr.faces_begin();
+         fit != arr.faces_end(); ++fit)
+        fit->set_data(unvisited);
+
+    std::queue<Winding_arrangement_2::Face_handle> Q;
+    arr.unbounded_face()->set_data(0);
+    Q.push(arr.unbounded_face());
+
+    while (!Q.empty()) {
+        Winding_arrangement_2::Face_handle f = Q.front();
+        Q.pop();
+
+        std::vector<Winding_arrangement_2::Ccb_halfedge_circulator> ccbs;
+        for (Winding_arrangement_2::Outer_ccb_iterator oit = f->outer_ccbs_begin();
+             oit != f->outer_ccbs_end(); ++oit)
+            ccbs.push_back(*oit);
+        for (Winding_arrangement_2::Inner_ccb_iterator iit = f->inner_ccbs_begin();
+             iit != f->inner_ccbs_end(); ++iit)
+            ccbs.push_back(*iit);
+
+        for (std::size_t k = 0; k < ccbs.size(); ++k) {
+            Winding_arrangement_2::Ccb_halfedge_circulator curr = ccbs[k];
+            do {
+                // f lies to the left of curr: crossing curr from right to left
+                // increases the winding number by the (signed) edge count
+                int d = curr->curve().data();
+                if (curr->direction() != CGAL::ARR_LEFT_TO_RIGHT) d = -d;
+                Winding_arrangement_2::Face_handle g = curr->twin()->face();
+                if (g->data() == unvisited) {
+                    g->set_data(f->data() - d);
+                    Q.push(g);
+                }
+            } while (++curr != ccbs[k]);
+        }
+    }
+
+    // from here on, the face data is the "inside" flag
+    for (Winding_arrangement_2::Face_iterator fit = arr.faces_begin();
+         fit != arr.faces_end(); ++fit) {
+        int w = fit->data();
+        bool inside = w != unvisited &&
+            (fill_rule == FILL_NONZERO ? w != 0 : (w % 2) != 0);
+        fit->set_data(inside ? 1 : 0);
+    }
+
+    // drop the edges not separating inside from outside
+    std::vector<Winding_arrangement_2::Halfedge_handle> redundant;
+    for (Winding_arrangement_2::Edge_iterator eit = arr.edges_begin();
+         eit != arr.edges_end(); ++eit)
+        if (eit->face()->data() == eit->twin()->face()->data())
+            redundant.push_back(eit);
+    for (std::size_t k = 0; k < redundant.size(); ++k)
+        arr.remove_edge(redundant[k]);
+
+    for (Winding_arrangement_2::Face_iterator fit = arr.faces_begin();
+         fit != arr.faces_end(); ++fit) {
+        if (fit->is_unbounded() || !fit->data()) continue;
+
+        Polygon_with_holes_2 P(ccb_to_polygon(fit->outer_ccb()));
+        for (Winding_arrangement_2::Inner_ccb_iterator iit = fit->inner_ccbs_begin();
+             iit != fit->inner_ccbs_end(); ++iit)
+            P.add_hole(ccb_to_polygon(*iit));
+        res.push_back(P);
+    }
+}
+
+
+// POLYGON_REPAIR
+// Repair a polygon with self-intersections (e.g. a hand-drawn annotation) by
+// splitting it into simple polygons, possibly with holes.
+//
+// The polygon is given as a (n x 2) numpy.ndarray, the last vertex being
+// implicitly connected to the first one. The fill rule (0: even-odd, 1: non-zero
+// winding) decides which regions delimited by the ring are inside. The result
+// is appended to the list R in flat layout (see polygons_with_holes_to_flat).
+//
+// Returns the number of resulting polygons and negative codes for errors:
+// -1: the vertices cannot be interpreted as a (n x 2) array
+// -2: unknown fill rule
+//
+int polygon_repair(PyObject* P, int fill_rule, py::list R)
+{
+    std::vector<Point_2> ring;
+    std::list<Polygon_with_holes_2> res;
+
+    if (!points_from_array(P, ring)) return -1;
+    if (fill_rule != FILL_EVEN_ODD && fill_rule != FILL_NONZERO) return -2;
+
+    if (ring.size() >= 3)
+        repair_polygon(ring, fill_rule, res);
+    polygons_with_holes_to_flat(res, R);
+
+    return static_cast<int>(res.size());
+}
+
+
+// POLYGON_INTERSECTION
+// Intersection of two polygons which need not be simple: both are repaired
+// (see polygon_repair) under the given fill rule before being intersected,
+// such that self-intersecting annotations are not rejected. The result is a
+// set of polygons with holes, appended to the list R in flat layout.
+//
+// Returns the number of resulting polygons and negative codes for errors:
+// -1, -2: P or Q cannot be interpreted as a (n x 2) array
+// -3: unknown fill rule
+//
+int polygon_intersection(PyObject* P, PyObject* Q, int fill_rule, py::list R)
+{
+    std::vector<Point_2> p_ring, q_ring;
+    std::list<Polygon_with_holes_2> p_parts, q_parts, res;
+
+    if (!points_from_array(P, p_ring)) return -1;
+    if (!points_from_array(Q, q_ring)) return -2;
+    if (fill_rule != FILL_EVEN_ODD && fill_rule != FILL_NONZERO) return -3;
+
+    if (p_ring.size() >= 3 && q_ring.size() >= 3) {
+        repair_polygon(p_ring, fill_rule, p_parts);
+        repair_polygon(q_ring, fill_rule, q_parts);
+
+        Polygon_set_2 S, T;
+        S.join(p_parts.begin(), p_parts.end());
+        T.join(q_parts.begin(), q_parts.end());
+        S.intersection(T);
+        S.polygons_with_holes(std::back_inserter(res));
+    }
+    polygons_with_holes_to_flat(res, R);
+
+    return static_cast<int>(res.size());
+}
+
 
 // POINT_WRT_POLYGON
 // Check the position of a (set of) point(s) with respect to a polygon.
@@ -177,11 +518,234 @@ int polygon_equality(py::list P_x, py::list P_y, py::list Q_x, py::list Q_y)
 }
 
 
+// CONVEX_HULL
+// Convex hull of a set of points (or of the vertices of a polygon).
+//
+// The points are given as a (n x 2) numpy.ndarray. The vertices of the hull,
+// in counterclockwise order and without repeating the first vertex, are
+// appended as a (m x 2) numpy.ndarray to the list H.
+//
+// Returns 0 on success and negative codes for errors:
+// -1: the points cannot be interpreted as a (n x 2) array
+//
+int convex_hull(PyObject* P, py::list H)
+{
+    std::vector<IPoint_2> pts, hull;
+
+    if (!points_from_array(P, pts)) return -1;
+
+    CGAL::convex_hull_2(pts.begin(), pts.end(), std::back_inserter(hull));
+    H.append(py::object(py::handle<>(points_to_array(hull.begin(), hull.end()))));
+
+    return 0;
+}
+
+
+// MIN_AREA_RECTANGLE
+// Minimum-area enclosing rectangle (arbitrarily oriented) of a set of points.
+//
+// The points are given as a (n x 2) numpy.ndarray. The convex hull is computed
+// first (with inexact constructions), then the rotating calipers search of
+// CGAL::min_rectangle_2() runs on the hull vertices with exact arithmetic.
+// The 4 corners of the rectangle, in counterclockwise order, are appended as a
+// (4 x 2) numpy.ndarray to the list R.
+//
+// Returns 0 on success and negative codes for errors:
+// -1: the points cannot be interpreted as a (n x 2) array
+// -2: degenerate point set (the hull has fewer than 3 vertices)
+//
+int min_area_rectangle(PyObject* P, py::list R)
+{
+    std::vector<IPoint_2> pts, hull;
+
+    if (!points_from_array(P, pts)) return -1;
+
+    CGAL::convex_hull_2(pts.begin(), pts.end(), std::back_inserter(hull));
+    if (hull.size() < 3) return -2;
+
+    std::vector<Point_2> ehull;
+    ehull.reserve(hull.size());
+    for (std::vector<IPoint_2>::const_iterator it = hull.begin(); it != hull.end(); ++it)
+        ehull.push_back(Point_2(it->x(), it->y()));
+
+    Polygon_2 rect;
+    CGAL::min_rectangle_2(ehull.begin(), ehull.end(), std::back_inserter(rect));
+    if (!rect.is_counterclockwise_oriented())
+        rect.reverse_orientation();
+
+    R.append(py::object(py::handle<>(points_to_array(rect.vertices_begin(),
+                                                     rect.vertices_end()))));
+
+    return 0;
+}
+
+
+// RING_PROPERTIES
+// Convexity, collinearity and orientation of a ring, in a single pass over
+// its vertices (see polygon_properties). Repeated consecutive vertices are
+// skipped. The convexity test is that of CGAL::is_convex_2: no two turns of
+// opposite signs and at most two changes of the xy-order along the edges. The
+// vertices are collinear iff no turn is a left or a right one. The orientation
+// is the turn at the lexicographically smallest vertex, which is the ring's
+// orientation if it is simple (as for CGAL::orientation_2).
+//
+struct RingProperties {
+    bool is_convex, is_collinear, has_repeated;
+    CGAL::Orientation orientation;
+};
+
+static RingProperties ring_properties(std::vector<IPoint_2>::const_iterator first,
+                                      std::vector<IPoint_2>::const_iterator last)
+{
+    const std::size_t n = last - first;
+    RingProperties rp;
+    rp.has_repeated = false;
+    rp.orientation = CGAL::COLLINEAR;
+
+    bool left = false, right = false;
+    int order_changes = 0;
+    CGAL::Comparison_result order0 = CGAL::EQUAL, order = CGAL::EQUAL;
+    const IPoint_2 *a0 = 0, *b0 = 0;    // the first (non-degenerate) edge
+    const IPoint_2 *prev = 0;           // source of the previous edge
+    const IPoint_2 *lowest = 0;
+
+    for (std::size_t i = 0; i < n; ++i) {
+        const IPoint_2& p = first[i];
+        const IPoint_2& q = first[(i + 1) % n];
+        const CGAL::Comparison_result c = CGAL::compare_xy(p, q);
+        if (c == CGAL::EQUAL) {
+            rp.has_repeated = true;
+            continue;
+        }
+        if (!prev) {
+            a0 = &p; b0 = &q;
+            order0 = c;
+        } else {
+            const CGAL::Orientation o = CGAL::orientation(*prev, p, q);
+            left |= o == CGAL::LEFT_TURN;
+            right |= o == CGAL::RIGHT_TURN;
+            order_changes += c != order;
+            if (CGAL::compare_xy(p, *lowest) == CGAL::SMALLER) {
+                lowest = &p;
+                rp.orientation = o;
+            }
+        }
+        if (!prev)
+            lowest = &p;
+        prev = &p;
+        order = c;
+    }
+
+    if (prev) {
+        // close the ring: the turn at the source of the first edge
+        const CGAL::Orientation o = CGAL::orientation(*prev, *a0, *b0);
+        left |= o == CGAL::LEFT_TURN;
+        right |= o == CGAL::RIGHT_TURN;
+        order_changes += order0 != order;
+        if (lowest == a0)
+            rp.orientation = o;
+    }
+
+    rp.is_convex = !(left && right) && order_changes <= 2;
+    rp.is_collinear = !left && !right;
+
+    return rp;
+}
+
+
+// POLYGON_PROPERTIES
+// Compute, for a batch of polygons, a set of basic properties.
+//
+// The polygons are given in flat layout: a (n x 2) numpy.ndarray with the
+// vertices of all polygons, concatenated, and an array of offsets such that
+// the vertices of the k-th polygon are xy[offsets[k]:offsets[k+1]]. A last
+// vertex repeating the first one (closed ring) is ignored.
+// Four numpy.ndarrays, with one entry per polygon, are appended to the list R:
+//   is_simple (bool), is_convex (bool), orientation (int8: 1 counterclockwise,
+//   -1 clockwise, 0 for collinear vertices or a non-simple polygon) and
+//   is_collinear (bool: all the vertices on a line).
+// The convexity, collinearity and orientation come from one pass over the
+// vertices (see ring_properties). The simplicity needs a sweep over the edges
+// (CGAL::is_simple_2), run only when it is not implied: convex rings without
+// repeated vertices are simple, collinear ones are not.
+//
+// Returns the number of polygons on success and negative codes for errors:
+// -1: the vertices cannot be interpreted as a (n x 2) array
+// -2: invalid offsets
+//
+int polygon_properties(PyObject* xy, PyObject* offsets, py::list R)
+{
+    std::vector<IPoint_2> pts;
+    std::vector<npy_int64> off;
+
+    if (!points_from_array(xy, pts)) return -1;
+    if (!offsets_from_array(offsets, pts.size(), off)) return -2;
+
+    npy_intp n = static_cast<npy_intp>(off.size()) - 1;
+    PyObject* is_simple = PyArray_SimpleNew(1, &n, NPY_BOOL);
+    PyObject* is_convex = PyArray_SimpleNew(1, &n, NPY_BOOL);
+    PyObject* orientation = PyArray_SimpleNew(1, &n, NPY_INT8);
+    PyObject* is_collinear = PyArray_SimpleNew(1, &n, NPY_BOOL);
+    npy_bool* p_simple = (npy_bool*)PyArray_DATA((PyArrayObject*)is_simple);
+    npy_bool* p_convex = (npy_bool*)PyArray_DATA((PyArrayObject*)is_convex);
+    npy_int8* p_orient = (npy_int8*)PyArray_DATA((PyArrayObject*)orientation);
+    npy_bool* p_collinear = (npy_bool*)PyArray_DATA((PyArrayObject*)is_collinear);
+
+    for (npy_intp k = 0; k < n; ++k) {
+        std::vector<IPoint_2>::const_iterator first = pts.begin() + off[k];
+        std::vector<IPoint_2>::const_iterator last = pts.begin() + off[k+1];
+        if (last - first > 1 && *first == *(last - 1))
+            --last;  // closed ring
+
+        if (last - first < 3) {
+            // not a polygon: report it as degenerate
+            p_simple[k] = p_convex[k] = NPY_FALSE;
+            p_orient[k] = 0;
+            p_collinear[k] = NPY_TRUE;
+            continue;
+        }
+
+        const RingProperties rp = ring_properties(first, last);
+        bool simple;
+        if (rp.is_collinear)
+            simple = false;
+        else if (rp.is_convex && !rp.has_repeated)
+            simple = true;
+        else
+            simple = CGAL::is_simple_2(first, last, IKernel());
+
+        p_simple[k] = simple ? NPY_TRUE : NPY_FALSE;
+        p_convex[k] = rp.is_convex ? NPY_TRUE : NPY_FALSE;
+        p_orient[k] = !simple ? 0 : static_cast<npy_int8>(
+            rp.orientation == CGAL::COUNTERCLOCKWISE ? 1 : (rp.orientation == CGAL::CLOCKWISE ? -1 : 0));
+        p_collinear[k] = rp.is_collinear ? NPY_TRUE : NPY_FALSE;
+    }
+
+    R.append(py::object(py::handle<>(is_simple)));
+    R.append(py::object(py::handle<>(is_convex)));
+    R.append(py::object(py::handle<>(orientation)));
+    R.append(py::object(py::handle<>(is_collinear)));
+
+    return static_cast<int>(n);
+}
+
+
 BOOST_PYTHON_MODULE(compgeom_){
+    import_array();
     def("simple_polygon_intersection_",
         simple_polygon_intersection);
     def("point_wrt_polygon_",
         point_wrt_polygon);
     def("polygon_equality_",
         polygon_equality);
+    def("convex_hull_",
+        convex_hull);
+    def("min_area_rectangle_",
+        min_area_rectangle);
+    def("polygon_properties_",
+        polygon_properties);
+    def("polygon_repair_",
+        polygon_repair);
+    def("polygon_intersection_",
+        polygon_intersection);
 }
@@ -11,17 +11,27 @@
 __all__ = ['simple_polygon_intersection',
            'point_wrt_polygon', 'polygon_equality', 'polygon_is_convex',
            'polygon_is_collinear', 'polygon_is_counterclockwise',
-           'rect_inside_polygon', 'polygon_inside_polygon']
+           'rect_inside_polygon', 'polygon_inside_polygon',
+           'convex_hull', 'min_area_rect',
+           'polygons_to_flat', 'flat_to_polygons', 'polygon_properties',
+           'polygon_repair', 'polygon_intersection']
 
 
 from qpath2.compgeom_ import simple_polygon_intersection_, \
     point_wrt_polygon_, \
-    polygon_equality_
-
-from CGAL.CGAL_Kernel import Polygon_2, Point_2
+    polygon_equality_, \
+    convex_hull_, \
+    min_area_rectangle_, \
+    polygon_properties_, \
+    polygon_repair_, \
+    polygon_intersection_
 
 import numpy as np
 import qpath2.core as core
+from qpath2.core import polygons_to_flat, flat_to_polygons
+
+
+_FILL_RULES = {'evenodd': 0, 'nonzero': 1}
 
 
 ##-
@@ -51,6 +61,41 @@ def polygon_equality(P, Q):
 ##-
 
 
+##-
+def polygon_properties(xy, offsets=None):
+    """Compute some basic properties for a batch of polygons, in a single
+    native call.
+
+    Args:
+        xy (numpy.array or list): either (n x 2) vertex coordinates of all
+            polygons in flat layout (see polygons_to_flat), or a list of
+            polygons (in which case offsets must be None)
+        offsets (numpy.array): polygon offsets into xy (flat layout)
+
+    Returns:
+        dict: with keys 'is_simple', 'is_convex', 'is_collinear' (bool arrays,
+        the latter for the polygons with all their vertices on a line) and
+        'orientation' (int8 array: 1 for counterclockwise, -1 for clockwise
+        and 0 for collinear vertices or non-simple polygons), each with one
+        entry per polygon
+    """
+    if offsets is None:
+        xy, offsets = polygons_to_flat(xy)
+
+    r = []
+    n = polygon_properties_(xy, offsets, r)
+
+    if n == -1:
+        raise core.Error("Vertices must be given as a (n x 2) array")
+    elif n == -2:
+        raise core.Error("Invalid polygon offsets")
+    elif n < 0:
+        raise core.Error("Unknown error")
+
+    return dict(zip(['is_simple', 'is_convex', 'orientation', 'is_collinear'], r))
+##-
+
+
 ##-
 def polygon_is_convex(P):
     """Test whether a polygon is convex.
@@ -62,18 +107,13 @@ def polygon_is_convex(P):
     Returns:
         bool
     """
-    # use the CGAL official wrapper
-    Q = Polygon_2()
-    for v in P:
-        Q.push_back(Point_2(v[0], v[1]))
-
-    return Q.is_convex()
+    return bool(polygon_properties([P])['is_convex'][0])
 ##-
 
 
 ##-
 def polygon_is_collinear(P):
-    """Test whether a polygon is degenerated.
+    """Test whether a polygon is degenerated (all its vertices on a line).
 
     Args:
         P (numpy.array): (n x 2) The vertex coordinates for the polygon
@@ -82,18 +122,14 @@ def polygon_is_collinear(P):
     Returns:
         bool
     """
-    # use the CGAL official wrapper
-    Q = Polygon_2()
-    for v in P:
-        Q.push_back(Point_2(v[0], v[1]))
-
-    return Q.is_collinear_oriented()
+    return bool(polygon_properties([P])['is_collinear'][0])
 ##-
 
 
 ##-
 def polygon_is_counterclockwise(P):
-    """Test whether the vertices of a polygon are ordered counterclockwise.
+    """Test whether the vertices of a polygon are ordered counterclockwise
+    (False for a non-simple polygon, which has no orientation).
 
     Args:
         P (numpy.array): (n x 2) The vertex coordinates for the polygon
@@ -102,12 +138,7 @@ def polygon_is_counterclockwise(P):
     Returns:
         bool
     """
-    # use the CGAL official wrapper
-    Q = Polygon_2()
-    for v in P:
-        Q.push_back(Point_2(v[0], v[1]))
-
-    return Q.is_counterclockwise_oriented()
+    return bool(polygon_properties([P])['orientation'][0] == 1)
 ##-
 
 
@@ -138,7 +169,7 @@ def simple_polygon_intersection(P, Q):
     elif n == -1 or n == -2:
         raise core.Error("Size mismatch in P or Q")
     elif n == -3:
-        raise core.Error("The polygons are not simple")
+        raise core.Error("The polygons are not simple (see polygon_intersection)")
     elif n == -4:
         raise core.Error("The intersection is not bounded")
 
@@ -239,3 +270,131 @@ def polygon_inside_polygon(P, Q):
 
     return polygon_equality(P, r[0])
 ##-
+
+
+##-
+def convex_hull(P):
+    """Compute the convex hull of a set of points (e.g. the vertices of a
+    polygon or of a contour).
+
+    Args:
+        P (numpy.array): (n x 2) The point coordinates ((x, y) by rows).
+
+    Returns:
+        numpy.array: (m x 2) the vertices of the convex hull, in counterclockwise
+        order ((x, y) by rows).
+    """
+    h = []
+    n = convex_hull_(P, h)
+
+    if n == -1:
+        raise core.Error("Points must be given as a (n x 2) array")
+    elif n < 0:
+        raise core.Error("Unknown error")
+
+    return h[0]
+##-
+
+
+##-
+def min_area_rect(P):
+    """Compute the minimum-area (oriented) rectangle enclosing a set of points.
+
+    Args:
+        P (numpy.array): (n x 2) The point coordinates ((x, y) by rows).
+
+    Returns:
+        (R, (w, h), angle) where
+        R (numpy.array): (4 x 2) the corners of the rectangle, in counterclockwise
+            order ((x, y) by rows), starting with the corner R[0];
+        w, h (float): the lengths of the sides R[0]R[1] and R[1]R[2];
+        angle (float): the orientation (in radians) of the side R[0]R[1] with
+            respect to the x-axis.
+    """
+    r = []
+    n = min_area_rectangle_(P, r)
+
+    if n == -1:
+        raise core.Error("Points must be given as a (n x 2) array")
+    elif n == -2:
+        raise core.Error("Degenerate point set (collinear or fewer than 3 points)")
+    elif n < 0:
+        raise core.Error("Unknown error")
+
+    R = r[0]
+    u, v = R[1] - R[0], R[2] - R[1]
+
+    return R, (np.hypot(u[0], u[1]), np.hypot(v[0], v[1])), np.arctan2(u[1], u[0])
+##-
+
+
+##-
+def _flat_to_polygons_with_holes(xy, ring_offsets, polygon_offsets):
+    rings = flat_to_polygons(xy, ring_offsets)
+    return [rings[i:j] for i, j in zip(polygon_offsets[:-1], polygon_offsets[1:])]
+##-
+
+
+##-
+def polygon_repair(P, fill_rule='evenodd'):
+    """Repair a polygon with self-intersections (e.g. a free-hand annotation)
+    by splitting it, at the self-intersection points, into simple polygons,
+    possibly with holes. Use it as a preprocessing step before Boolean
+    operations, which require simple polygons.
+
+    Args:
+        P (numpy.array): (n x 2) The vertex coordinates for the polygon
+            ((x, y) by rows). The last vertex is implicitly connected to the
+            first one.
+        fill_rule (str): 'evenodd' or 'nonzero' - the rule deciding which of
+            the regions delimited by the polygon's boundary are inside.
+
+    Returns:
+        a list of polygons with holes, each given as a list of numpy.arrays
+        (n_k x 2): the first one is the outer boundary (counterclockwise), the
+        rest are the holes (clockwise).
+    """
+    if fill_rule not in _FILL_RULES:
+        raise core.Error("Unknown fill rule: " + str(fill_rule))
+
+    r = []
+    n = polygon_repair_(P, _FILL_RULES[fill_rule], r)
+
+    if n == -1:
+        raise core.Error("Vertices must be given as a (n x 2) array")
+    elif n < 0:
+        raise core.Error("Unknown error")
+
+    return _flat_to_polygons_with_holes(*r)
+##-
+
+
+##-
+def polygon_intersection(P, Q, fill_rule='evenodd'):
+    """Compute the intersection of two polygons that need not be simple. Both
+    polygons are repaired (see polygon_repair) before being intersected.
+
+    Args:
+        P (numpy.array): (n x 2) The vertex coordinates for the first polygon
+            ((x, y) by rows).
+        Q (numpy.array): (m x 2) The vertex coordinates for the second polygon
+            ((x, y) by rows).
+        fill_rule (str): 'evenodd' or 'nonzero' (see polygon_repair)
+
+    Returns:
+        a list of polygons with holes (see polygon_repair), empty if P and Q
+        do not intersect.
+    """
+    if fill_rule not in _FILL_RULES:
+        raise core.Error("Unknown fill rule: " + str(fill_rule))
+
+    r = []
+    n = polygon_intersection_(P, Q, _FILL_RULES[fill_rule], r)
+
+    if n == -1 or n == -2:
+        raise core.Error("Vertices must be given as a (n x 2) array")
+    elif n < 0:
+        raise core.Error("Unknown error")
+
+    return _flat_to_polygons_with_holes(*r)
+##-
@@ -10,7 +10,8 @@ Defines exception classes and other basic classes.
 """
 
 __all__ = ['Error', 'WSIInfo', 'MRIBase', 'MRI',
-           'MRIExplorer', 'MRISlidingWindow']
+           'MRIExplorer', 'MRISlidingWindow',
+           'polygons_to_flat', 'flat_to_polygons']
 
 
 import openslide as osl
@@ -339,3 +340,45 @@ class MRISlidingWindow(MRIExplorer):
             raise StopIteration()
 ##-
 
+
+##-
+def polygons_to_flat(polys):
+    """Convert a list of polygons to the flat layout used by the batch
+    functions: all the vertices concatenated in a single array and an array
+    of offsets delimiting each polygon.
+
+    Args:
+        polys (list): a list of (n_k x 2) numpy.arrays with the vertex
+            coordinates of each polygon ((x, y) by rows)
+
+    Returns:
+        (xy, offsets) where
+        xy (numpy.array): (n x 2) the vertices of all polygons
+        offsets (numpy.array): (len(polys)+1) int64 offsets such that the k-th
+            polygon is xy[offsets[k]:offsets[k+1]]
+    """
+    offsets = np.zeros(len(polys) + 1, dtype=np.int64)
+    offsets[1:] = np.cumsum([len(_p) for _p in polys])
+    if len(polys) == 0:
+        return np.zeros((0, 2)), offsets
+
+    xy = np.vstack([np.asarray(_p).reshape((-1, 2)) for _p in polys])
+
+    return xy, offsets
+##-
+
+
+##-
+def flat_to_polygons(xy, offsets):
+    """Inverse of polygons_to_flat(): split the flat layout into a list of
+    polygons. The returned arrays are views into xy.
+
+    Args:
+        xy (numpy.array): (n x 2) the vertices of all polygons
+        offsets (numpy.array): polygon offsets into xy
+
+    Returns:
+        a list of (n_k x 2) numpy.arrays
+    """
+    return [xy[i:j] for i, j in zip(offsets[:-1], offsets[1:])]
+##-
@@ -14,6 +14,8 @@ __all__ = ['sliding_window',
            'sliding_window_on_regions',
            'random_window',
            'random_window_on_regions',
+           'sliding_window_on_mask',
+           'random_window_on_mask',
            'regular_grid'
            ]
 
@@ -233,6 +235,119 @@ def random_window_on_regions(image_shape, roi, w_size, n):
 ## end random_window_on_regions
 ##-
 
+
+##-
+def sliding_window_on_mask(image_shape, coverage, w_size, step=(1,1), min_coverage=0.5,
+                           level=0):
+    """Yield the windows of a sliding window scan which are (mostly) foreground,
+    as given by a coverage map of the image. The coverage of all windows is
+    computed in a single batch query.
+
+    Parameters
+    ----------
+    image_shape : tuple (nrows, ncols)
+        Image shape (img.shape).
+    coverage : qpath2.masks.CoverageMap
+        Foreground coverage of the image.
+    w_size : tuple (width, height)
+        Window size as a pair of width and height values.
+    step : tuple (x_step, y_step)
+        Step size for the sliding window, as a pair of horizontal
+        and vertical steps. Defaults to (1,1).
+    min_coverage : float
+        Minimum fraction of foreground pixels in a window. Defaults to 0.5.
+    level : int
+        Level of the image, in the coverage map's pyramid (for levels other
+        than 0, the map needs the levels' downsample factors, see
+        qpath2.masks.CoverageMap). Defaults to 0.
+
+    Returns
+    -------
+    sliding_window_on_mask : generator
+        Generator yielding the (y0, y1, x0, x1) coordinates of the windows.
+    """
+
+    img_h, img_w = image_shape
+
+    if w_size[0] < 2 or w_size[1] < 2:
+        raise ValueError('Window size too small.')
+
+    x, y = np.meshgrid(np.arange(0, img_w-w_size[0]+1, step[0]),
+                       np.arange(0, img_h-w_size[1]+1, step[1]))
+    x, y = x.reshape((-1,)), y.reshape((-1,))
+
+    f = coverage.coverage(np.c_[x, y, np.full_like(x, w_size[0]), np.full_like(y, w_size[1])],
+                          level=level)
+    keep = f >= min_coverage
+
+    for x0, y0 in zip(x[keep].tolist(), y[keep].tolist()):
+        x1, y1 = x0 + w_size[0], y0 + w_size[1]
+        yield (y0, y1, x0, x1)
+## end sliding_window_on_mask
+##-
+
+
+##-
+def random_window_on_mask(image_shape, coverage, w_size, n, min_coverage=0.5, level=0,
+                          batch=1024):
+    """Yield randomly placed windows which are (mostly) foreground, as given by a
+    coverage map of the image. Candidate windows are drawn in batches and
+    only those with enough foreground are kept.
+
+    Parameters
+    ----------
+    image_shape : tuple (nrows, ncols)
+        Image shape (img.shape).
+    coverage : qpath2.masks.CoverageMap
+        Foreground coverage of the image.
+    w_size : tuple (width, height)
+        Window size as a pair of width and height values.
+    n : int
+        Number of windows to generate. If negative, then each call
+        will yield a new window.
+    min_coverage : float
+        Minimum fraction of foreground pixels in a window. Defaults to 0.5.
+    level : int
+        Level of the image, in the coverage map's pyramid (for levels other
+        than 0, the map needs the levels' downsample factors, see
+        qpath2.masks.CoverageMap). Defaults to 0.
+    batch : int
+        Number of candidate windows drawn at once.
+
+    Returns
+    -------
+    random_window_on_mask : generator
+        Generator yielding the (y0, y1, x0, x1) coordinates of the windows.
+    """
+
+    img_h, img_w = image_shape
+
+    if w_size[0] < 2 or w_size[1] < 2:
+        raise ValueError('Window size too small.')
+    if w_size[0] > img_w or w_size[1] > img_h:
+        return
+
+    n_empty = 0
+    while n != 0:
+        rs = rnd.randint(0, img_h-w_size[1]+1, size=batch)
+        cs = rnd.randint(0, img_w-w_size[0]+1, size=batch)
+        f = coverage.coverage(np.c_[cs, rs, np.full_like(cs, w_size[0]), np.full_like(rs, w_size[1])],
+                              level=level)
+        keep = np.flatnonzero(f >= min_coverage)
+        if keep.size == 0:
+            n_empty += 1
+            if n_empty >= 100:
+                raise ValueError('No window with enough foreground found.')
+            continue
+        n_empty = 0
+        for k in keep.tolist():
+            yield (rs[k], rs[k]+w_size[1], cs[k], cs[k]+w_size[0])
+            n -= 1
+            if n == 0:
+                break
+## end random_window_on_mask
+##-
+
 ##-
 ## REGULAR_GRID
 def regular_grid(image_shape, n):
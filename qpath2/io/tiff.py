@@ -0,0 +1,151 @@
+#
+# QPATH2 - a quantitative pathology toolkit
+#
+# (c) 2017 Vlad Popovici
+#
+
+"""IO.TIFF: streaming output of pyramidal, tiled BigTIFF images.
+
+ The image (e.g. a tissue blob or its mask) is written band by band (or
+tile-row by tile-row), top to bottom, without ever being held in memory.
+The lower resolution levels are built on the fly, by successive 2x2
+downsampling. The resulting files can be read by libtiff-based tools and by
+OpenSlide (as generic tiled TIFF), hence by qpath2.core.MRI.
+"""
+
+from __future__ import (absolute_import, division, print_function, unicode_literals)
+
+__all__ = ['BigTiffWriter']
+
+import numpy as np
+
+from qpath2.core import Error
+from qpath2.io.tiled_ import BigTiffWriter as _BigTiffWriter
+
+
+# codes as in tiled_.cxx (TileCodec)
+TIFF_COMPRESSION = {'none': 0, 'raw': 0,
+                    'deflate': 1, 'zlib': 1,
+                    'jpeg': 2}
+
+_TIFF_DEFAULT_QUALITY = {0: 0, 1: 6, 2: 90}
+
+
+##-
+class BigTiffWriter(object):
+    """Streaming writer for pyramidal tiled BigTIFF files.
+
+    Args:
+        file_name (string): output file (overwritten, if it exists)
+        shape (tuple): (height, width[, channels]) of the full resolution image;
+            only 1 or 3 (RGB) channels are supported
+        tile_geom (tuple): (width, height) of the tiles (multiples of 16)
+        compression (string): 'jpeg', 'deflate' or 'none' (see TIFF_COMPRESSION)
+        quality (int, optional): JPEG quality or deflate level (default: 90 and 6,
+            respectively)
+        n_levels (int, optional): number of levels to write (0: until a level fits
+            in a single tile)
+        subifds (bool, optional): store the reduced resolution levels as SubIFDs of
+            the full resolution image, instead of as main IFDs (OpenSlide needs
+            the latter)
+        fill (int, optional): background value; the constant tiles of this value
+            are stored only once (e.g. 0 for masks or masked images)
+        mpp (tuple, optional): (x, y) microns per pixel of the full resolution
+            image, stored as TIFF resolution
+        n_threads (int, optional): number of threads encoding the tiles in
+            parallel (0: one per CPU core)
+
+    Example:
+        with BigTiffWriter('mask.tiff', msk.shape, compression='deflate', fill=0) as w:
+            for y in range(0, msk.shape[0], 512):
+                w.write(255 * msk[y:y+512, :])
+    """
+
+    def __init__(self, file_name, shape, tile_geom=(512, 512), compression='jpeg', quality=None,
+                 n_levels=0, subifds=False, fill=None, mpp=None, n_threads=0):
+        if compression not in TIFF_COMPRESSION:
+            raise Error("unsupported compression: " + compression)
+        codec = TIFF_COMPRESSION[compression]
+        if quality is None:
+            quality = _TIFF_DEFAULT_QUALITY[codec]
+
+        height, width = int(shape[0]), int(shape[1])
+        n_channels = 1 if len(shape) == 2 else int(shape[2])
+
+        if n_levels <= 0:
+            n_levels = 1
+            w, h = width, height
+            while w > tile_geom[0] or h > tile_geom[1]:
+                w, h = (w + 1) // 2, (h + 1) // 2
+                n_levels += 1
+
+        self._file_name = file_name
+        self._shape = (height, width) if n_channels == 1 else (height, width, n_channels)
+        self._tile_geom = tile_geom
+        self._band = None      # tile row being assembled by write_tile()
+        self._next_tile = (0, 0)
+
+        self._writer = _BigTiffWriter()
+        r = self._writer.open(file_name, width, height, n_channels, tile_geom[0], tile_geom[1],
+                              codec, quality, n_levels, subifds, -1 if fill is None else int(fill),
+                              n_threads)
+        if r != 0:
+            raise Error("low-level error in BigTiffWriter.open", code=r)
+        if mpp is not None:
+            self._writer.set_resolution(float(mpp[0]), float(mpp[1]))
+        self._open = True
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        if exc_type is None:
+            self.close()
+        return False
+
+    @property
+    def n_levels(self):
+        return self._writer.n_levels
+
+    def write(self, band):
+        """Append a band of rows (numpy.ndarray, uint8, rows x width[ x channels])."""
+        r = self._writer.write_rows(band)
+        if r != 0:
+            raise Error("low-level error in BigTiffWriter.write", code=r)
+
+    def write_tile(self, i, j, tile):
+        """Write the tile (i, j) (row i, column j of the tile grid, with the right-most
+        and bottom-most tiles possibly smaller). The tiles must be written in
+        row-major order; each completed row of tiles is passed on as a band.
+        """
+        if (i, j) != self._next_tile:
+            raise Error("tiles must be written in row-major order")
+
+        tw, th = self._tile_geom
+        height, width = self._shape[:2]
+        h = min(th, height - i * th)
+        w = min(tw, width - j * tw)
+        if tile.shape[:2] != (h, w):
+            raise Error("unexpected tile shape")
+
+        if self._band is None:
+            self._band = np.empty((h,) + self._shape[1:], dtype=np.uint8)
+        self._band[:, j * tw:j * tw + w, ...] = tile
+
+        if (j + 1) * tw >= width:
+            self.write(self._band)
+            self._band = None
+            self._next_tile = (i + 1, 0)
+        else:
+            self._next_tile = (i, j + 1)
+
+    def close(self):
+        """Write the remaining tiles and the TIFF directories."""
+        if not self._open:
+            return
+        self._open = False
+
+        r = self._writer.close()
+        if r != 0:
+            raise Error("low-level error in BigTiffWriter.close", code=r)
+##-
@@ -13,38 +13,248 @@
               +---- meta.json    <- meta data about the file
               +---- first downsampling level/
                         +---- meta.json
-                        | tile_i_j.ppm...
+                        | tiles.qpt
               +---- second downsampling level/
                         +---- meta.json
-                        | tile_i_j.ppm...
+                        | tiles.qpt
               ...etc...
 
- The image type (here .ppm) can be changed.
+ All the tiles of a level are stored in a single container file (tiles.qpt):
+ a header, a binary index with a fixed-size record (offset, length, ...) for
+ each tile and the encoded tiles, concatenated (see tiled_.cxx). The level's
+ meta.json holds only the global meta-data; the position of each tile follows
+ from the grid geometry and its record is read from the index when needed
+ (see tile_index), so opening a level takes the same time whatever the
+ number of tiles. The tile encoding (jpeg, png, raw,
+ deflate- or LZ4-compressed pixels) can be changed. The containers are
+ memory-mapped when read: 'raw' tiles need no decoding at all and 'lz4' tiles
+ are cheap to decode, which suits images read over and over again (e.g. when
+ training).
+
+ Background tiles can be elided: tiles (almost) entirely equal to a fill value
+ are only recorded in the index (with length 0) and synthesized when read.
 """
 
 from __future__ import (absolute_import, division, print_function, unicode_literals)
 
-__all__ = ['save_tiled_image', 'load_tiled_image']
+__all__ = ['save_tiled_image', 'load_tiled_image', 'tiled_level_complete', 'tile_index',
+           'TiledImage', 'TiledPyramidWriter', 'extract_slide_region']
 
-from math import floor
 import os
 import os.path
-import shutil
 import simplejson as json
 import numpy as np
-from skimage.io import imread, imsave
 
-from qpath2.core import MRIBase
+from qpath2.core import MRIBase, Error
+from qpath2.io.tiled_ import tiled_write_, tiled_read_, tiled_info_, tiled_extract_, TiledReader
+from qpath2.io.tiled_ import TiledPyramidWriter as _PyramidWriter
+
+
+TILE_CONTAINER = 'tiles.qpt'
+
+# tile encodings, as understood by tiled_ (the keys are the image types
+# accepted by save_tiled_image; 'ppm' and 'tiff' are kept for compatibility
+# with the file-per-tile storage and map to raw and deflated pixels)
+TILE_CODECS = {'raw': 0, 'ppm': 0,
+               'zlib': 1, 'tiff': 1,
+               'jpeg': 2, 'jpg': 2,
+               'png': 3,
+               'lz4': 4}
+
+# default quality parameter for each codec (JPEG quality, deflate level or
+# LZ4 acceleration)
+_TILE_CODEC_QUALITY = {0: 0, 1: 6, 2: 90, 3: 6, 4: 1}
+
+# a record of the container's tile index (TileIndexRecord in tiled_.cxx)
+TILE_INDEX_RECORD = np.dtype([('offset', '<u8'), ('length', '<u4'),
+                              ('flags', '<u4'), ('hash', '<u8')])
+
+
+##-
+def _tile_grid(width, height, tile_geom):
+    """Effective tile size and number of tiles of a level."""
+    tg = (min(tile_geom[0], width), min(tile_geom[1], height))
+    nh = width // tg[0] + (1 if width % tg[0] != 0 else 0)
+    nv = height // tg[1] + (1 if height % tg[1] != 0 else 0)
+
+    return tg, nh, nv
+##-
+
+
+##-
+def _level_meta(level, width, height, n_channels, tile_geom, img_type, dst_path, fill=None,
+                downsample_factor=None):
+    """Build (and save in dst_path) the meta-data of a tiled level. The tiles
+    themselves are described by the container's index (see tile_index). The
+    downsample factor (wrt. level 0) defaults to 2**level."""
+    tg, nh, nv = _tile_grid(width, height, tile_geom)
+    if downsample_factor is None:
+        downsample_factor = 2.0**level
+
+    tile_meta = dict({'level': level,
+                      'downsample_factor': float(downsample_factor),
+                      'level_image_width': width,
+                      'level_image_height': height,
+                      'level_image_nchannels': n_channels,
+                      'n_tiles_horiz': nh,
+                      'n_tiles_vert': nv,
+                      'tile_width': tg[0],
+                      'tile_height': tg[1],
+                      'tile_type': img_type,
+                      'tile_fill': fill,
+                      'container': dst_path + os.path.sep + TILE_CONTAINER})
+
+    with open(dst_path + os.path.sep + 'meta.json', 'w') as fp:
+        json.dump(tile_meta, fp, separators=(',', ':'), indent='  ', sort_keys=True)
+
+    return tile_meta
+##-
+
+
+##-
+def _make_level_dir(root, level):
+    dst_path = root + os.path.sep + 'level_{:d}'.format(level)
+    if not os.path.exists(dst_path):
+        os.mkdir(dst_path)
+
+    return dst_path
+##-
+
+
+##-
+class TiledPyramidWriter(object):
+    """Streaming writer for a multi-resolution tiled image. The finest level is
+    pushed in horizontal bands (of any height), top to bottom; each coarser level
+    is obtained by 2x2 box-filter downsampling of the previous one, while its
+    tiles are still in memory, so the whole pyramid is built in a single pass and
+    without holding any full level in memory.
+
+    Existing levels are resumed (see save_tiled_image).
+
+    Args:
+        root (string): root folder of the image storing hierarchy
+        level (int): the level of the finest image; the coarser levels are
+            stored as level+1, level+2, ...
+        shape (tuple): (height, width[, channels]) of the finest level
+        tile_geom (tuple): (width, height) of the tile
+        n_levels (int, optional): number of levels to write (0: until a level
+            fits in a single tile)
+        img_type (string, optional): tile encoding (see TILE_CODECS)
+        n_threads (int, optional): number of threads encoding the tiles in
+            parallel (0: one per CPU core)
+        resume (bool, optional): keep the unchanged tiles of existing levels
+        fill, max_foreground: background tiles elision (see save_tiled_image)
+        downsample_factor (float, optional): downsample factor of the finest
+            level wrt. level 0 (e.g. of the source slide; default: 2**level),
+            doubled for each coarser level
+
+    Example:
+        with TiledPyramidWriter(root, 0, img.shape, (512, 512), n_levels=4) as w:
+            for y in range(0, img.shape[0], 1024):
+                w.write(img[y:y+1024, ...])
+    """
+
+    def __init__(self, root, level, shape, tile_geom, n_levels=0, img_type="jpeg", n_threads=0,
+                 resume=True, fill=None, max_foreground=0.0, downsample_factor=None):
+        if img_type not in TILE_CODECS:
+            raise Error("unsupported tile type: " + img_type)
+        codec = TILE_CODECS[img_type]
+
+        height, width = int(shape[0]), int(shape[1])
+        n_channels = 1 if len(shape) == 2 else int(shape[2])
+
+        if n_levels <= 0:
+            n_levels = 1
+            w, h = width, height
+            while w > tile_geom[0] or h > tile_geom[1]:
+                w, h = (w + 1) // 2, (h + 1) // 2
+                n_levels += 1
+
+        self._root = root
+        self._level = level
+        self._tile_geom = tile_geom
+        self._img_type = img_type
+        self._n_channels = n_channels
+        self._fill = fill
+        self._downsample_factor = 2.0**level if downsample_factor is None else float(downsample_factor)
+        self._sizes = []
+        self._paths = []
+
+        containers = []
+        w, h = width, height
+        for k in range(n_levels):
+            tg, _, _ = _tile_grid(w, h, tile_geom)
+            self._sizes.append((w, h, tg))
+            self._paths.append(_make_level_dir(root, level + k))
+            containers.append(self._paths[-1] + os.path.sep + TILE_CONTAINER)
+            w, h = (w + 1) // 2, (h + 1) // 2
+
+        self._writer = _PyramidWriter()
+        r = self._writer.open(containers, width, height, n_channels,
+                              tile_geom[0], tile_geom[1], codec, _TILE_CODEC_QUALITY[codec],
+                              -1 if fill is None else int(fill), float(max_foreground),
+                              n_threads, resume)
+        if r != 0:
+            raise Error("low-level error in TiledPyramidWriter.open", code=r)
+        self._open = True
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        if exc_type is None:
+            self.close()
+        return False
+
+    def write(self, band):
+        """Append a band of rows (numpy.ndarray, uint8, rows x width[ x channels])
+        to the finest level."""
+        r = self._writer.write_rows(band)
+        if r != 0:
+            raise Error("low-level error in TiledPyramidWriter.write", code=r)
+
+    def close(self):
+        """Flush the remaining tiles and save the meta-data of all levels.
+
+        Returns:
+            list: the meta-data of each level (see save_tiled_image)
+        """
+        if not self._open:
+            return self._meta
+        self._open = False
+
+        r = self._writer.close()
+        if r != 0:
+            raise Error("low-level error in TiledPyramidWriter.close", code=r)
+
+        self._meta = []
+        for k, (w, h, tg) in enumerate(self._sizes):
+            self._meta.append(_level_meta(self._level + k, w, h, self._n_channels, tg,
+                                          self._img_type, self._paths[k], self._fill,
+                                          self._downsample_factor * 2**k))
+
+        return self._meta
+##-
 
 
 ##-
-def save_tiled_image(img, root, level, tile_geom, img_type="jpeg"):
+def save_tiled_image(img, root, level, tile_geom, img_type="jpeg", n_threads=0, n_levels=1,
+                     resume=True, fill=None, max_foreground=0.0, downsample_factor=None):
     """Save an image as a collection of tiles.
 
     The image is split into a set of fixed-sized (with the exception of right-most and
-    bottom-most) tiles.
+    bottom-most) tiles, stored in a single container file.
 
-    *WARNING*: any existing tiles in the path root/level will be deleted!
+    If root/level already contains tiles with the same geometry and encoding (e.g.
+    from a previous, possibly interrupted, run), only the tiles which are missing
+    or whose content changed are encoded and written, the others are kept (the
+    container keeps a hash of each tile's pixels). Use resume=False to rewrite
+    all the tiles.
+
+    If a fill value is given, the background tiles - those with at most a fraction
+    max_foreground of their pixels different from fill - are not stored, but
+    read back as constant tiles (hence, with max_foreground > 0, their few
+    foreground pixels are lost).
 
     Args:
         img (numpy array): an image in OpenCV ordering (BGR). Alpha channel is not
@@ -53,58 +263,158 @@ def save_tiled_image(img, root, level, tile_geom, img_type="jpeg"):
             stored into root/level folder
         level (int): the magnification level
         tile_geom (tuple): (width, height) of the tile
-        img_type (string, optional): file type for the tiles
+        img_type (string, optional): tile encoding (see TILE_CODECS)
+        n_threads (int, optional): number of threads encoding the tiles in
+            parallel (0: one per CPU core)
+        n_levels (int, optional): if different from 1, the coarser levels
+            level+1, level+2, ... are generated as well, by successive 2x2
+            downsampling (0: until a level fits in one tile). See TiledPyramidWriter.
+        resume (bool, optional): keep the unchanged tiles of an existing level
+        fill (int, optional): value (0-255, all channels) of the background; None
+            stores all the tiles
+        max_foreground (float, optional): largest fraction of foreground pixels in a
+            background tile
+        downsample_factor (float, optional): downsample factor of the level wrt.
+            level 0 (e.g. of the source slide), stored in the meta-data (default:
+            2**level)
 
     Returns:
         dict: a dictionary with meta-data about the tiles and original image
     """
     assert(img.ndim == 2 or (img.ndim == 3 and img.shape[2] <= 3))
 
-    n_channels = 1 if img.ndim == 2 else img.shape[2]
-    dst_path = root + os.path.sep + 'level_{:d}'.format(level)
+    if img_type not in TILE_CODECS:
+        raise Error("unsupported tile type: " + img_type)
+    codec = TILE_CODECS[img_type]
 
-    tg = (min(tile_geom[0], img.shape[1]), min(tile_geom[1], img.shape[0]))
-    nh = int(floor(img.shape[1] / tg[0])) + (1 if img.shape[1] % tg[0] != 0 else 0)
-    nv = int(floor(img.shape[0] / tg[1])) + (1 if img.shape[0] % tg[1] != 0 else 0)
+    if n_levels != 1:
+        with TiledPyramidWriter(root, level, img.shape, tile_geom, n_levels=n_levels,
+                                img_type=img_type, n_threads=n_threads, resume=resume,
+                                fill=fill, max_foreground=max_foreground,
+                                downsample_factor=downsample_factor) as w:
+            w.write(img)
+        return w.close()[0]
 
-    tile_meta = dict({'level': level,
-                      'level_image_width': img.shape[1],
-                      'level_image_height': img.shape[0],
-                      'level_image_nchannels': 1 if img.ndim == 2 else img.shape[2],
-                      'n_tiles_horiz': nh,
-                      'n_tiles_vert': nv,
-                      'tile_width': tg[0],
-                      'tile_height': tg[1]})
-
-    if os.path.exists(dst_path):
-        shutil.rmtree(dst_path)
-    os.mkdir(dst_path)
-
-    for i in range(nv):
-        for j in range(nh):
-            i0, j0 = i * tg[1], j * tg[0]
-            i1, j1 = min((i + 1) * tg[1], img.shape[0]), min((j + 1) * tg[0], img.shape[1])
-            if n_channels == 1:
-                im_sub = img[i0:i1, j0:j1]
-            else:
-                im_sub = img[i0:i1, j0:j1, :]
-            tile_meta['tile_' + str(i) + '_' + str(j)] = dict(
-                {'name': dst_path + '/tile_' + str(i) + '_' + str(j) + '.' + img_type,
-                 'i': i, 'j': j,
-                 'x': j0, 'y': i0})
-            imsave(dst_path + os.path.sep + 'tile_' + str(i) + '_' + str(j) + '.' + img_type, im_sub)
+    dst_path = _make_level_dir(root, level)
+    tg, _, _ = _tile_grid(img.shape[1], img.shape[0], tile_geom)
 
-    with open(dst_path + os.path.sep + 'meta.json', 'w') as fp:
-        json.dump(tile_meta, fp, separators=(',', ':'), indent='  ', sort_keys=True)
+    index = []
+    r = tiled_write_(dst_path + os.path.sep + TILE_CONTAINER, img, tg[0], tg[1], codec,
+                     _TILE_CODEC_QUALITY[codec], -1 if fill is None else int(fill),
+                     float(max_foreground), n_threads, resume, index)
+    if r != 0:
+        raise Error("low-level error in tiled_write", code=r)
 
-    return tile_meta
+    return _level_meta(level, img.shape[1], img.shape[0], 1 if img.ndim == 2 else img.shape[2],
+                       tg, img_type, dst_path, fill, downsample_factor)
 ##-end
 
 
+##-
+def extract_slide_region(wsi_file, x0, y0, level, width, height, writers, mask=None,
+                         mask_writers=None, small_mask=None):
+    """Stream a region of a whole slide image (read through OpenSlide) to tiled
+    image writers, without loading it into memory: the region is read one band
+    of tiles at a time, the pixels outside the mask and outside the scanned
+    area (transparent) are set to 0 and the band is passed on to the writers.
+
+    Args:
+        wsi_file (string): whole slide image file
+        x0, y0 (int): top-left corner of the region, in level 0 coordinates
+        level (int): the level to read from
+        width, height (int): size of the region, at the given level
+        writers (list): open TiledPyramidWriter or io.tiff.BigTiffWriter objects,
+            of shape (height, width, 3), receiving the (RGB) image
+        mask (numpy array, optional): a 2D mask (non-zero: keep) covering the
+            region, usually at a lower resolution; it is upscaled (nearest
+            neighbour) on the fly
+        mask_writers (list, optional): open writers, of shape (height, width),
+            receiving the final mask (0/255)
+        small_mask (numpy array, optional): a uint8 array with the shape of mask,
+            receiving the mask restricted to the scanned area
+
+    Returns:
+        nothing; the writers still have to be closed
+    """
+    if mask is not None:
+        mask = np.ascontiguousarray(mask, dtype=np.uint8)
+    if mask is None or small_mask is None:
+        small_mask = None
+    elif small_mask.shape != mask.shape or small_mask.dtype != np.uint8:
+        raise Error("small_mask must be a uint8 array of the same shape as mask")
+
+    r = tiled_extract_(wsi_file, int(x0), int(y0), int(level), int(width), int(height),
+                       mask, small_mask, [w._writer for w in writers],
+                       [w._writer for w in (mask_writers or [])])
+    if r != 0:
+        raise Error("low-level error in tiled_extract", code=r)
+
+    return
+##-
+
+
+##-
+def tiled_level_complete(root, level, tile_geom=None, img_type=None):
+    """Check whether a level of a tiled image has been completely written (i.e.
+    its writing was not interrupted), optionally with the given tile geometry
+    and encoding.
+
+    Args:
+        root (string): root folder of the image storing hierarchy
+        level (int): the magnification level
+        tile_geom (tuple, optional): (width, height) of the tile
+        img_type (string, optional): tile encoding (see TILE_CODECS)
+
+    Returns:
+        bool
+    """
+    dst_path = root + os.path.sep + 'level_{:d}'.format(level)
+    if not os.path.exists(dst_path + os.path.sep + 'meta.json'):
+        return False
+
+    info = dict()
+    if tiled_info_(dst_path + os.path.sep + TILE_CONTAINER, info) != 0 or not info['complete']:
+        return False
+    if img_type is not None and TILE_CODECS.get(img_type) != info['codec']:
+        return False
+    if tile_geom is not None:
+        tg, _, _ = _tile_grid(info['level_image_width'], info['level_image_height'], tile_geom)
+        if tg != (info['tile_width'], info['tile_height']):
+            return False
+
+    return True
+##-
+
+
+##-
+def tile_index(img_meta):
+    """Return the index of the tiles of a level, as a (read-only) memory map of the
+    container's records: an array of shape (n_tiles_vert, n_tiles_horiz) and
+    type TILE_INDEX_RECORD. Tile (i, j) covers the pixels starting at
+    (x, y) = (j * tile_width, i * tile_height); a record with length 0 and the
+    TILE_FILL flag set denotes a background tile (its fill value is in offset).
+
+    Args:
+        img_meta (dict): the meta-data of the level (see save_tiled_image)
+
+    Returns:
+        a numpy.memmap
+    """
+    info = dict()
+    r = tiled_info_(img_meta['container'], info)
+    if r != 0:
+        raise Error("cannot read tile container " + img_meta['container'], code=r)
+
+    return np.memmap(img_meta['container'], dtype=TILE_INDEX_RECORD, mode='r',
+                     offset=info['index_offset'],
+                     shape=(info['n_tiles_vert'], info['n_tiles_horiz']))
+##-
+
+
 ##-
 def load_tiled_image(img_meta):
-    """Load a tiled image. All the information about the tile geometry and tile paths is
-     taken from img_meta.
+    """Load a tiled image. All the information about the tile geometry and the
+    tile container is taken from img_meta.
 
     Args:
         img_meta (dict): a descriptor for the tiled image with at least the following
@@ -112,42 +422,154 @@ def load_tiled_image(img_meta):
                 level_image_width
                 level_image_height
                 level_image_nchannels
-                n_tiles_horiz
-                n_tiles_vert
-            and for each tile, an entry as
-                'tile_i_j' which is a dict with keys:
-                i
-                j
-                name
-                x
-                y
+                container
 
     Returns:
         a numpy.ndarray
     """
-    img_w, img_h = long(img_meta['level_image_width']), long(img_meta['level_image_height'])
-    nh, nv = long(img_meta['n_tiles_horiz']), long(img_meta['n_tiles_vert'])
+    img_w, img_h = int(img_meta['level_image_width']), int(img_meta['level_image_height'])
+    nc = int(img_meta['level_image_nchannels'])
 
-    img = np.zeros((img_h, img_w, 3), dtype=np.uint8)
+    img = np.zeros((img_h, img_w) if nc == 1 else (img_h, img_w, nc), dtype=np.uint8)
 
-    for i in range(nv):
-        for j in range(nh):
-            tile_id = 'tile_'+str(i)+'_'+str(j)
-            tile = imread(img_meta[tile_id]['name']).astype(np.uint8)
-            # the tile might not have the regular default shape, so it's better to use the
-            # tile's shape than 'tile_width' and 'tile_height'
-            x, y = long(img_meta[tile_id]['x']), long(img_meta[tile_id]['y'])
-            img[x:x+tile.width, y:y+tile.height, :] = tile
+    r = tiled_read_(img_meta['container'], img)
+    if r != 0:
+        raise Error("low-level error in tiled_read", code=r)
 
     return img
 ##-
 
 
 ##-
-class TiledImage(object):
-    """A tiled image, loading regions on demand.
+class TiledImage(MRIBase):
+    """A tiled image, loading regions on demand. Only the tiles overlapping a
+    requested region are decoded; decoded tiles are cached (per level), such that
+    successive reads of neighbouring regions are cheap. Levels stored as 'raw'
+    tiles are not decoded (nor cached) at all, being read from a memory map.
+
+    Only the (small) meta.json of each level is read when the image is opened;
+    the container of a level is mapped when first read from.
+
+    The stored levels need not start at 0 (e.g. a tissue blob extracted at
+    level 3 of a slide): info['levels'] is keyed by the level numbers (see
+    levels), while info['level_count'] and nlevels are the number of levels
+    stored.
+
+    Args:
+        path (str): root folder of the tiled image (containing the level_{n}
+            folders, see save_tiled_image)
+        cache_size (long): maximum size (in bytes) of the decoded tiles cache,
+            for each level
 
+    Attributes:
+        see MRIBase
     """
-    def __init__(self, path):
-        pass
-##-
\ No newline at end of file
+
+    def __init__(self, path, cache_size=256*1024*1024):
+        self._path = path
+        self._cache_size = cache_size
+        self._containers = dict()
+        self._readers = dict()
+
+        lv = dict()
+        for d in sorted(os.listdir(path)):
+            if not d.startswith('level_') or \
+                    not os.path.exists(os.path.join(path, d, 'meta.json')):
+                continue
+            with open(os.path.join(path, d, 'meta.json'), 'r') as fp:
+                meta = json.load(fp)
+            level = int(meta['level'])
+            self._containers[level] = os.path.join(path, d, TILE_CONTAINER)
+            lv[level] = {'x_size': int(meta['level_image_width']),
+                         'y_size': int(meta['level_image_height']),
+                         'n_channels': int(meta['level_image_nchannels']),
+                         # not in the meta-data of the levels written before
+                         'downsample_factor': float(meta.get('downsample_factor', 2.0**level)),
+                         'tile_x_size': int(meta['tile_width']),
+                         'tile_y_size': int(meta['tile_height'])}
+
+        if len(lv) == 0:
+            raise Error("no tiled levels found in " + path)
+
+        self._info = {'vendor': 'qpath2-tiled',
+                      'level_count': len(lv),
+                      'levels': lv}
+
+    def _reader(self, level):
+        """The reader of a level, opened on first use."""
+        reader = self._readers.get(level)
+        if reader is None:
+            reader = TiledReader()
+            r = reader.open(self._containers[level], self._cache_size)
+            if r != 0:
+                raise Error("cannot open tiled level {:d}".format(level), code=r)
+            self._readers[level] = reader
+
+        return reader
+
+    @property
+    def info(self):
+        return self._info
+
+    @property
+    def path(self):
+        return self._path
+
+    @property
+    def levels(self):
+        """The magnification levels stored (not necessarily starting at 0)."""
+        return sorted(self._info['levels'].keys())
+
+    @property
+    def nlevels(self):
+        return len(self._info['levels'])
+
+    @property
+    def widths(self):
+        return [self._info['levels'][l]['x_size'] for l in self.levels]
+
+    @property
+    def heights(self):
+        return [self._info['levels'][l]['y_size'] for l in self.levels]
+
+    def get_region_px(self, x0, y0, width, height, level, as_type=np.uint8, copy=True):
+        """Read a region from the tiled image. The region is specified in
+            pixel coordinates. Parts of the region outside the image are
+            set to 0.
+
+            Args:
+                x0, y0 (long): top left corner of the region (in pixels, at the specified
+                level)
+                width, height (long): width and height (in pixels) of the region
+                level (int): the magnification level to read from
+                as_type: type of the pixels (default numpy.uint8)
+                copy (bool): if False, for 'raw' levels and regions lying inside a
+                single tile, a read-only view of the memory-mapped tile is returned
+                (no copy); otherwise a new array
+
+            Returns:
+                a numpy.ndarray
+        """
+        if level not in self._containers:
+            raise Error("requested level does not exist")
+
+        reader = self._reader(level)
+        x0, y0, width, height = [int(_x) for _x in [x0, y0, width, height]]
+
+        if not copy and as_type == np.uint8:
+            img = reader.view(x0, y0, width, height)
+            if img is not None:
+                return img
+
+        nc = reader.n_channels
+        img = np.empty((height, width) if nc == 1 else (height, width, nc), dtype=np.uint8)
+
+        r = reader.read_region(img, x0, y0, width, height)
+        if r != 0:
+            raise Error("low-level error in TiledReader.read_region", code=r)
+
+        return img.astype(as_type, copy=False)
+
+    def get_region(self, x0, y0, width, height, level, as_type=np.uint8):
+        raise Error("Not yet implemented")
+##-
@@ -0,0 +1,2450 @@
+//---------------------------------------------------------------------
+// TILED_.CXX: native tiled image storage (and pyramidal BigTIFF output).
+//
+// A level of a tiled image is stored in a single container file instead
+// of one file per tile. The container has the layout
+//
+//  +----------------------+  offset 0
+//  | TileFileHeader       |  (64 bytes)
+//  +----------------------+  offset header_size
+//  | TileIndexRecord[nt]  |  (24 bytes each, nt = n_tiles_vert x n_tiles_horiz,
+//  |                      |   row-major: record of tile (i,j) is i*n_tiles_horiz+j)
+//  +----------------------+
+//  | encoded tile data... |  (tiles concatenated, in any order)
+//  +----------------------+
+//
+// All integers are stored little-endian. Tiles are split as in the
+// Python implementation: fixed-sized, with the exception of the right-most
+// and bottom-most ones, which may be smaller. Pixels are 8 bit, with 1 to 4
+// interleaved channels.
+//
+// Containers are written append-only: the index is written first and each
+// record is updated as soon as its tile has been appended, while the header
+// is flagged FILE_INCOMPLETE until all the tiles are written. Each record keeps
+// a hash of the tile's pixels, such that an interrupted or repeated write
+// resumes the existing container and re-encodes only the tiles which are
+// missing or whose content changed (see ContainerWriter).
+//
+// Background tiles may be elided (sparse containers): a tile with (almost)
+// all its pixels equal to a fill value is not stored, its record is flagged
+// TILE_FILL and holds the fill value (in the offset field, length 0) and the
+// readers synthesize it.
+//
+// Containers are read through a memory map: raw tiles are used in place
+// (a region read is a strided copy from the map, or no copy at all when the
+// region lies inside a single tile, see TiledReader.view) and LZ4 tiles are
+// decompressed directly from the map.
+//
+// Author: Vlad Popovici
+//---------------------------------------------------------------------
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#include <boost/python.hpp>
+#include <numpy/ndarrayobject.h>
+#include <stdint.h>
+#include <algorithm>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <jpeglib.h>
+#include <lz4.h>
+#include <openslide.h>
+#include <png.h>
+#include <zlib.h>
+
+namespace bp = boost::python;
+
+
+enum TileCodec {
+    CODEC_RAW  = 0,     // uncompressed pixels
+    CODEC_ZLIB = 1,     // deflate-compressed pixels
+    CODEC_JPEG = 2,
+    CODEC_PNG  = 3,
+    CODEC_LZ4  = 4,     // LZ4-compressed pixels (fast decoding)
+    // not used in containers:
+    CODEC_JPEG_RGB = 5  // JPEG without colour transform (TIFF, RGB photometric)
+};
+
+enum TileFlags {
+    TILE_PRESENT = 1,   // the tile's data has been written
+    TILE_HASHED  = 2,   // the record holds the hash of the tile's pixels
+    TILE_FILL    = 4    // constant tile (fill value in offset), no data stored
+};
+
+enum FileFlags {
+    FILE_INCOMPLETE = 1 // not all the tiles have been written (yet)
+};
+
+static const char TILE_FILE_MAGIC[8] = {'Q', 'P', 'T', 'I', 'L', 'E', 'S', '\0'};
+static const uint32_t TILE_FILE_VERSION = 1;
+
+struct TileFileHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t width;             // level image width and height (pixels)
+    uint64_t height;
+    uint32_t n_channels;
+    uint32_t tile_width;
+    uint32_t tile_height;
+    uint32_t n_tiles_horiz;
+    uint32_t n_tiles_vert;
+    uint32_t codec;
+    uint32_t quality;           // JPEG quality, deflate level or LZ4 acceleration
+    uint32_t flags;             // FileFlags
+};
+
+struct TileIndexRecord
+{
+    uint64_t offset;            // position of the encoded tile in the file
+    uint32_t length;            // size of the encoded tile
+    uint32_t flags;             // TileFlags
+    uint64_t hash;              // hash of the raw tile pixels (see tile_hash)
+};
+
+static_assert(sizeof(TileFileHeader) == 64, "unexpected TileFileHeader layout");
+static_assert(sizeof(TileIndexRecord) == 24, "unexpected TileIndexRecord layout");
+
+
+// TILE_GEOMETRY
+// Position and size of tile (i,j) in the level image.
+struct TileGeometry
+{
+    uint64_t x, y;
+    uint32_t width, height;
+
+    TileGeometry(const TileFileHeader& hdr, uint32_t i, uint32_t j)
+    {
+        x = uint64_t(j) * hdr.tile_width;
+        y = uint64_t(i) * hdr.tile_height;
+        width = static_cast<uint32_t>(std::min<uint64_t>(hdr.tile_width, hdr.width - x));
+        height = static_cast<uint32_t>(std::min<uint64_t>(hdr.tile_height, hdr.height - y));
+    }
+};
+
+
+//-- low-level file I/O -----------------------------------------------
+
+static bool write_all(int fd, const void* buf, std::size_t len, off_t offset)
+{
+    const char* p = static_cast<const char*>(buf);
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void* buf, std::size_t len, off_t offset)
+{
+    char* p = static_cast<char*>(buf);
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+
+//-- codecs -----------------------------------------------------------
+//
+// Encoders read a tile from a strided source (stride = bytes between the
+// starts of two consecutive rows), such that tiles can be encoded directly
+// from the full image, without copying. Decoders write into a strided
+// destination.
+
+struct JpegErrorManager
+{
+    jpeg_error_mgr pub;
+    jmp_buf jmp;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+    JpegErrorManager* err = reinterpret_cast<JpegErrorManager*>(cinfo->err);
+    longjmp(err->jmp, 1);
+}
+
+static bool encode_jpeg(const uint8_t* src, std::size_t stride,
+                        uint32_t w, uint32_t h, uint32_t c, int quality, bool ycc,
+                        std::vector<uint8_t>& out)
+{
+    if (c != 1 && c != 3) return false;
+
+    jpeg_compress_struct cinfo;
+    JpegErrorManager jerr;
+    unsigned char* mem = 0;
+    unsigned long mem_size = 0;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    if (setjmp(jerr.jmp)) {
+        jpeg_destroy_compress(&cinfo);
+        std::free(mem);
+        return false;
+    }
+
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &mem, &mem_size);
+    cinfo.image_width = w;
+    cinfo.image_height = h;
+    cinfo.input_components = c;
+    cinfo.in_color_space = c == 1 ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    if (c == 3 && !ycc)
+        jpeg_set_colorspace(&cinfo, JCS_RGB);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = const_cast<JSAMPROW>(src + cinfo.next_scanline * stride);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+
+    out.assign(mem, mem + mem_size);
+    jpeg_destroy_compress(&cinfo);
+    std::free(mem);
+
+    return true;
+}
+
+static bool decode_jpeg(const uint8_t* data, std::size_t len,
+                        uint32_t w, uint32_t h, uint32_t c,
+                        uint8_t* dst, std::size_t stride)
+{
+    jpeg_decompress_struct dinfo;
+    JpegErrorManager jerr;
+
+    dinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    if (setjmp(jerr.jmp)) {
+        jpeg_destroy_decompress(&dinfo);
+        return false;
+    }
+
+    jpeg_create_decompress(&dinfo);
+    jpeg_mem_src(&dinfo, const_cast<unsigned char*>(data), len);
+    jpeg_read_header(&dinfo, TRUE);
+    dinfo.out_color_space = c == 1 ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_start_decompress(&dinfo);
+    if (dinfo.output_width != w || dinfo.output_height != h ||
+        dinfo.output_components != static_cast<int>(c)) {
+        jpeg_destroy_decompress(&dinfo);
+        return false;
+    }
+    while (dinfo.output_scanline < dinfo.output_height) {
+        JSAMPROW row = dst + dinfo.output_scanline * stride;
+        jpeg_read_scanlines(&dinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&dinfo);
+    jpeg_destroy_decompress(&dinfo);
+
+    return true;
+}
+
+static const int PNG_COLOR_TYPES[] = {0, PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA,
+                                      PNG_COLOR_TYPE_RGB, PNG_COLOR_TYPE_RGB_ALPHA};
+
+struct PngMemoryReader
+{
+    const uint8_t* data;
+    std::size_t len, pos;
+};
+
+static void png_write_to_vector(png_structp png, png_bytep data, png_size_t len)
+{
+    std::vector<uint8_t>* out = static_cast<std::vector<uint8_t>*>(png_get_io_ptr(png));
+    out->insert(out->end(), data, data + len);
+}
+
+static void png_flush_nothing(png_structp)
+{
+}
+
+static void png_read_from_memory(png_structp png, png_bytep data, png_size_t len)
+{
+    PngMemoryReader* r = static_cast<PngMemoryReader*>(png_get_io_ptr(png));
+    if (r->pos + len > r->len)
+        png_error(png, "truncated tile");
+    std::memcpy(data, r->data + r->pos, len);
+    r->pos += len;
+}
+
+static bool encode_png(const uint8_t* src, std::size_t stride,
+                       uint32_t w, uint32_t h, uint32_t c, int level,
+                       std::vector<uint8_t>& out)
+{
+    if (c < 1 || c > 4) return false;
+
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
+    if (!png) return false;
+    png_infop info = png_create_info_struct(png);
+    if (!info) {
+        png_destroy_write_struct(&png, 0);
+        return false;
+    }
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        return false;
+    }
+
+    out.clear();
+    png_set_write_fn(png, &out, png_write_to_vector, png_flush_nothing);
+    png_set_compression_level(png, level);
+    png_set_IHDR(png, info, w, h, 8, PNG_COLOR_TYPES[c], PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+    for (uint32_t y = 0; y < h; ++y)
+        png_write_row(png, const_cast<png_bytep>(src + y * stride));
+    png_write_end(png, 0);
+    png_destroy_write_struct(&png, &info);
+
+    return true;
+}
+
+static bool decode_png(const uint8_t* data, std::size_t len,
+                       uint32_t w, uint32_t h, uint32_t c,
+                       uint8_t* dst, std::size_t stride)
+{
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
+    if (!png) return false;
+    png_infop info = png_create_info_struct(png);
+    if (!info) {
+        png_destroy_read_struct(&png, 0, 0);
+        return false;
+    }
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, 0);
+        return false;
+    }
+
+    PngMemoryReader reader = {data, len, 0};
+    png_set_read_fn(png, &reader, png_read_from_memory);
+    png_read_info(png, info);
+    if (png_get_image_width(png, info) != w || png_get_image_height(png, info) != h ||
+        png_get_bit_depth(png, info) != 8 || png_get_channels(png, info) != c) {
+        png_destroy_read_struct(&png, &info, 0);
+        return false;
+    }
+    for (uint32_t y = 0; y < h; ++y)
+        png_read_row(png, dst + y * stride, 0);
+    png_destroy_read_struct(&png, &info, 0);
+
+    return true;
+}
+
+static bool encode_tile(const uint8_t* src, std::size_t stride,
+                        uint32_t w, uint32_t h, uint32_t c,
+                        int codec, int quality, std::vector<uint8_t>& out)
+{
+    std::size_t row = std::size_t(w) * c;
+
+    switch (codec) {
+        case CODEC_RAW:
+            out.resize(row * h);
+            for (uint32_t y = 0; y < h; ++y)
+                std::memcpy(&out[y * row], src + y * stride, row);
+            return true;
+        case CODEC_ZLIB: {
+            std::vector<uint8_t> raw(row * h);
+            for (uint32_t y = 0; y < h; ++y)
+                std::memcpy(&raw[y * row], src + y * stride, row);
+            uLongf n = compressBound(raw.size());
+            out.resize(n);
+            if (compress2(&out[0], &n, &raw[0], raw.size(), quality) != Z_OK)
+                return false;
+            out.resize(n);
+            return true;
+        }
+        case CODEC_LZ4: {
+            std::vector<uint8_t> raw(row * h);
+            for (uint32_t y = 0; y < h; ++y)
+                std::memcpy(&raw[y * row], src + y * stride, row);
+            out.resize(LZ4_compressBound(static_cast<int>(raw.size())));
+            int n = LZ4_compress_fast((const char*)&raw[0], (char*)&out[0],
+                                      static_cast<int>(raw.size()), static_cast<int>(out.size()),
+                                      std::max(quality, 1));
+            if (n <= 0)
+                return false;
+            out.resize(n);
+            return true;
+        }
+        case CODEC_JPEG:
+        case CODEC_JPEG_RGB:
+            return encode_jpeg(src, stride, w, h, c, quality, codec == CODEC_JPEG, out);
+        case CODEC_PNG:
+            return encode_png(src, stride, w, h, c, quality, out);
+        default:
+            return false;
+    }
+}
+
+static bool decode_tile(const uint8_t* data, std::size_t len, int codec,
+                        uint32_t w, uint32_t h, uint32_t c,
+                        uint8_t* dst, std::size_t stride)
+{
+    std::size_t row = std::size_t(w) * c;
+
+    switch (codec) {
+        case CODEC_RAW:
+            if (len != row * h) return false;
+            for (uint32_t y = 0; y < h; ++y)
+                std::memcpy(dst + y * stride, data + y * row, row);
+            return true;
+        case CODEC_ZLIB: {
+            std::vector<uint8_t> raw(row * h);
+            uLongf n = raw.size();
+            if (uncompress(&raw[0], &n, data, len) != Z_OK || n != raw.size())
+                return false;
+            for (uint32_t y = 0; y < h; ++y)
+                std::memcpy(dst + y * stride, &raw[y * row], row);
+            return true;
+        }
+        case CODEC_LZ4: {
+            if (stride == row) {
+                return LZ4_decompress_safe((const char*)data, (char*)dst, static_cast<int>(len),
+                                           static_cast<int>(row * h)) == static_cast<int>(row * h);
+            }
+            std::vector<uint8_t> raw(row * h);
+            if (LZ4_decompress_safe((const char*)data, (char*)&raw[0], static_cast<int>(len),
+                                    static_cast<int>(raw.size())) != static_cast<int>(raw.size()))
+                return false;
+            for (uint32_t y = 0; y < h; ++y)
+                std::memcpy(dst + y * stride, &raw[y * row], row);
+            return true;
+        }
+        case CODEC_JPEG:
+        case CODEC_JPEG_RGB:
+            return decode_jpeg(data, len, w, h, c, dst, stride);
+        case CODEC_PNG:
+            return decode_png(data, len, w, h, c, dst, stride);
+        default:
+            return false;
+    }
+}
+
+
+//-- parallel encoding ------------------------------------------------
+
+// A tile to be encoded: pointer to its top-left pixel in a strided buffer.
+struct TileSource
+{
+    const uint8_t* pixels;
+    std::size_t stride;
+    uint32_t width, height;
+};
+
+// TILE_HASH
+// 64-bit hash (MurmurHash64A, chained over rows) of the pixels of a tile.
+static uint64_t tile_hash(const TileSource& t, uint32_t c)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    const std::size_t len = std::size_t(t.width) * c;
+    uint64_t h = 0x5170a7ed5170a7edULL ^ (uint64_t(t.width) << 32 | t.height);
+
+    for (uint32_t y = 0; y < t.height; ++y) {
+        const uint8_t* p = t.pixels + y * t.stride;
+        h ^= len * m;
+        std::size_t n = len / 8;
+        for (std::size_t i = 0; i < n; ++i) {
+            uint64_t k;
+            std::memcpy(&k, p + 8 * i, 8);
+            k *= m;
+            k ^= k >> r;
+            k *= m;
+            h ^= k;
+            h *= m;
+        }
+        const uint8_t* tail = p + 8 * n;
+        switch (len & 7) {
+            case 7: h ^= uint64_t(tail[6]) << 48;
+                    // fall through
+            case 6: h ^= uint64_t(tail[5]) << 40;
+                    // fall through
+            case 5: h ^= uint64_t(tail[4]) << 32;
+                    // fall through
+            case 4: h ^= uint64_t(tail[3]) << 24;
+                    // fall through
+            case 3: h ^= uint64_t(tail[2]) << 16;
+                    // fall through
+            case 2: h ^= uint64_t(tail[1]) << 8;
+                    // fall through
+            case 1: h ^= uint64_t(tail[0]);
+                    h *= m;
+        }
+        h ^= h >> r;
+        h *= m;
+        h ^= h >> r;
+    }
+
+    return h;
+}
+
+// TILE_FILL_PARAMS
+// Which tiles are elided: the ones with at most max_foreground x (number of
+// pixels) pixels differing from value in any channel (0: only the constant
+// tiles). value < 0 disables the elision.
+struct TileFillParams
+{
+    int value;
+    double max_foreground;
+
+    // mixed into the tile hashes, such that a change of the parameters
+    // invalidates the stored tiles
+    uint64_t key() const
+    {
+        if (value < 0)
+            return 0;
+        uint64_t f;
+        std::memcpy(&f, &max_foreground, sizeof(f));
+        return (0x9e3779b97f4a7c15ULL * (uint64_t(value) + 1)) ^ (f * 0xc2b2ae3d27d4eb4fULL);
+    }
+};
+
+static const TileFillParams NO_TILE_FILL = {-1, 0.0};
+
+static bool is_fill_tile(const TileSource& t, uint32_t c, const TileFillParams& fill)
+{
+    if (fill.value < 0)
+        return false;
+
+    const uint8_t v = static_cast<uint8_t>(fill.value);
+    const uint64_t max_fg = static_cast<uint64_t>(fill.max_foreground * t.width * t.height);
+    const std::size_t len = std::size_t(t.width) * c;
+    uint64_t fg = 0;
+
+    for (uint32_t y = 0; y < t.height; ++y) {
+        const uint8_t* p = t.pixels + y * t.stride;
+        if (c == 1) {
+            for (std::size_t x = 0; x < len; ++x)
+                fg += p[x] != v;
+        } else {
+            for (std::size_t x = 0; x < len; x += c) {
+                bool diff = false;
+                for (uint32_t ch = 0; ch < c; ++ch)
+                    diff |= p[x + ch] != v;
+                fg += diff;
+            }
+        }
+        if (fg > max_fg)
+            return false;
+    }
+
+    return true;
+}
+
+// Encode a tile, or leave buf empty if it is a fill tile.
+static bool encode_or_fill(const TileSource& t, uint32_t c, int codec, int quality,
+                           const TileFillParams& fill, std::vector<uint8_t>& buf)
+{
+    if (is_fill_tile(t, c, fill)) {
+        buf.clear();
+        return true;
+    }
+    return encode_tile(t.pixels, t.stride, t.width, t.height, c, codec, quality, buf);
+}
+
+typedef std::function<TileSource (std::size_t)> TileSourceFn;
+// reuse(k, hash): true if the stored tile k has the same pixels (it is not
+// encoded again)
+typedef std::function<bool (std::size_t, uint64_t)> TileReuseFn;
+// store(k, hash, buf): buf is the encoded tile, empty for a fill tile or null
+// for a reused tile
+typedef std::function<bool (std::size_t, uint64_t, const std::vector<uint8_t>*)> TileStoreFn;
+
+
+// ENCODE_TILES
+// Encode n tiles on a pool of worker threads and pass the encoded tiles to
+// store() in the calling thread, in order (k = 0, 1, ..., n-1), such that the
+// output is identical to the one of a sequential encoder. At most 2 x n_threads
+// encoded tiles wait to be stored, which bounds the memory use independently
+// of the image size. n_threads = 0 uses all available cores. The calling thread
+// does not touch Python objects, so the GIL may be released around this call.
+// The workers hash each tile and skip the encoding of the tiles for which
+// reuse() (called from the workers) returns true, or which are fill tiles.
+//
+// Returns:
+//  0: success
+// -4: encoding error
+// -5: store() failed
+//
+int encode_tiles(std::size_t n, const TileSourceFn& tile, uint32_t c,
+                 int codec, int quality, const TileFillParams& fill, unsigned n_threads,
+                 const TileReuseFn& reuse, const TileStoreFn& store)
+{
+    const uint64_t key = fill.key();
+
+    if (n_threads == 0)
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<uint8_t> buf;
+
+    if (n_threads == 1 || n < 2) {
+        for (std::size_t k = 0; k < n; ++k) {
+            TileSource t = tile(k);
+            uint64_t h = tile_hash(t, c) ^ key;
+            if (reuse(k, h)) {
+                if (!store(k, h, 0))
+                    return -5;
+                continue;
+            }
+            if (!encode_or_fill(t, c, codec, quality, fill, buf))
+                return -4;
+            if (!store(k, h, &buf))
+                return -5;
+        }
+        return 0;
+    }
+
+    const std::size_t cap = 2 * n_threads;     // slots for encoded tiles
+    std::vector<std::vector<uint8_t> > slots(cap);
+    std::vector<uint64_t> hashes(cap, 0);
+    std::vector<char> reused(cap, 0);
+    std::vector<char> ready(cap, 0);
+    std::size_t next = 0;                       // next tile to encode
+    std::size_t stored = 0;                     // next tile to store
+    int status = 0;
+    std::mutex m;
+    std::condition_variable can_encode, can_store;
+
+    std::function<void ()> worker = [&]() {
+        std::vector<uint8_t> enc;
+        for (;;) {
+            std::size_t k;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                can_encode.wait(lock, [&]() {
+                    return status != 0 || next >= n || next < stored + cap; });
+                if (status != 0 || next >= n)
+                    return;
+                k = next++;
+            }
+
+            TileSource t = tile(k);
+            uint64_t h = tile_hash(t, c) ^ key;
+            bool skip = reuse(k, h);
+            bool ok = skip || encode_or_fill(t, c, codec, quality, fill, enc);
+            {
+                std::lock_guard<std::mutex> lock(m);
+                if (ok) {
+                    if (!skip)
+                        slots[k % cap].swap(enc);
+                    hashes[k % cap] = h;
+                    reused[k % cap] = skip;
+                    ready[k % cap] = 1;
+                } else if (status == 0) {
+                    status = -4;
+                }
+            }
+            can_store.notify_one();
+            if (!ok) {
+                can_encode.notify_all();
+                return;
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < n_threads; ++t)
+        pool.push_back(std::thread(worker));
+
+    while (stored < n) {
+        uint64_t h;
+        bool skip;
+        {
+            std::unique_lock<std::mutex> lock(m);
+            can_store.wait(lock, [&]() { return status != 0 || ready[stored % cap]; });
+            if (status != 0)
+                break;
+            buf.swap(slots[stored % cap]);
+            h = hashes[stored % cap];
+            skip = reused[stored % cap];
+            ready[stored % cap] = 0;
+        }
+        bool ok = store(stored, h, skip ? 0 : &buf);
+        {
+            std::lock_guard<std::mutex> lock(m);
+            if (ok)
+                ++stored;
+            else if (status == 0)
+                status = -5;
+        }
+        can_encode.notify_all();
+        if (!ok)
+            break;
+    }
+
+    for (std::size_t t = 0; t < pool.size(); ++t)
+        pool[t].join();
+
+    return status;
+}
+
+
+//-- container ----------------------------------------------------------
+
+static bool read_header(int fd, TileFileHeader& hdr)
+{
+    if (!read_all(fd, &hdr, sizeof(hdr), 0)) return false;
+    if (std::memcmp(hdr.magic, TILE_FILE_MAGIC, sizeof(hdr.magic)) != 0) return false;
+    if (hdr.version != TILE_FILE_VERSION || hdr.header_size < sizeof(hdr)) return false;
+    if (hdr.n_channels < 1 || hdr.n_channels > 4) return false;
+
+    return true;
+}
+
+static bool read_index(int fd, const TileFileHeader& hdr, std::vector<TileIndexRecord>& index)
+{
+    index.resize(std::size_t(hdr.n_tiles_horiz) * hdr.n_tiles_vert);
+    return index.empty() ||
+        read_all(fd, &index[0], index.size() * sizeof(TileIndexRecord), hdr.header_size);
+}
+
+
+// TILE_SINK
+// Destination of the encoded tiles of an image level (see PyramidCascade):
+// a container (ContainerWriter) or a level of a TIFF file (TiffLevelWriter).
+class TileSink
+{
+public:
+    virtual ~TileSink() {}
+
+    // geometry and encoding of the level
+    virtual const TileFileHeader& header() const = 0;
+    // true if the tiles at the right and bottom edges must be padded to the
+    // full tile size (as in TIFF)
+    virtual bool full_tiles() const { return false; }
+    // see ContainerWriter
+    virtual bool unchanged(std::size_t k, uint64_t hash) const = 0;
+    virtual bool store(std::size_t k, uint64_t hash, const std::vector<uint8_t>* buf) = 0;
+    virtual int finish(bool complete = true) = 0;
+};
+
+
+// CONTAINER_WRITER
+// Creates (or resumes) a container and appends encoded tiles to it. The
+// header, flagged FILE_INCOMPLETE, and the index are written first; each
+// record is rewritten once its tile has been appended and the flag is cleared
+// by finish(), such that an interrupted write leaves a container whose
+// present tiles are all valid.
+//
+// When resuming, an existing container with the same geometry, codec and
+// quality is kept: store() is told (via unchanged()) which tiles have the
+// same pixels as the stored ones and does not write these again. The data
+// of the replaced tiles is not reclaimed; a fresh write (resume = false)
+// compacts the file.
+class ContainerWriter : public TileSink
+{
+public:
+    TileFileHeader hdr;
+    std::vector<TileIndexRecord> records;
+    std::size_t n_reused;               // tiles kept from a previous write
+    std::size_t n_filled;               // fill tiles written
+    int fill_value;                     // value of the fill tiles (see TileFillParams)
+
+    ContainerWriter() : n_reused(0), n_filled(0), fill_value(-1), fd(-1), offset(0)
+    {
+        std::memset(&hdr, 0, sizeof(hdr));
+    }
+
+    ~ContainerWriter()
+    {
+        if (fd >= 0) ::close(fd);
+    }
+
+    const TileFileHeader& header() const { return hdr; }
+
+    // CREATE
+    // Returns 0 on success, -2 if the file cannot be created and -3 for an
+    // invalid tile geometry, number of channels or codec.
+    int create(const std::string& filename, uint64_t width, uint64_t height, uint32_t n_channels,
+               uint32_t tile_width, uint32_t tile_height, int codec, int quality,
+               bool resume = false)
+    {
+        std::memcpy(hdr.magic, TILE_FILE_MAGIC, sizeof(hdr.magic));
+        hdr.version = TILE_FILE_VERSION;
+        hdr.header_size = sizeof(hdr);
+        hdr.width = width;
+        hdr.height = height;
+        hdr.n_channels = n_channels;
+        hdr.tile_width = static_cast<uint32_t>(std::min<uint64_t>(tile_width, width));
+        hdr.tile_height = static_cast<uint32_t>(std::min<uint64_t>(tile_height, height));
+        hdr.codec = codec;
+        hdr.quality = quality;
+        hdr.flags = FILE_INCOMPLETE;
+        n_reused = 0;
+        n_filled = 0;
+
+        if (hdr.tile_width == 0 || hdr.tile_height == 0 ||
+            n_channels < 1 || n_channels > 4 ||
+            codec < CODEC_RAW || codec > CODEC_LZ4)
+            return -3;
+        hdr.n_tiles_horiz = static_cast<uint32_t>((width + hdr.tile_width - 1) / hdr.tile_width);
+        hdr.n_tiles_vert = static_cast<uint32_t>((height + hdr.tile_height - 1) / hdr.tile_height);
+
+        if (resume && reopen(filename))
+            return write_all(fd, &hdr, sizeof(hdr), 0) ? 0 : -2;
+
+        fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return -2;
+
+        TileIndexRecord empty;
+        std::memset(&empty, 0, sizeof(empty));
+        records.assign(std::size_t(hdr.n_tiles_horiz) * hdr.n_tiles_vert, empty);
+        offset = hdr.header_size + records.size() * sizeof(TileIndexRecord);
+
+        if (!write_all(fd, &hdr, sizeof(hdr), 0) ||
+            (!records.empty() &&
+             !write_all(fd, &records[0], records.size() * sizeof(TileIndexRecord), hdr.header_size)))
+            return -2;
+
+        return 0;
+    }
+
+    // UNCHANGED
+    // True if the stored tile k has the given hash. Safe to call from the
+    // encoding threads (store() never touches a record before its tile has
+    // been hashed).
+    bool unchanged(std::size_t k, uint64_t hash) const
+    {
+        const TileIndexRecord& r = records[k];
+        return (r.flags & (TILE_PRESENT | TILE_HASHED)) == (TILE_PRESENT | TILE_HASHED) &&
+            r.hash == hash;
+    }
+
+    // STORE
+    // Append the encoded tile k (row-major index) and update its record, or
+    // just count it if it is reused (buf == 0). An empty buf is a fill tile
+    // (with the value fill_value): only its record is written.
+    bool store(std::size_t k, uint64_t hash, const std::vector<uint8_t>* buf)
+    {
+        if (!buf) {
+            ++n_reused;
+            return true;
+        }
+        if (buf->empty()) {
+            records[k].offset = static_cast<uint64_t>(std::max(fill_value, 0));
+            records[k].length = 0;
+            records[k].flags = TILE_PRESENT | TILE_HASHED | TILE_FILL;
+            ++n_filled;
+        } else {
+            if (!write_all(fd, &(*buf)[0], buf->size(), offset))
+                return false;
+            records[k].offset = offset;
+            records[k].length = static_cast<uint32_t>(buf->size());
+            records[k].flags = TILE_PRESENT | TILE_HASHED;
+            offset += buf->size();
+        }
+        records[k].hash = hash;
+        return write_all(fd, &records[k], sizeof(TileIndexRecord),
+                         hdr.header_size + k * sizeof(TileIndexRecord));
+    }
+
+    // FINISH
+    // Mark the container as complete (unless complete is false, e.g. after an
+    // error) and close the file. Returns 0 on success and -5 on write errors.
+    int finish(bool complete = true)
+    {
+        if (!complete) {
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+            return 0;
+        }
+        hdr.flags &= ~FILE_INCOMPLETE;
+        bool ok = fd >= 0 && fdatasync(fd) == 0 &&      // tiles and index before the flag
+            write_all(fd, &hdr, sizeof(hdr), 0);
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        return ok ? 0 : -5;
+    }
+
+    // Tile (offset, length) pairs as a (n_tiles x 2) int64 numpy.ndarray
+    // ((0, 0) for fill tiles).
+    PyObject* index_array() const
+    {
+        npy_intp dims[2] = {static_cast<npy_intp>(records.size()), 2};
+        PyObject* idx = PyArray_SimpleNew(2, dims, NPY_INT64);
+        npy_int64* p = (npy_int64*)PyArray_DATA((PyArrayObject*)idx);
+        for (std::size_t k = 0; k < records.size(); ++k) {
+            bool filled = (records[k].flags & TILE_FILL) != 0;
+            *p++ = filled ? 0 : static_cast<npy_int64>(records[k].offset);
+            *p++ = static_cast<npy_int64>(records[k].length);
+        }
+        return idx;
+    }
+
+    TileSource tile_in(const uint8_t* pixels, std::size_t stride, std::size_t k) const
+    {
+        TileGeometry g(hdr, k / hdr.n_tiles_horiz, k % hdr.n_tiles_horiz);
+        TileSource t = {pixels + g.y * stride + g.x * hdr.n_channels, stride, g.width, g.height};
+        return t;
+    }
+
+private:
+    // Open an existing container for appending, if it matches hdr.
+    bool reopen(const std::string& filename)
+    {
+        fd = ::open(filename.c_str(), O_RDWR);
+        if (fd < 0)
+            return false;
+
+        TileFileHeader old;
+        struct stat st;
+        if (!read_header(fd, old) || fstat(fd, &st) != 0 ||
+            old.header_size != hdr.header_size ||
+            old.width != hdr.width || old.height != hdr.height ||
+            old.n_channels != hdr.n_channels ||
+            old.tile_width != hdr.tile_width || old.tile_height != hdr.tile_height ||
+            old.codec != hdr.codec || old.quality != hdr.quality ||
+            !read_index(fd, old, records)) {
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+        offset = std::max<uint64_t>(st.st_size,
+                                    hdr.header_size + records.size() * sizeof(TileIndexRecord));
+
+        return true;
+    }
+
+    int fd;
+    uint64_t offset;
+};
+
+
+// TILED_WRITE
+// Split an image into tiles and store them, encoded, in a container file.
+// Any existing file is overwritten, unless resume is true and the file is a
+// container with the same tile geometry and encoding: then only the tiles
+// missing from it or with different pixels are encoded and appended.
+//
+// Args:
+//  filename (string)
+//  img (PyObject): numpy.ndarray (height x width [x channels]), uint8, at most
+//      4 channels (only 1 or 3 channels for JPEG)
+//  tile_width, tile_height (unsigned): tile geometry; clipped to image size
+//  codec (int): one of TileCodec
+//  quality (int): JPEG quality (1-100), deflate level (0-9) for ZLIB and PNG or
+//      acceleration (>= 1) for LZ4
+//  fill (int): fill value (0-255) of the background tiles, which are not
+//      stored; -1: store all the tiles
+//  max_foreground (double): fraction of the pixels of a tile that may differ
+//      from fill for the tile to be considered background (see TileFillParams)
+//  n_threads (unsigned): number of encoding threads (0: one per core)
+//  resume (bool): reuse the tiles of an existing container
+//  index (list): receives a (n_tiles x 2) int64 numpy.ndarray with the offset and
+//      the length of each tile in the container (row-major tile order), the
+//      number of tiles reused and the number of fill tiles
+//
+// Returns:
+//  0: success
+// -1: cannot access buffer (not an uint8 array with 2 or 3 dimensions)
+// -2: cannot open file
+// -3: invalid tile geometry, number of channels or codec
+// -4: encoding error
+// -5: write error
+//
+int tiled_write(const std::string& filename, PyObject* img,
+                unsigned tile_width, unsigned tile_height,
+                int codec, int quality, int fill, double max_foreground,
+                unsigned n_threads, bool resume, bp::list index)
+{
+    PyArrayObject* src = (PyArrayObject*)PyArray_FROMANY(img, NPY_UINT8, 2, 3,
+                                                         NPY_ARRAY_IN_ARRAY);
+    if (!src) {
+        // cannot access buffer
+        PyErr_Clear();
+        return -1;
+    }
+
+    uint32_t n_channels = PyArray_NDIM(src) == 2 ? 1 : static_cast<uint32_t>(PyArray_DIM(src, 2));
+    ContainerWriter out;
+    int res = out.create(filename, PyArray_DIM(src, 1), PyArray_DIM(src, 0), n_channels,
+                         tile_width, tile_height, codec, quality, resume);
+    if (res != 0) {
+        Py_DECREF(src);
+        return res;
+    }
+    TileFillParams fp = {std::min(fill, 255), max_foreground};
+    out.fill_value = fp.value;
+
+    // tiles are encoded straight from the image buffer (no copies), in parallel,
+    // and appended to the file in row-major order
+    const uint8_t* pixels = (const uint8_t*)PyArray_DATA(src);
+    const std::size_t stride = std::size_t(out.hdr.width) * n_channels;
+    TileSourceFn tile = [&](std::size_t k) { return out.tile_in(pixels, stride, k); };
+    TileReuseFn reuse = [&](std::size_t k, uint64_t h) { return out.unchanged(k, h); };
+    TileStoreFn store = [&](std::size_t k, uint64_t h, const std::vector<uint8_t>* buf) {
+        return out.store(k, h, buf);
+    };
+
+    Py_BEGIN_ALLOW_THREADS
+    res = encode_tiles(out.records.size(), tile, n_channels, codec, quality, fp, n_threads,
+                       reuse, store);
+    Py_END_ALLOW_THREADS
+    Py_DECREF(src);
+
+    if (res == 0)
+        res = out.finish();
+    if (res != 0)
+        return res;
+
+    index.append(bp::object(bp::handle<>(out.index_array())));
+    index.append(out.n_reused);
+    index.append(out.n_filled);
+
+    return 0;
+}
+
+
+// PYRAMID_CASCADE
+// Builds a multi-resolution tiled image in a single pass over the rows of the
+// finest level: the image is pushed in horizontal bands of any height, each
+// level collects the rows of its current tile row in a strip buffer and, once
+// the strip is complete, encodes its tiles (in parallel), passes them to the
+// level's sink and passes the strip, downsampled by 2x2 box filtering, to the
+// next level. Hence each coarser level is built from the finer tiles while
+// they are still in memory (nothing is read back or decoded) and the memory
+// use is bounded by one strip per level.
+// Level k has the size ceil(width / 2^k) x ceil(height / 2^k) (as given by
+// the headers of the sinks); at odd edges the missing pixels are replaced by
+// their neighbours. The sinks are not owned.
+class PyramidCascade
+{
+public:
+    PyramidCascade() : n_threads(0), fill(NO_TILE_FILL) {}
+
+    void init(const std::vector<TileSink*>& sinks, const TileFillParams& fill, unsigned n_threads)
+    {
+        this->fill = fill;
+        this->n_threads = n_threads;
+        levels.assign(sinks.size(), Level());
+        for (std::size_t k = 0; k < sinks.size(); ++k) {
+            Level& L = levels[k];
+            const TileFileHeader& hdr = sinks[k]->header();
+            L.out = sinks[k];
+            L.row_size = std::size_t(hdr.width) * hdr.n_channels;
+            // padded strips are wide enough for full tiles; the padding stays 0
+            L.stride = L.out->full_tiles() ?
+                std::size_t(hdr.n_tiles_horiz) * hdr.tile_width * hdr.n_channels : L.row_size;
+            L.strip.assign(L.stride * hdr.tile_height, 0);
+            L.pending.resize(((hdr.width + 1) / 2) * hdr.n_channels);
+        }
+    }
+
+    bool empty() const { return levels.empty(); }
+
+    // Push n rows of the finest level (row_size bytes each, contiguous). Does
+    // not touch Python objects. Returns 0 or the error code of encode_tiles
+    // (-4, -5), or -6 if there are too many rows.
+    int push_rows(const uint8_t* rows, std::size_t n)
+    {
+        int res = 0;
+        for (std::size_t r = 0; r < n && res == 0; ++r)
+            res = push_row(0, rows + r * levels[0].row_size);
+        return res;
+    }
+
+    // Flush the pending (odd) rows of all levels. Returns 0, the error code of
+    // encode_tiles or -6 if the image is incomplete.
+    int flush()
+    {
+        int res = 0;
+        for (std::size_t k = 0; k < levels.size() && res == 0; ++k) {
+            Level& L = levels[k];
+            if (L.rows_done != L.out->header().height)
+                return -6;
+            if (L.has_pending && k + 1 < levels.size()) {
+                // last (odd) row of the level: no row below to average with
+                std::vector<uint8_t>& row = levels[k + 1].row;
+                row.resize(L.pending.size());
+                for (std::size_t x = 0; x < L.pending.size(); ++x)
+                    row[x] = static_cast<uint8_t>((L.pending[x] + 1) >> 1);
+                L.has_pending = false;
+                res = push_row(k + 1, &row[0]);
+            }
+        }
+        return res;
+    }
+
+private:
+    struct Level
+    {
+        TileSink* out;
+        std::size_t row_size;           // bytes per row
+        std::size_t stride;             // bytes per strip row (>= row_size)
+        std::vector<uint8_t> strip;     // rows of the current tile row
+        uint32_t strip_rows;            // rows currently in the strip
+        uint32_t tile_row;              // index of the current tile row
+        uint64_t rows_done;             // rows received so far
+        std::vector<uint16_t> pending;  // horizontal pair sums of an unpaired row
+        bool has_pending;
+        std::vector<uint8_t> row;       // downsampled row, passed to this level
+
+        Level() : out(0), row_size(0), stride(0), strip_rows(0), tile_row(0), rows_done(0),
+                  has_pending(false) {}
+    };
+
+    int push_row(std::size_t k, const uint8_t* row)
+    {
+        Level& L = levels[k];
+        const TileFileHeader& hdr = L.out->header();
+        if (L.rows_done >= hdr.height)
+            return -6;
+
+        std::memcpy(&L.strip[L.strip_rows * L.stride], row, L.row_size);
+        ++L.strip_rows;
+        ++L.rows_done;
+
+        uint64_t y0 = uint64_t(L.tile_row) * hdr.tile_height;
+        if (L.strip_rows < std::min<uint64_t>(hdr.tile_height, hdr.height - y0))
+            return 0;
+
+        return flush_strip(k);
+    }
+
+    int flush_strip(std::size_t k)
+    {
+        Level& L = levels[k];
+        const TileFileHeader& hdr = L.out->header();
+        const uint8_t* strip = &L.strip[0];
+        const std::size_t first = std::size_t(L.tile_row) * hdr.n_tiles_horiz;
+        const std::size_t stride = L.stride;
+        const bool full = L.out->full_tiles();
+        TileSink* out = L.out;
+
+        if (full && L.strip_rows < hdr.tile_height)     // bottom padding
+            std::memset(&L.strip[L.strip_rows * stride], 0,
+                        (hdr.tile_height - L.strip_rows) * stride);
+
+        // the strip is the tile row: tile k of the level is tile k - first of the strip
+        TileSourceFn tile = [&](std::size_t t) {
+            TileGeometry g(hdr, 0, static_cast<uint32_t>(t));
+            TileSource s = {strip + g.x * hdr.n_channels, stride,
+                            full ? hdr.tile_width : g.width,
+                            full ? hdr.tile_height : L.strip_rows};
+            return s;
+        };
+        TileReuseFn reuse = [&](std::size_t t, uint64_t h) { return out->unchanged(first + t, h); };
+        TileStoreFn store = [&](std::size_t t, uint64_t h, const std::vector<uint8_t>* buf) {
+            return out->store(first + t, h, buf);
+        };
+        int res = encode_tiles(hdr.n_tiles_horiz, tile, hdr.n_channels, hdr.codec,
+                               hdr.quality, fill, n_threads, reuse, store);
+        if (res != 0)
+            return res;
+
+        uint32_t n_rows = L.strip_rows;
+        L.strip_rows = 0;
+        ++L.tile_row;
+
+        if (k + 1 < levels.size())
+            for (uint32_t r = 0; r < n_rows && res == 0; ++r)
+                res = downsample_row(k, &L.strip[r * stride]);
+
+        return res;
+    }
+
+    // DOWNSAMPLE_ROW
+    // 2x2 box filter: horizontal pair sums are kept until the row below
+    // arrives, then the averaged row is pushed to the next level.
+    int downsample_row(std::size_t k, const uint8_t* row)
+    {
+        Level& L = levels[k];
+        const uint32_t c = L.out->header().n_channels;
+        const uint64_t w = L.out->header().width;
+        const uint64_t w2 = (w + 1) / 2;
+
+        if (!L.has_pending) {
+            for (uint64_t x = 0; x < w2; ++x) {
+                const uint8_t* a = row + 2 * x * c;
+                const uint8_t* b = 2 * x + 1 < w ? a + c : a;
+                for (uint32_t ch = 0; ch < c; ++ch)
+                    L.pending[x * c + ch] = uint16_t(a[ch]) + b[ch];
+            }
+            L.has_pending = true;
+            return 0;
+        }
+
+        std::vector<uint8_t>& out = levels[k + 1].row;
+        out.resize(w2 * c);
+        for (uint64_t x = 0; x < w2; ++x) {
+            const uint8_t* a = row + 2 * x * c;
+            const uint8_t* b = 2 * x + 1 < w ? a + c : a;
+            for (uint32_t ch = 0; ch < c; ++ch)
+                out[x * c + ch] = static_cast<uint8_t>(
+                    (L.pending[x * c + ch] + a[ch] + b[ch] + 2) >> 2);
+        }
+        L.has_pending = false;
+
+        return push_row(k + 1, &out[0]);
+    }
+
+    std::vector<Level> levels;
+    unsigned n_threads;
+    TileFillParams fill;
+};
+
+
+// Check a band of rows (numpy.ndarray, rows x width [x channels], uint8)
+// against the finest level of a pyramid and push it (releasing the GIL).
+// Returns 0, -1 if the buffer cannot be accessed or its shape does not match,
+// or the error codes of PyramidCascade::push_rows.
+static int push_band(PyramidCascade& cascade, const TileFileHeader& hdr, PyObject* band)
+{
+    PyArrayObject* src = (PyArrayObject*)PyArray_FROMANY(band, NPY_UINT8, 2, 3,
+                                                         NPY_ARRAY_IN_ARRAY);
+    if (!src) {
+        PyErr_Clear();
+        return -1;
+    }
+    uint32_t c = PyArray_NDIM(src) == 2 ? 1 : static_cast<uint32_t>(PyArray_DIM(src, 2));
+    if (static_cast<uint64_t>(PyArray_DIM(src, 1)) != hdr.width || c != hdr.n_channels) {
+        Py_DECREF(src);
+        return -1;
+    }
+
+    const uint8_t* rows = (const uint8_t*)PyArray_DATA(src);
+    std::size_t n = PyArray_DIM(src, 0);
+    int res;
+
+    Py_BEGIN_ALLOW_THREADS
+    res = cascade.push_rows(rows, n);
+    Py_END_ALLOW_THREADS
+    Py_DECREF(src);
+
+    return res;
+}
+
+
+// ROW_SINK
+// An image written row by row, top to bottom (a TiledPyramidWriter or a
+// BigTiffWriter), as seen from native code (see tiled_extract).
+class RowSink
+{
+public:
+    virtual ~RowSink() {}
+
+    // geometry of the (full resolution) image; valid while open
+    virtual bool is_open() const = 0;
+    virtual const TileFileHeader& image_header() const = 0;
+    // Push n contiguous rows. Does not touch Python objects. Returns the
+    // same codes as write_rows.
+    virtual int push_rows(const uint8_t* rows, std::size_t n) = 0;
+};
+
+
+// TILED_PYRAMID_WRITER
+// Writes a multi-resolution tiled image, one container per level, in a single
+// pass (see PyramidCascade).
+class TiledPyramidWriter : public RowSink
+{
+public:
+    TiledPyramidWriter() : status(0) {}
+
+    // OPEN
+    // Create the containers, one per level, finest first.
+    //
+    // Args:
+    //  filenames (list of strings): the container of each level
+    //  width, height (unsigned long): size of the finest level
+    //  n_channels (unsigned): 1 to 4 (1 or 3 for JPEG)
+    //  tile_width, tile_height (unsigned)
+    //  codec, quality (int): see tiled_write
+    //  fill, max_foreground: background tiles elision (see tiled_write)
+    //  n_threads (unsigned): number of encoding threads (0: one per core)
+    //  resume (bool): reuse the unchanged tiles of existing containers (see
+    //      tiled_write)
+    //
+    // Returns:
+    //  0: success
+    // -2: cannot create a file
+    // -3: invalid geometry, number of channels or codec
+    int open(bp::list filenames, unsigned long width, unsigned long height, unsigned n_channels,
+             unsigned tile_width, unsigned tile_height, int codec, int quality,
+             int fill, double max_foreground, unsigned n_threads, bool resume)
+    {
+        levels.clear();
+        status = 0;
+
+        TileFillParams fp = {std::min(fill, 255), max_foreground};
+        std::vector<TileSink*> sinks;
+        uint64_t w = width, h = height;
+        for (long k = 0; k < bp::len(filenames); ++k) {
+            levels.push_back(std::unique_ptr<ContainerWriter>(new ContainerWriter()));
+            std::string fname = bp::extract<std::string>(filenames[k]);
+            int res = levels.back()->create(fname, w, h, n_channels, tile_width, tile_height,
+                                            codec, quality, resume);
+            if (res != 0) {
+                levels.clear();
+                return res;
+            }
+            levels.back()->fill_value = fp.value;
+            sinks.push_back(levels.back().get());
+            w = (w + 1) / 2;
+            h = (h + 1) / 2;
+        }
+        if (levels.empty())
+            return -3;
+        cascade.init(sinks, fp, n_threads);
+
+        return 0;
+    }
+
+    // WRITE_ROWS
+    // Append a band of rows (numpy.ndarray, rows x width [x channels], uint8)
+    // to the finest level.
+    //
+    // Returns:
+    //  0: success
+    // -1: cannot access buffer or band shape mismatch
+    // -3: writer not open
+    // -4: encoding error
+    // -5: write error
+    // -6: too many rows
+    int write_rows(PyObject* band)
+    {
+        if (levels.empty())
+            return -3;
+        if (status != 0)
+            return status;
+
+        status = push_band(cascade, levels[0]->hdr, band);
+        return status;
+    }
+
+    bool is_open() const { return !levels.empty() && status == 0; }
+    const TileFileHeader& image_header() const { return levels[0]->hdr; }
+
+    int push_rows(const uint8_t* rows, std::size_t n)
+    {
+        if (levels.empty())
+            return -3;
+        if (status == 0)
+            status = cascade.push_rows(rows, n);
+        return status;
+    }
+
+    // CLOSE
+    // Flush the pending rows of all levels and finalize the containers.
+    //
+    // Returns:
+    //  0: success
+    // -3: writer not open
+    // -4, -5: encoding or write error
+    // -6: the image is incomplete (fewer rows than its height were written)
+    int close()
+    {
+        if (levels.empty())
+            return -3;
+
+        int res = status != 0 ? status : cascade.flush();
+        for (std::size_t k = 0; k < levels.size(); ++k) {
+            int r = levels[k]->finish(res == 0);
+            if (res == 0) res = r;
+        }
+        status = res != 0 ? res : -3;   // no more writes
+
+        return res;
+    }
+
+    // INDEX
+    // (offset, length) of the tiles of a level, as a (n_tiles x 2) int64 array.
+    bp::object index(unsigned level) const
+    {
+        if (level >= levels.size())
+            return bp::object();
+        return bp::object(bp::handle<>(levels[level]->index_array()));
+    }
+
+    // Number of tiles of a level kept from a previous write.
+    unsigned long n_reused(unsigned level) const
+    {
+        return level < levels.size() ? levels[level]->n_reused : 0;
+    }
+
+    // Number of fill tiles of a level.
+    unsigned long n_filled(unsigned level) const
+    {
+        return level < levels.size() ? levels[level]->n_filled : 0;
+    }
+
+    unsigned n_levels() const { return static_cast<unsigned>(levels.size()); }
+
+private:
+    std::vector<std::unique_ptr<ContainerWriter> > levels;
+    PyramidCascade cascade;
+    int status;
+};
+
+
+//-- BigTIFF ----------------------------------------------------------
+//
+// Pyramidal, tiled BigTIFF output, readable by libtiff and OpenSlide (as a
+// generic tiled TIFF, hence MRI as well). The tiles of all the levels are
+// appended to the file as they are produced (by a PyramidCascade) and the
+// directories (IFDs) are written at the end. The levels are, by default,
+// chained as the main IFDs (level 0 first), which is what OpenSlide expects;
+// optionally, the reduced levels are stored as SubIFDs of the first one.
+// Edge tiles are padded with zeros to the full tile size.
+
+enum TiffType {
+    TIFF_ASCII    = 2,
+    TIFF_SHORT    = 3,
+    TIFF_LONG     = 4,
+    TIFF_RATIONAL = 5,
+    TIFF_LONG8    = 16,
+    TIFF_IFD8     = 18
+};
+
+static const std::size_t TIFF_TYPE_SIZE[] = {0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8, 4, 0, 0, 8, 8, 8};
+
+
+// BIG_TIFF_FILE
+// Append-only output file, with a BigTIFF header.
+class BigTiffFile
+{
+public:
+    BigTiffFile() : fd(-1), offset(0) {}
+
+    ~BigTiffFile()
+    {
+        if (fd >= 0) ::close(fd);
+    }
+
+    bool create(const std::string& filename)
+    {
+        // byte order, version 43, offsets size 8, first IFD (set by close())
+        static const uint8_t header[16] = {'I', 'I', 43, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+        fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || !write_all(fd, header, sizeof(header), 0))
+            return false;
+        offset = sizeof(header);
+        return true;
+    }
+
+    // Append data (word aligned), returning its offset in at.
+    bool append(const void* data, std::size_t len, uint64_t& at)
+    {
+        offset += offset & 1;
+        at = offset;
+        if (len > 0 && !write_all(fd, data, len, offset))
+            return false;
+        offset += len;
+        return true;
+    }
+
+    // Write the first IFD offset and close the file.
+    bool close(uint64_t first_ifd)
+    {
+        bool ok = fd >= 0 && write_all(fd, &first_ifd, sizeof(first_ifd), 8);
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        return ok;
+    }
+
+private:
+    int fd;
+    uint64_t offset;
+};
+
+
+// TIFF_IFD
+// An image file directory, collecting its entries (sorted by tag when
+// written). Values not fitting in an entry are appended to the file first.
+class TiffIfd
+{
+public:
+    TiffIfd(BigTiffFile& file) : file(file), ok(true) {}
+
+    void add(uint16_t tag, uint16_t type, uint64_t count, const void* values)
+    {
+        Entry e;
+        std::size_t size = TIFF_TYPE_SIZE[type] * count;
+        e.tag = tag;
+        e.type = type;
+        e.count = count;
+        std::memset(e.value, 0, sizeof(e.value));
+        if (size <= sizeof(e.value)) {
+            std::memcpy(e.value, values, size);
+        } else {
+            uint64_t at = 0;
+            ok = ok && file.append(values, size, at);
+            std::memcpy(e.value, &at, sizeof(at));
+        }
+        entries.push_back(e);
+    }
+
+    void add_short(uint16_t tag, uint16_t v) { add(tag, TIFF_SHORT, 1, &v); }
+    void add_long(uint16_t tag, uint32_t v) { add(tag, TIFF_LONG, 1, &v); }
+
+    // Write the IFD, linked to the next one; returns false on write errors.
+    bool write(uint64_t next, uint64_t& at)
+    {
+        std::sort(entries.begin(), entries.end(),
+                  [](const Entry& a, const Entry& b) { return a.tag < b.tag; });
+        std::vector<uint8_t> buf(8 + 20 * entries.size() + 8);
+        uint64_t n = entries.size();
+        std::memcpy(&buf[0], &n, 8);
+        for (std::size_t i = 0; i < entries.size(); ++i) {
+            uint8_t* p = &buf[8 + 20 * i];
+            std::memcpy(p, &entries[i].tag, 2);
+            std::memcpy(p + 2, &entries[i].type, 2);
+            std::memcpy(p + 4, &entries[i].count, 8);
+            std::memcpy(p + 12, entries[i].value, 8);
+        }
+        std::memcpy(&buf[buf.size() - 8], &next, 8);
+
+        return ok && file.append(&buf[0], buf.size(), at);
+    }
+
+private:
+    struct Entry
+    {
+        uint16_t tag, type;
+        uint64_t count;
+        uint8_t value[8];
+    };
+
+    BigTiffFile& file;
+    std::vector<Entry> entries;
+    bool ok;
+};
+
+
+// TIFF_LEVEL_WRITER
+// Sink for the tiles of one level of a BigTIFF file: the tiles are appended
+// to the file and their offsets and sizes are kept for the level's IFD. All
+// fill tiles (see TileFillParams) share the same data.
+class TiffLevelWriter : public TileSink
+{
+public:
+    TileFileHeader hdr;
+    std::vector<uint64_t> offsets, counts;
+    int fill_value;
+
+    TiffLevelWriter(BigTiffFile& file, uint64_t width, uint64_t height, uint32_t n_channels,
+                    uint32_t tile_width, uint32_t tile_height, int codec, int quality)
+        : fill_value(-1), file(file), fill_offset(0), fill_count(0)
+    {
+        std::memset(&hdr, 0, sizeof(hdr));
+        hdr.width = width;
+        hdr.height = height;
+        hdr.n_channels = n_channels;
+        hdr.tile_width = tile_width;
+        hdr.tile_height = tile_height;
+        hdr.n_tiles_horiz = static_cast<uint32_t>((width + tile_width - 1) / tile_width);
+        hdr.n_tiles_vert = static_cast<uint32_t>((height + tile_height - 1) / tile_height);
+        hdr.codec = codec;
+        hdr.quality = quality;
+        offsets.assign(std::size_t(hdr.n_tiles_horiz) * hdr.n_tiles_vert, 0);
+        counts.assign(offsets.size(), 0);
+    }
+
+    const TileFileHeader& header() const { return hdr; }
+    bool full_tiles() const { return true; }
+    bool unchanged(std::size_t, uint64_t) const { return false; }
+    int finish(bool) { return 0; }     // see BigTiffWriter::close
+
+    bool store(std::size_t k, uint64_t, const std::vector<uint8_t>* buf)
+    {
+        if (buf && buf->empty()) {
+            if (fill_count == 0) {
+                // encode the fill tile once
+                std::vector<uint8_t> pixels(std::size_t(hdr.tile_width) * hdr.tile_height * hdr.n_channels,
+                                            static_cast<uint8_t>(fill_value));
+                std::vector<uint8_t> enc;
+                if (!encode_tile(&pixels[0], std::size_t(hdr.tile_width) * hdr.n_channels,
+                                 hdr.tile_width, hdr.tile_height, hdr.n_channels,
+                                 hdr.codec, hdr.quality, enc) ||
+                    !file.append(&enc[0], enc.size(), fill_offset))
+                    return false;
+                fill_count = enc.size();
+            }
+            offsets[k] = fill_offset;
+            counts[k] = fill_count;
+            return true;
+        }
+        if (!buf || !file.append(&(*buf)[0], buf->size(), offsets[k]))
+            return false;
+        counts[k] = buf->size();
+        return true;
+    }
+
+    // Write the IFD of the level.
+    //
+    // Args:
+    //  reduced: not the full resolution image (NewSubfileType)
+    //  mpp_x, mpp_y: microns per pixel at this level (0: not set)
+    //  subifds: the SubIFDs of this IFD (or 0)
+    //  next: offset of the next IFD in the chain (0: last)
+    bool write_ifd(bool reduced, double mpp_x, double mpp_y,
+                   const std::vector<uint64_t>* subifds, uint64_t next, uint64_t& at)
+    {
+        TiffIfd ifd(file);
+        const uint32_t c = hdr.n_channels;
+        std::vector<uint16_t> bits(c, 8);
+        static const char software[] = "qpath2";
+
+        ifd.add_long(254, reduced ? 1 : 0);                         // NewSubfileType
+        ifd.add_long(256, static_cast<uint32_t>(hdr.width));        // ImageWidth
+        ifd.add_long(257, static_cast<uint32_t>(hdr.height));       // ImageLength
+        ifd.add(258, TIFF_SHORT, c, &bits[0]);                      // BitsPerSample
+        ifd.add_short(259, hdr.codec == CODEC_RAW ? 1 :             // Compression
+                           hdr.codec == CODEC_ZLIB ? 8 : 7);
+        ifd.add_short(262, c == 1 ? 1 : 2);                         // Photometric
+        ifd.add_short(277, static_cast<uint16_t>(c));               // SamplesPerPixel
+        ifd.add_short(284, 1);                                      // PlanarConfiguration
+        ifd.add(305, TIFF_ASCII, sizeof(software), software);       // Software
+        ifd.add_long(322, hdr.tile_width);                          // TileWidth
+        ifd.add_long(323, hdr.tile_height);                         // TileLength
+        ifd.add(324, TIFF_LONG8, offsets.size(), &offsets[0]);      // TileOffsets
+        ifd.add(325, TIFF_LONG8, counts.size(), &counts[0]);        // TileByteCounts
+        if (mpp_x > 0 && mpp_y > 0) {
+            // pixels per centimeter
+            uint32_t xres[2] = {static_cast<uint32_t>(1e4 / mpp_x * 1000 + 0.5), 1000};
+            uint32_t yres[2] = {static_cast<uint32_t>(1e4 / mpp_y * 1000 + 0.5), 1000};
+            ifd.add(282, TIFF_RATIONAL, 1, xres);                   // XResolution
+            ifd.add(283, TIFF_RATIONAL, 1, yres);                   // YResolution
+            ifd.add_short(296, 3);                                  // ResolutionUnit
+        }
+        if (subifds && !subifds->empty())
+            ifd.add(330, TIFF_IFD8, subifds->size(), &(*subifds)[0]);  // SubIFDs
+
+        return ifd.write(next, at);
+    }
+
+private:
+    BigTiffFile& file;
+    uint64_t fill_offset, fill_count;
+};
+
+
+// BIG_TIFF_WRITER
+// Streaming writer of a pyramidal tiled BigTIFF file: the full resolution
+// image is pushed in bands of rows and the reduced levels are built on the fly
+// (see PyramidCascade), such that no level is ever held in memory.
+class BigTiffWriter : public RowSink
+{
+public:
+    BigTiffWriter() : subifds(false), mpp_x(0), mpp_y(0), status(-3) {}
+
+    // OPEN
+    // Create the file.
+    //
+    // Args:
+    //  filename (string)
+    //  width, height (unsigned long): size of the full resolution image
+    //  n_channels (unsigned): 1 or 3
+    //  tile_width, tile_height (unsigned): multiples of 16
+    //  codec (int): CODEC_RAW, CODEC_ZLIB (deflate) or CODEC_JPEG
+    //  quality (int): JPEG quality or deflate level
+    //  n_levels (unsigned): number of levels (>= 1)
+    //  subifds (bool): store the reduced levels as SubIFDs of the first one,
+    //      instead of chaining them (as OpenSlide expects)
+    //  fill (int): if >= 0, the constant tiles of this value share their data
+    //  n_threads (unsigned): number of encoding threads (0: one per core)
+    //
+    // Returns:
+    //  0: success
+    // -2: cannot create the file
+    // -3: invalid geometry, number of channels or codec
+    int open(const std::string& filename, unsigned long width, unsigned long height,
+             unsigned n_channels, unsigned tile_width, unsigned tile_height, int codec,
+             int quality, unsigned n_levels, bool subifds, int fill, unsigned n_threads)
+    {
+        levels.clear();
+        status = -3;
+        if (width == 0 || height == 0 || (n_channels != 1 && n_channels != 3) ||
+            tile_width == 0 || tile_height == 0 || tile_width % 16 != 0 || tile_height % 16 != 0 ||
+            (codec != CODEC_RAW && codec != CODEC_ZLIB && codec != CODEC_JPEG) || n_levels == 0)
+            return -3;
+        // JPEG tiles are RGB, without colour transform (Photometric RGB)
+        if (codec == CODEC_JPEG)
+            codec = CODEC_JPEG_RGB;
+
+        file.reset(new BigTiffFile());
+        if (!file->create(filename)) {
+            file.reset();
+            return -2;
+        }
+
+        TileFillParams fp = {std::min(fill, 255), 0.0};
+        std::vector<TileSink*> sinks;
+        uint64_t w = width, h = height;
+        for (unsigned k = 0; k < n_levels; ++k) {
+            levels.push_back(std::unique_ptr<TiffLevelWriter>(
+                new TiffLevelWriter(*file, w, h, n_channels, tile_width, tile_height, codec, quality)));
+            levels.back()->fill_value = fp.value;
+            sinks.push_back(levels.back().get());
+            w = (w + 1) / 2;
+            h = (h + 1) / 2;
+        }
+        cascade.init(sinks, fp, n_threads);
+        this->subifds = subifds;
+        status = 0;
+
+        return 0;
+    }
+
+    // Resolution of the full resolution image, in microns per pixel.
+    void set_resolution(double mpp_x, double mpp_y)
+    {
+        this->mpp_x = mpp_x;
+        this->mpp_y = mpp_y;
+    }
+
+    // WRITE_ROWS
+    // Append a band of rows (numpy.ndarray, rows x width [x channels], uint8).
+    //
+    // Returns:
+    //  0: success
+    // -1: cannot access buffer or band shape mismatch
+    // -3: writer not open
+    // -4: encoding error
+    // -5: write error
+    // -6: too many rows
+    int write_rows(PyObject* band)
+    {
+        if (status != 0)
+            return status;
+
+        status = push_band(cascade, levels[0]->hdr, band);
+        return status;
+    }
+
+    bool is_open() const { return status == 0; }
+    const TileFileHeader& image_header() const { return levels[0]->hdr; }
+
+    int push_rows(const uint8_t* rows, std::size_t n)
+    {
+        if (status == 0)
+            status = cascade.push_rows(rows, n);
+        return status;
+    }
+
+    // CLOSE
+    // Flush the pending rows, write the directories and close the file.
+    //
+    // Returns:
+    //  0: success
+    // -3: writer not open
+    // -4, -5: encoding or write error
+    // -6: the image is incomplete (fewer rows than its height were written)
+    int close()
+    {
+        if (!file)
+            return -3;
+
+        int res = status != 0 ? status : cascade.flush();
+        uint64_t first = 0;
+
+        if (res == 0) {
+            // IFDs are written from the last level up, such that each one
+            // knows the offset of the next one
+            std::vector<uint64_t> sub;
+            uint64_t next = 0;
+            for (std::size_t k = levels.size() - 1; k > 0 && res == 0; --k) {
+                double f = double(1 << k);
+                uint64_t at;
+                if (!levels[k]->write_ifd(true, mpp_x * f, mpp_y * f, 0,
+                                          subifds ? 0 : next, at))
+                    res = -5;
+                next = at;
+                sub.insert(sub.begin(), at);
+            }
+            if (res == 0 &&
+                !levels[0]->write_ifd(false, mpp_x, mpp_y, subifds ? &sub : 0,
+                                      subifds ? 0 : next, first))
+                res = -5;
+        }
+        // an incomplete file has no IFD, hence it is not a valid TIFF
+        if (!file->close(res == 0 ? first : 0) && res == 0)
+            res = -5;
+        file.reset();
+        status = res != 0 ? res : -3;   // no more writes
+
+        return res;
+    }
+
+    unsigned n_levels() const { return static_cast<unsigned>(levels.size()); }
+
+private:
+    std::unique_ptr<BigTiffFile> file;
+    std::vector<std::unique_ptr<TiffLevelWriter> > levels;
+    PyramidCascade cascade;
+    bool subifds;
+    double mpp_x, mpp_y;
+    int status;
+};
+
+
+//-- slide extraction --------------------------------------------------
+
+// NN_INDEX
+// Nearest neighbour resampling map from n_src to n_dst samples (as in
+// skimage.transform.resize with order=0): dst i <- src (i + 1/2) n_src / n_dst.
+static std::vector<uint32_t> nn_index(uint64_t n_dst, uint64_t n_src)
+{
+    std::vector<uint32_t> idx(n_dst);
+    for (uint64_t i = 0; i < n_dst; ++i)
+        idx[i] = static_cast<uint32_t>(std::min((2 * i + 1) * n_src / (2 * n_dst), n_src - 1));
+    return idx;
+}
+
+static bool get_row_sinks(bp::list objs, std::vector<RowSink*>& sinks)
+{
+    for (long k = 0; k < bp::len(objs); ++k) {
+        bp::extract<TiledPyramidWriter&> tw(objs[k]);
+        bp::extract<BigTiffWriter&> bw(objs[k]);
+        if (tw.check())
+            sinks.push_back(&tw());
+        else if (bw.check())
+            sinks.push_back(&bw());
+        else
+            return false;
+        if (!sinks.back()->is_open())
+            return false;
+    }
+    return true;
+}
+
+
+// TILED_EXTRACT
+// Extract a region of a whole slide image (read through OpenSlide) straight
+// to tiled outputs, applying a (low resolution) mask on the fly. The region is
+// read in bands of one tile row, converted from OpenSlide's premultiplied ARGB
+// to RGB and the pixels outside the mask (upscaled by nearest neighbour) or
+// transparent (alpha = 0, outside the scanned area) are set to 0. The bands
+// are pushed to the image writers (RGB) and, as 0/255 masks, to the mask
+// writers. Hence the memory use is bounded by a few bands, independently of
+// the region size, and no intermediate image file is needed.
+//
+// Args:
+//  filename (string): whole slide image
+//  x, y (long): top-left corner of the region, in level 0 coordinates
+//  level (unsigned): the level to read from
+//  width, height (unsigned long): size of the region (at the given level)
+//  mask (PyObject): numpy.ndarray (uint8, 2D) with the mask (non-zero: keep)
+//      covering the region at lower resolution, or None
+//  small_mask (PyObject): None or a PRE-ALLOCATED, C-contiguous uint8 array,
+//      of the same shape as mask, receiving the mask and-ed with the slide's
+//      alpha channel, sampled at the mask resolution
+//  img_writers (list): open TiledPyramidWriter/BigTiffWriter objects for the
+//      RGB image (width x height x 3)
+//  mask_writers (list): open writers for the (width x height) mask
+//
+// Returns:
+//  0: success
+// -1: cannot access buffer (mask or small_mask)
+// -2: cannot open file
+// -3: invalid level or writer (closed, or of different geometry)
+// -4: encoding error
+// -5: write error
+// -6: too many rows for a writer
+// -7: OpenSlide read error
+//
+int tiled_extract(const std::string& filename, long x, long y, unsigned level,
+                  unsigned long width, unsigned long height,
+                  PyObject* mask, PyObject* small_mask,
+                  bp::list img_writers, bp::list mask_writers)
+{
+    std::vector<RowSink*> img_out, msk_out;
+    if (!get_row_sinks(img_writers, img_out) || !get_row_sinks(mask_writers, msk_out))
+        return -3;
+    for (std::size_t k = 0; k < img_out.size(); ++k) {
+        const TileFileHeader& h = img_out[k]->image_header();
+        if (h.width != width || h.height != height || h.n_channels != 3)
+            return -3;
+    }
+    for (std::size_t k = 0; k < msk_out.size(); ++k) {
+        const TileFileHeader& h = msk_out[k]->image_header();
+        if (h.width != width || h.height != height || h.n_channels != 1)
+            return -3;
+    }
+    if (width == 0 || height == 0)
+        return -3;
+
+    PyArrayObject* msk = 0;
+    PyArrayObject* small = 0;
+    if (mask != Py_None) {
+        msk = (PyArrayObject*)PyArray_FROMANY(mask, NPY_UINT8, 2, 2, NPY_ARRAY_IN_ARRAY);
+        if (!msk) {
+            PyErr_Clear();
+            return -1;
+        }
+        if (small_mask != Py_None) {
+            if (!PyArray_Check(small_mask) ||
+                PyArray_TYPE((PyArrayObject*)small_mask) != NPY_UINT8 ||
+                !PyArray_IS_C_CONTIGUOUS((PyArrayObject*)small_mask) ||
+                PyArray_NDIM((PyArrayObject*)small_mask) != 2 ||
+                PyArray_DIM((PyArrayObject*)small_mask, 0) != PyArray_DIM(msk, 0) ||
+                PyArray_DIM((PyArrayObject*)small_mask, 1) != PyArray_DIM(msk, 1)) {
+                Py_DECREF(msk);
+                return -1;
+            }
+            small = (PyArrayObject*)small_mask;
+        }
+    }
+
+    openslide_t* osr = openslide_open(filename.c_str());
+    if (!osr || openslide_get_error(osr)) {
+        if (osr) openslide_close(osr);
+        Py_XDECREF(msk);
+        return -2;
+    }
+    if (static_cast<int32_t>(level) >= openslide_get_level_count(osr)) {
+        openslide_close(osr);
+        Py_XDECREF(msk);
+        return -3;
+    }
+    const double ds = openslide_get_level_downsample(osr, level);
+
+    // mask lookup: mask pixel of each region row and column
+    const uint64_t mh = msk ? PyArray_DIM(msk, 0) : 1, mw = msk ? PyArray_DIM(msk, 1) : 1;
+    const uint8_t* mpix = msk ? (const uint8_t*)PyArray_DATA(msk) : 0;
+    std::vector<uint32_t> mrow = nn_index(height, mh), mcol = nn_index(width, mw);
+    // region pixels sampled for small_mask
+    std::vector<uint32_t> srow = nn_index(mh, height), scol = nn_index(mw, width);
+    uint8_t* spix = small ? (uint8_t*)PyArray_DATA(small) : 0;
+    if (spix)
+        std::memcpy(spix, mpix, mh * mw);
+    std::size_t next_srow = 0;
+
+    const uint32_t band = img_out.empty() ?
+        (msk_out.empty() ? 256 : msk_out[0]->image_header().tile_height) :
+        img_out[0]->image_header().tile_height;
+    std::vector<uint32_t> argb(std::size_t(width) * band);
+    std::vector<uint8_t> rgb(std::size_t(width) * band * 3);
+    std::vector<uint8_t> keep(std::size_t(width) * band);
+    int res = 0;
+
+    Py_BEGIN_ALLOW_THREADS
+    for (uint64_t y0 = 0; y0 < height && res == 0; y0 += band) {
+        const uint32_t n = static_cast<uint32_t>(std::min<uint64_t>(band, height - y0));
+        openslide_read_region(osr, &argb[0], x, y + static_cast<int64_t>(y0 * ds + 0.5),
+                              level, width, n);
+        if (openslide_get_error(osr)) {
+            res = -7;
+            break;
+        }
+
+        for (uint32_t r = 0; r < n; ++r) {
+            const uint32_t* src = &argb[std::size_t(r) * width];
+            uint8_t* dst = &rgb[std::size_t(r) * width * 3];
+            uint8_t* k = &keep[std::size_t(r) * width];
+            const uint8_t* mr = mpix ? mpix + std::size_t(mrow[y0 + r]) * mw : 0;
+
+            for (uint64_t c = 0; c < width; ++c) {
+                const uint32_t p = src[c];
+                const uint32_t a = p >> 24;
+                if (a == 0 || (mr && !mr[mcol[c]])) {
+                    dst[3 * c] = dst[3 * c + 1] = dst[3 * c + 2] = 0;
+                    k[c] = 0;
+                    continue;
+                }
+                uint32_t cr = (p >> 16) & 0xff, cg = (p >> 8) & 0xff, cb = p & 0xff;
+                if (a != 255) {
+                    // un-premultiply
+                    cr = std::min(255u, (cr * 255 + a / 2) / a);
+                    cg = std::min(255u, (cg * 255 + a / 2) / a);
+                    cb = std::min(255u, (cb * 255 + a / 2) / a);
+                }
+                dst[3 * c] = static_cast<uint8_t>(cr);
+                dst[3 * c + 1] = static_cast<uint8_t>(cg);
+                dst[3 * c + 2] = static_cast<uint8_t>(cb);
+                k[c] = 255;
+            }
+
+            // and the small mask with the alpha channel, at its sampled rows
+            for (; spix && next_srow < mh && srow[next_srow] == y0 + r; ++next_srow)
+                for (uint64_t j = 0; j < mw; ++j)
+                    if ((src[scol[j]] >> 24) == 0)
+                        spix[next_srow * mw + j] = 0;
+        }
+
+        for (std::size_t k = 0; k < img_out.size() && res == 0; ++k)
+            res = img_out[k]->push_rows(&rgb[0], n);
+        for (std::size_t k = 0; k < msk_out.size() && res == 0; ++k)
+            res = msk_out[k]->push_rows(&keep[0], n);
+    }
+    Py_END_ALLOW_THREADS
+
+    openslide_close(osr);
+    Py_XDECREF(msk);
+
+    return res;
+}
+
+
+// TILED_READ
+// Decode all tiles of a container into a full level image. The function does
+// not allocate the memory for the image, but expects a pre-allocated, C-contiguous
+// uint8 numpy.ndarray of height x width x channels elements.
+//
+// Args:
+//  filename (string)
+//  dst (PyObject): a pointer to a numpy.ndarray PRE-ALLOCATED
+//
+// Returns:
+//  0: success
+// -1: cannot access buffer
+// -2: cannot open file
+// -3: not a (valid) tile container, or an incomplete one
+// -4: buffer size mismatch
+// -5: tile decoding error
+//
+int tiled_read(const std::string& filename, PyObject* dst)
+{
+    if (!PyArray_Check(dst) ||
+        PyArray_TYPE((PyArrayObject*)dst) != NPY_UINT8 ||
+        !PyArray_IS_C_CONTIGUOUS((PyArrayObject*)dst))
+        // cannot access buffer
+        return -1;
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        // cannot open file
+        return -2;
+
+    TileFileHeader hdr;
+    std::vector<TileIndexRecord> index;
+    if (!read_header(fd, hdr) || (hdr.flags & FILE_INCOMPLETE) || !read_index(fd, hdr, index)) {
+        close(fd);
+        return -3;
+    }
+
+    if (static_cast<uint64_t>(PyArray_SIZE((PyArrayObject*)dst)) !=
+        hdr.width * hdr.height * hdr.n_channels) {
+        close(fd);
+        return -4;
+    }
+
+    uint8_t* pixels = (uint8_t*)PyArray_DATA((PyArrayObject*)dst);
+    std::size_t stride = std::size_t(hdr.width) * hdr.n_channels;
+    std::vector<uint8_t> buf;
+    int res = 0;
+
+    for (uint32_t i = 0; i < hdr.n_tiles_vert && res == 0; ++i) {
+        for (uint32_t j = 0; j < hdr.n_tiles_horiz; ++j) {
+            const TileIndexRecord& r = index[std::size_t(i) * hdr.n_tiles_horiz + j];
+            TileGeometry g(hdr, i, j);
+            uint8_t* tile = pixels + g.y * stride + g.x * hdr.n_channels;
+            if ((r.flags & (TILE_PRESENT | TILE_FILL)) == (TILE_PRESENT | TILE_FILL)) {
+                for (uint32_t y = 0; y < g.height; ++y)
+                    std::memset(tile + y * stride, int(r.offset), std::size_t(g.width) * hdr.n_channels);
+                continue;
+            }
+            buf.resize(r.length);
+            if (!(r.flags & TILE_PRESENT) ||
+                !read_all(fd, &buf[0], r.length, r.offset) ||
+                !decode_tile(&buf[0], r.length, hdr.codec, g.width, g.height,
+                             hdr.n_channels, tile, stride)) {
+                res = -5;
+                break;
+            }
+        }
+    }
+    close(fd);
+
+    return res;
+}
+
+
+// TILED_INFO
+// Read the header of a container into a dict.
+//
+// Returns:
+//  0: success
+// -2: cannot open file
+// -3: not a (valid) tile container
+//
+int tiled_info(const std::string& filename, bp::dict info)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return -2;
+
+    TileFileHeader hdr;
+    bool ok = read_header(fd, hdr);
+    close(fd);
+    if (!ok)
+        return -3;
+
+    info["level_image_width"] = hdr.width;
+    info["level_image_height"] = hdr.height;
+    info["level_image_nchannels"] = hdr.n_channels;
+    info["tile_width"] = hdr.tile_width;
+    info["tile_height"] = hdr.tile_height;
+    info["n_tiles_horiz"] = hdr.n_tiles_horiz;
+    info["n_tiles_vert"] = hdr.n_tiles_vert;
+    info["codec"] = hdr.codec;
+    info["quality"] = hdr.quality;
+    info["index_offset"] = hdr.header_size;
+    info["complete"] = !(hdr.flags & FILE_INCOMPLETE);
+
+    return 0;
+}
+
+
+// MAPPED_FILE
+// A read-only memory map of a whole file, unmapped on destruction. It is
+// shared (std::shared_ptr) between a reader and the numpy views into it.
+struct MappedFile
+{
+    const uint8_t* data;
+    std::size_t size;
+
+    MappedFile() : data(0), size(0) {}
+
+    ~MappedFile()
+    {
+        if (data) munmap(const_cast<uint8_t*>(data), size);
+    }
+
+    bool open(const std::string& filename)
+    {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void* p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);            // the mapping stays valid
+        if (p == MAP_FAILED)
+            return false;
+        data = static_cast<const uint8_t*>(p);
+        size = st.st_size;
+        return true;
+    }
+};
+
+static void release_mapped_file(PyObject* capsule)
+{
+    delete static_cast<std::shared_ptr<MappedFile>*>(PyCapsule_GetPointer(capsule, 0));
+}
+
+
+// TILED_READER
+// Random access reader for a tile container. The container is memory-mapped.
+// Regions are assembled from the tiles they overlap: raw tiles are copied
+// straight from the map, the other ones are decoded on demand and kept in a
+// LRU cache of decoded tiles (bounded in bytes), such that neighbouring or
+// repeated region requests do not decode the same tiles again.
+class TiledReader
+{
+public:
+    TiledReader() : cache_capacity(0), cache_used(0)
+    {
+        std::memset(&hdr, 0, sizeof(hdr));
+    }
+
+    ~TiledReader()
+    {
+        close();
+    }
+
+    // OPEN
+    // Open a container, read its header and index.
+    //
+    // Args:
+    //  filename (string)
+    //  cache_size (unsigned long): maximum size of the decoded tiles cache (bytes)
+    //
+    // Returns:
+    //  0: success
+    // -2: cannot open file
+    // -3: not a (valid) tile container, or an incomplete one
+    int open(const std::string& filename, unsigned long cache_size)
+    {
+        close();
+
+        std::shared_ptr<MappedFile> m(new MappedFile());
+        if (!m->open(filename))
+            return -2;
+
+        // header and index are checked against the file size once, such that
+        // tiles can be accessed without further bound checks
+        std::size_t index_size;
+        if (m->size < sizeof(hdr))
+            return -3;
+        std::memcpy(&hdr, m->data, sizeof(hdr));
+        index_size = std::size_t(hdr.n_tiles_horiz) * hdr.n_tiles_vert;
+        if (std::memcmp(hdr.magic, TILE_FILE_MAGIC, sizeof(hdr.magic)) != 0 ||
+            hdr.version != TILE_FILE_VERSION || hdr.header_size < sizeof(hdr) ||
+            hdr.n_channels < 1 || hdr.n_channels > 4 || (hdr.flags & FILE_INCOMPLETE) ||
+            hdr.header_size + index_size * sizeof(TileIndexRecord) > m->size) {
+            std::memset(&hdr, 0, sizeof(hdr));
+            return -3;
+        }
+        index.resize(index_size);
+        if (index_size > 0)
+            std::memcpy(&index[0], m->data + hdr.header_size, index_size * sizeof(TileIndexRecord));
+        for (std::size_t k = 0; k < index_size; ++k)
+            if ((index[k].flags & TILE_PRESENT) && index[k].offset + index[k].length > m->size) {
+                close();
+                return -3;
+            }
+
+        file = m;
+        cache_capacity = cache_size;
+
+        return 0;
+    }
+
+    // Views returned by view() keep the mapping alive after close().
+    void close()
+    {
+        file.reset();
+        index.clear();
+        cache.clear();
+        cache_map.clear();
+        cache_used = 0;
+    }
+
+    // READ_REGION
+    // Read a rectangular region of the level image into a PRE-ALLOCATED,
+    // C-contiguous uint8 numpy.ndarray of height x width x channels elements.
+    // Parts of the region falling outside the image are set to 0.
+    //
+    // Args:
+    //  dst (PyObject): destination numpy.ndarray
+    //  x0, y0 (long): top-left corner of the region
+    //  width, height (unsigned long): size of the region
+    //
+    // Returns:
+    //  0: success
+    // -1: cannot access buffer
+    // -3: no container open
+    // -4: buffer size mismatch
+    // -5: tile decoding error
+    int read_region(PyObject* dst, long x0, long y0,
+                    unsigned long width, unsigned long height)
+    {
+        if (!PyArray_Check(dst) ||
+            PyArray_TYPE((PyArrayObject*)dst) != NPY_UINT8 ||
+            !PyArray_IS_C_CONTIGUOUS((PyArrayObject*)dst))
+            return -1;
+        if (!file)
+            return -3;
+        if (static_cast<uint64_t>(PyArray_SIZE((PyArrayObject*)dst)) !=
+            uint64_t(width) * height * hdr.n_channels)
+            return -4;
+
+        const uint32_t c = hdr.n_channels;
+        uint8_t* out = (uint8_t*)PyArray_DATA((PyArrayObject*)dst);
+        std::size_t out_stride = std::size_t(width) * c;
+        std::memset(out, 0, out_stride * height);
+
+        // intersection of the region with the image
+        int64_t rx0 = std::max<int64_t>(x0, 0), ry0 = std::max<int64_t>(y0, 0);
+        int64_t rx1 = std::min<int64_t>(x0 + int64_t(width), hdr.width);
+        int64_t ry1 = std::min<int64_t>(y0 + int64_t(height), hdr.height);
+        if (rx0 >= rx1 || ry0 >= ry1)
+            return 0;
+
+        for (uint32_t i = ry0 / hdr.tile_height; i <= (ry1 - 1) / hdr.tile_height; ++i) {
+            for (uint32_t j = rx0 / hdr.tile_width; j <= (rx1 - 1) / hdr.tile_width; ++j) {
+                TileGeometry g(hdr, i, j);
+                const TileIndexRecord& r = index[std::size_t(i) * hdr.n_tiles_horiz + j];
+                int64_t tx0 = std::max<int64_t>(rx0, g.x), tx1 = std::min<int64_t>(rx1, g.x + g.width);
+                int64_t ty0 = std::max<int64_t>(ry0, g.y), ty1 = std::min<int64_t>(ry1, g.y + g.height);
+                std::size_t row = std::size_t(tx1 - tx0) * c;
+
+                if ((r.flags & (TILE_PRESENT | TILE_FILL)) == (TILE_PRESENT | TILE_FILL)) {
+                    // synthesized fill tile
+                    for (int64_t y = ty0; y < ty1; ++y)
+                        std::memset(out + (y - y0) * out_stride + (tx0 - x0) * c, int(r.offset), row);
+                    continue;
+                }
+
+                const uint8_t* tile = get_tile(i, j, g);
+                if (!tile)
+                    return -5;
+
+                // copy the overlap between the tile and the region
+                for (int64_t y = ty0; y < ty1; ++y)
+                    std::memcpy(out + (y - y0) * out_stride + (tx0 - x0) * c,
+                                tile + ((y - g.y) * g.width + (tx0 - g.x)) * c,
+                                row);
+            }
+        }
+
+        return 0;
+    }
+
+    // VIEW
+    // Zero-copy access to a region of a raw (uncompressed) container: if the
+    // region lies inside a single tile, return a read-only numpy.ndarray
+    // (height x width [x channels], uint8) pointing into the memory map;
+    // otherwise (or for compressed or fill tiles) return None, and read_region()
+    // should be used instead.
+    static bp::object view(bp::object self, long x0, long y0,
+                           unsigned long width, unsigned long height)
+    {
+        TiledReader& r = bp::extract<TiledReader&>(self);
+        const TileFileHeader& hdr = r.hdr;
+
+        if (!r.file || hdr.codec != CODEC_RAW || x0 < 0 || y0 < 0 || width == 0 || height == 0 ||
+            uint64_t(x0) + width > hdr.width || uint64_t(y0) + height > hdr.height)
+            return bp::object();
+        uint32_t i = y0 / hdr.tile_height, j = x0 / hdr.tile_width;
+        if ((y0 + height - 1) / hdr.tile_height != i || (x0 + width - 1) / hdr.tile_width != j)
+            return bp::object();
+        const TileIndexRecord& rec = r.index[std::size_t(i) * hdr.n_tiles_horiz + j];
+        if (!(rec.flags & TILE_PRESENT) || (rec.flags & TILE_FILL))
+            return bp::object();
+
+        TileGeometry g(hdr, i, j);
+        const uint32_t c = hdr.n_channels;
+        const uint8_t* p = r.file->data + rec.offset + ((y0 - g.y) * g.width + (x0 - g.x)) * c;
+        npy_intp dims[3] = {npy_intp(height), npy_intp(width), npy_intp(c)};
+        npy_intp strides[3] = {npy_intp(g.width) * c, npy_intp(c), 1};
+
+        PyObject* arr = PyArray_New(&PyArray_Type, c == 1 ? 2 : 3, dims, NPY_UINT8, strides,
+                                    const_cast<uint8_t*>(p), 0, NPY_ARRAY_ALIGNED, 0);
+        if (!arr)
+            bp::throw_error_already_set();
+        PyObject* base = PyCapsule_New(new std::shared_ptr<MappedFile>(r.file), 0,
+                                       release_mapped_file);
+        if (!base || PyArray_SetBaseObject((PyArrayObject*)arr, base) != 0) {
+            Py_XDECREF(base);
+            Py_DECREF(arr);
+            bp::throw_error_already_set();
+        }
+
+        return bp::object(bp::handle<>(arr));
+    }
+
+    unsigned long width() const { return hdr.width; }
+    unsigned long height() const { return hdr.height; }
+    unsigned n_channels() const { return hdr.n_channels; }
+    unsigned tile_width() const { return hdr.tile_width; }
+    unsigned tile_height() const { return hdr.tile_height; }
+    int codec() const { return hdr.codec; }
+
+private:
+    struct CachedTile
+    {
+        uint64_t id;
+        std::vector<uint8_t> pixels;
+    };
+
+    // GET_TILE
+    // Return the decoded pixels of tile (i,j): raw tiles are returned in
+    // place, the other ones are decoded if not in cache. The pointer is valid
+    // until the next call.
+    const uint8_t* get_tile(uint32_t i, uint32_t j, const TileGeometry& g)
+    {
+        uint64_t id = uint64_t(i) * hdr.n_tiles_horiz + j;
+        const TileIndexRecord& r = index[id];
+        std::size_t size = std::size_t(g.width) * g.height * hdr.n_channels;
+
+        if (!(r.flags & TILE_PRESENT))
+            return 0;
+        if (hdr.codec == CODEC_RAW)
+            return r.length == size ? file->data + r.offset : 0;
+
+        std::unordered_map<uint64_t, std::list<CachedTile>::iterator>::iterator it = cache_map.find(id);
+        if (it != cache_map.end()) {
+            // move to front (most recently used)
+            cache.splice(cache.begin(), cache, it->second);
+            return &cache.front().pixels[0];
+        }
+
+        CachedTile t;
+        t.id = id;
+        t.pixels.resize(size);
+        if (!decode_tile(file->data + r.offset, r.length, hdr.codec, g.width, g.height,
+                         hdr.n_channels, &t.pixels[0], std::size_t(g.width) * hdr.n_channels))
+            return 0;
+
+        // evict least recently used tiles, keeping at least the new one
+        while (!cache.empty() && cache_used + size > cache_capacity) {
+            cache_used -= cache.back().pixels.size();
+            cache_map.erase(cache.back().id);
+            cache.pop_back();
+        }
+        cache.push_front(CachedTile());
+        cache.front().id = id;
+        cache.front().pixels.swap(t.pixels);
+        cache_map[id] = cache.begin();
+        cache_used += size;
+
+        return &cache.front().pixels[0];
+    }
+
+    std::shared_ptr<MappedFile> file;
+    TileFileHeader hdr;
+    std::vector<TileIndexRecord> index;
+
+    std::list<CachedTile> cache;
+    std::unordered_map<uint64_t, std::list<CachedTile>::iterator> cache_map;
+    std::size_t cache_capacity, cache_used;
+};
+
+
+BOOST_PYTHON_MODULE(tiled_)
+{
+    import_array();
+    bp::def("tiled_write_", tiled_write);
+    bp::def("tiled_read_", tiled_read);
+    bp::def("tiled_info_", tiled_info);
+    bp::def("tiled_extract_", tiled_extract);
+
+    bp::class_<TiledPyramidWriter, boost::noncopyable>("TiledPyramidWriter")
+        .def("open", &TiledPyramidWriter::open)
+        .def("write_rows", &TiledPyramidWriter::write_rows)
+        .def("close", &TiledPyramidWriter::close)
+        .def("index", &TiledPyramidWriter::index)
+        .def("n_reused", &TiledPyramidWriter::n_reused)
+        .def("n_filled", &TiledPyramidWriter::n_filled)
+        .add_property("n_levels", &TiledPyramidWriter::n_levels);
+
+    bp::class_<BigTiffWriter, boost::noncopyable>("BigTiffWriter")
+        .def("open", &BigTiffWriter::open)
+        .def("set_resolution", &BigTiffWriter::set_resolution)
+        .def("write_rows", &BigTiffWriter::write_rows)
+        .def("close", &BigTiffWriter::close)
+        .add_property("n_levels", &BigTiffWriter::n_levels);
+
+    bp::class_<TiledReader, boost::noncopyable>("TiledReader")
+        .def("open", &TiledReader::open)
+        .def("close", &TiledReader::close)
+        .def("read_region", &TiledReader::read_region)
+        .def("view", &TiledReader::view)
+        .add_property("width", &TiledReader::width)
+        .add_property("height", &TiledReader::height)
+        .add_property("n_channels", &TiledReader::n_channels)
+        .add_property("tile_width", &TiledReader::tile_width)
+        .add_property("tile_height", &TiledReader::tile_height)
+        .add_property("codec", &TiledReader::codec);
+}
@@ -9,12 +9,23 @@
 # masks (i.e. binary images of 0s and 1s).
 #
 
-__all__ = ['add_region', 'masked_points', 'apply_mask']
+__all__ = ['add_region', 'masked_points', 'apply_mask', 'mask_to_polygons',
+           'SpanMask', 'BitMask', 'CoverageMap', 'ComponentLabeler', 'connected_components']
 
 import numpy as np
 from skimage.draw import polygon
 import vigra
 
+from qpath2.core import Error, polygons_to_flat, flat_to_polygons
+from qpath2.masks_ import SpanMask as _SpanMask, BitMask as _BitMask, CoverageMap as _CoverageMap, \
+    ComponentLabeler as _ComponentLabeler, apply_mask_, apply_scaled_mask_, mask_contours_
+
+
+_FILL_RULES = {'evenodd': 0, 'nonzero': 1}
+
+# codes as in masks_.cxx (MorphOp)
+_MORPH_OPS = {'dilation': 0, 'erosion': 1, 'opening': 2, 'closing': 3}
+
 ##-
 def add_region(mask, poly_line):
     """Add a new masking region by setting to 1 all the
@@ -65,32 +76,612 @@ def masked_points(poly_line, shape):
 
 
 ##-
-def apply_mask(img, mask):
+def apply_mask(img, mask, fill=0, window=None):
     """Apply a mask to each channel of an image. Pixels corresponding to 0s in
-    the mask will be set to 0. Changes are made in situ.
+    the mask will be set to fill (default: 0). Changes are made in situ, in a
+    single (native, vectorized) pass for uint8, uint16 and float32 images.
+
+    The mask may have a lower resolution than the image: it is then upscaled
+    on the fly (nearest neighbour, as skimage.transform.resize with order=0),
+    without building the full resolution mask. With a window, the image is
+    only a part of the (larger) image covered by the mask, e.g. a band of a
+    tissue blob processed piece by piece.
 
     Args:
         img (numpy.array or vigra.VigraArray): an image as an N-dim array
             (height x width x no_of_channels)
-        mask (numpy.array): a mask as a 2-dim array (height x width)
+        mask (numpy.array or vigra.VigraArray): a mask as a 2-dim array
+            (height x width, or lower resolution); any non-zero value keeps
+            the pixel
+        fill (img.dtype): value set outside the mask, to all channels
+        window (tuple, optional): (x0, y0, full_width, full_height): img is the
+            window with top-left corner (x0, y0) of a full_width x full_height
+            image covered by the mask
 
     Return:
         numpy.array: the modified image
     """
-    if mask.dtype is np.bool:
-        mask = mask.astype(np.uint8)
-    mask[mask > 0] = 1
-
-    if isinstance(img, vigra.VigraArray):
-        ch_iter = img.channelIter()
-        for c in ch_iter:
-            c *= mask
+    a, m = img, mask
+    if isinstance(a, vigra.VigraArray):
+        a = a.transposeToNumpyOrder().view(np.ndarray)
+    if isinstance(m, vigra.VigraArray):
+        m = m.transposeToNumpyOrder().view(np.ndarray)
+    if m.dtype != np.bool_ and m.dtype != np.uint8:
+        m = m != 0
+
+    if window is None and m.shape == a.shape[:2]:
+        r = apply_mask_(a, m, float(fill))
     else:
-        if img.ndim == 2:
-            img *= mask
+        if window is None:
+            window = (0, 0, a.shape[1], a.shape[0])
+        x0, y0, full_w, full_h = [int(_x) for _x in window]
+        r = apply_scaled_mask_(a, m, full_w, full_h, x0, y0, float(fill))
+        if r == -1 or r == -2:
+            # no fast path: upscale the mask over the window
+            rows = np.minimum((2 * np.arange(y0, y0 + a.shape[0]) + 1) * m.shape[0] // (2 * full_h),
+                              m.shape[0] - 1)
+            cols = np.minimum((2 * np.arange(x0, x0 + a.shape[1]) + 1) * m.shape[1] // (2 * full_w),
+                              m.shape[1] - 1)
+            m = m[rows][:, cols]
+            r = -4
+
+    if r == -3:
+        raise Error("image and mask shapes do not match")
+    elif r != 0:
+        # unsupported type or memory layout: no fast path
+        if a.ndim == 2:
+            a[m == 0] = fill
         else:
-            for k in np.arange(img.shape[2]):
-                img[:,:,k] *= mask
+            a[m == 0, :] = fill
 
     return img
 ##-
+
+
+##-
+def mask_to_polygons(mask, tolerance=0.0, scale=1.0, offset=(0, 0), flat=False):
+    """Vectorize a mask: trace the boundaries of its foreground regions (8-connected
+    pixels) along the pixel edges and return them as polygons with holes. Pixel
+    (x, y) covers [x, x+1) x [y, y+1), so the vertices are on the pixel corners.
+
+    add_region (and SpanMask/BitMask.add_region) set the pixels whose
+    coordinates (x, y) are inside or on the boundary: rasterizing the corner
+    polygons directly grows the regions by one pixel towards +x and +y. Use
+    offset=(-0.5, -0.5) for polygons to be rasterized: their pixels are then
+    those with the centre inside, which gives back the mask (for scale=1 and
+    no simplification).
+
+    Args:
+        mask (numpy.array): 2D mask, non-zero for foreground
+        tolerance (float): if > 0, the boundaries are simplified (Douglas-Peucker)
+            with this tolerance, in mask pixels
+        scale (float): scale factor of the coordinates (e.g. the downsample factor
+            of the mask wrt. the level where the polygons are used)
+        offset (pair): (x, y) added to the (scaled) coordinates; (-0.5, -0.5)
+            for the pixel centres convention of add_region (see above)
+        flat (bool): return the polygons in flat layout
+
+    Returns:
+        a list of polygons with holes, each given as a list of numpy.arrays
+        (n_k x 2): the first one is the outer boundary (counterclockwise), the rest
+        are the holes (clockwise). If flat is True, (xy, ring_offsets,
+        polygon_offsets) instead (see compgeom.polygon_repair).
+    """
+    r = []
+    if mask_contours_(mask, float(tolerance), float(scale), float(offset[0]), float(offset[1]), r) != 0:
+        raise Error("invalid mask")
+    if flat:
+        return tuple(r)
+
+    xy, ring_offsets, polygon_offsets = r
+    rings = flat_to_polygons(xy, ring_offsets)
+    return [rings[i:j] for i, j in zip(polygon_offsets[:-1], polygon_offsets[1:])]
+##-
+
+
+##-
+class SpanMask(object):
+    """A binary mask stored as runs of set pixels (run-length encoding, row
+    by row), for masks too large to be held as dense arrays (e.g. annotation
+    masks at the full resolution of a whole slide image). The memory needed
+    is proportional to the total height of the masked regions, not to the
+    size of the image.
+
+    Args:
+        shape (pair): (height, width) of the mask (as for numpy arrays)
+
+    Example:
+        msk = SpanMask((img_h, img_w))
+        msk.add_region(poly_line)
+        f = msk.coverage([(x, y, 256, 256) for x, y in tile_corners])
+        patch = msk.to_dense(x, y, 256, 256)
+    """
+
+    def __init__(self, shape, _mask=None):
+        self._mask = _SpanMask(int(shape[1]), int(shape[0])) if _mask is None else _mask
+
+    @property
+    def shape(self):
+        return self._mask.height, self._mask.width
+
+    @property
+    def area(self):
+        """Number of set pixels."""
+        return self._mask.area
+
+    @property
+    def n_runs(self):
+        """Number of runs of set pixels."""
+        return self._mask.n_runs
+
+    def copy(self):
+        return SpanMask(None, self._mask.copy())
+
+    def add_region(self, poly_line, fill_rule='evenodd'):
+        """Set to 1 all the pixels within the boundaries of a polygon (see
+        masks.add_region), or of a set of rings (e.g. a polygon with holes).
+
+        Args:
+            poly_line (numpy.array or list): an N x 2 array with the (x,y)
+                coordinates of the polygon vertices as rows, or a list of such
+                arrays
+            fill_rule (string): 'evenodd' or 'nonzero', deciding which pixels
+                are inside when several rings are given or the polygon is
+                self-intersecting
+
+        Returns:
+            self
+        """
+        if isinstance(poly_line, np.ndarray):
+            poly_line = [poly_line]
+        xy, offsets = polygons_to_flat(poly_line)
+
+        return self.add_flat(xy, offsets, fill_rule)
+
+    def add_flat(self, xy, offsets, fill_rule='evenodd'):
+        """Same as add_region, for rings given in flat layout (see
+        core.polygons_to_flat)."""
+        if fill_rule not in _FILL_RULES:
+            raise Error("unknown fill rule: " + fill_rule)
+        r = self._mask.add_polygons(xy, offsets, _FILL_RULES[fill_rule])
+        if r == -1:
+            raise Error("Vertices must be given as a (n x 2) array")
+        elif r == -2:
+            raise Error("Invalid polygon offsets")
+        elif r != 0:
+            raise Error("Unknown error", code=r)
+
+        return self
+
+    def union(self, other):
+        """Return the union with another mask of the same shape."""
+        m = self.copy()
+        m |= other
+        return m
+
+    def intersection(self, other):
+        """Return the intersection with another mask of the same shape."""
+        m = self.copy()
+        m &= other
+        return m
+
+    def __ior__(self, other):
+        if self._mask.unite(other._mask) != 0:
+            raise Error("mask shape mismatch")
+        return self
+
+    def __iand__(self, other):
+        if self._mask.intersect(other._mask) != 0:
+            raise Error("mask shape mismatch")
+        return self
+
+    __or__ = union
+    __and__ = intersection
+
+    def coverage(self, windows):
+        """Fraction of set pixels in each of a batch of windows (the parts of a
+        window outside the mask count as not set).
+
+        Args:
+            windows (numpy.array or list): n x 4 array of (x0, y0, width, height)
+                rows
+
+        Returns:
+            numpy.array: n float64 values
+        """
+        windows = np.asarray(windows, dtype=np.int64).reshape((-1, 4))
+        f = np.empty(windows.shape[0], dtype=np.float64)
+        if self._mask.coverage(windows, f) != 0:
+            raise Error("invalid windows")
+
+        return f
+
+    def morphology(self, op, radius, n_threads=0):
+        """Binary morphology with a disk structuring element (the offsets (dx, dy)
+        with dx**2 + dy**2 <= radius**2, as skimage.morphology.disk), in place.
+        The disk is decomposed into horizontal runs, applied to the runs of the
+        mask. The pixels outside the mask count as background for the dilation
+        and as foreground for the erosion (as for skimage's binary_erosion).
+
+        Args:
+            op (string): 'dilation', 'erosion', 'opening' or 'closing'
+            radius (int): radius of the disk
+            n_threads (int): number of threads (0: one per CPU core)
+
+        Returns:
+            self
+        """
+        if op not in _MORPH_OPS:
+            raise Error("unknown morphological operation: " + op)
+        if self._mask.morphology(_MORPH_OPS[op], int(radius), int(n_threads)) != 0:
+            raise Error("Unknown error")
+        return self
+
+    def dilation(self, radius, n_threads=0):
+        return self.morphology('dilation', radius, n_threads)
+
+    def erosion(self, radius, n_threads=0):
+        return self.morphology('erosion', radius, n_threads)
+
+    def opening(self, radius, n_threads=0):
+        return self.morphology('opening', radius, n_threads)
+
+    def closing(self, radius, n_threads=0):
+        return self.morphology('closing', radius, n_threads)
+
+    def to_dense(self, x0=0, y0=0, width=None, height=None, value=1):
+        """Export a window of the mask as a dense array.
+
+        Args:
+            x0, y0 (int): top left corner of the window
+            width, height (int): size of the window (default: up to the end of
+                the mask)
+            value (int): value of the set pixels (the others are 0)
+
+        Returns:
+            numpy.array: height x width uint8 array
+        """
+        if width is None:
+            width = self._mask.width - x0
+        if height is None:
+            height = self._mask.height - y0
+        dst = np.empty((int(height), int(width)), dtype=np.uint8)
+        if self._mask.to_dense(dst, int(x0), int(y0), int(value)) != 0:
+            raise Error("Unknown error")
+
+        return dst
+##-
+
+
+##-
+class BitMask(object):
+    """A binary mask stored with 1 bit per pixel (8 times less memory than a
+    uint8 mask), with rows aligned for SIMD processing. The logical
+    operations, the area and the tile coverage work directly on the packed
+    bits.
+
+    Args:
+        shape (pair): (height, width) of the mask (as for numpy arrays)
+
+    Example:
+        msk = BitMask.from_dense(tissue > 0)
+        msk &= BitMask(msk.shape).add_region(poly_line)
+        f = msk.tile_coverage((256, 256))
+    """
+
+    def __init__(self, shape, _mask=None):
+        self._mask = _BitMask(int(shape[1]), int(shape[0])) if _mask is None else _mask
+
+    @classmethod
+    def from_dense(cls, mask):
+        """Pack a 2D (uint8 or bool) mask, any non-zero value being set."""
+        if mask.dtype != np.bool_ and mask.dtype != np.uint8:
+            mask = mask != 0
+        m = cls(mask.shape)
+        r = m._mask.from_dense(mask)
+        if r == -1:
+            mask = np.ascontiguousarray(mask)
+            r = m._mask.from_dense(mask)
+        if r != 0:
+            raise Error("invalid mask", code=r)
+
+        return m
+
+    def set_rows(self, y0, band):
+        """Set the rows y0, y0 + 1, ... from a band (2D uint8 or bool array, rows x
+        width, any non-zero value being set), e.g. for building the mask band by
+        band.
+
+        Returns:
+            self
+        """
+        if band.dtype != np.bool_ and band.dtype != np.uint8:
+            band = band != 0
+        r = self._mask.set_rows(band, int(y0))
+        if r == -1:
+            r = self._mask.set_rows(np.ascontiguousarray(band), int(y0))
+        if r != 0:
+            raise Error("invalid band", code=r)
+
+        return self
+
+    @property
+    def shape(self):
+        return self._mask.height, self._mask.width
+
+    @property
+    def area(self):
+        """Number of set pixels."""
+        return self._mask.area
+
+    @property
+    def nbytes(self):
+        return self._mask.nbytes
+
+    def copy(self):
+        return BitMask(None, self._mask.copy())
+
+    def add_region(self, poly_line, fill_rule='evenodd'):
+        """Set to 1 all the pixels within the boundaries of a polygon or of a set
+        of rings (see SpanMask.add_region).
+
+        Returns:
+            self
+        """
+        if isinstance(poly_line, np.ndarray):
+            poly_line = [poly_line]
+        xy, offsets = polygons_to_flat(poly_line)
+
+        return self.add_flat(xy, offsets, fill_rule)
+
+    def add_flat(self, xy, offsets, fill_rule='evenodd'):
+        """Same as add_region, for rings given in flat layout (see
+        core.polygons_to_flat)."""
+        if fill_rule not in _FILL_RULES:
+            raise Error("unknown fill rule: " + fill_rule)
+        r = self._mask.add_polygons(xy, offsets, _FILL_RULES[fill_rule])
+        if r == -1:
+            raise Error("Vertices must be given as a (n x 2) array")
+        elif r == -2:
+            raise Error("Invalid polygon offsets")
+        elif r != 0:
+            raise Error("Unknown error", code=r)
+
+        return self
+
+    def __ior__(self, other):
+        if self._mask.unite(other._mask) != 0:
+            raise Error("mask shape mismatch")
+        return self
+
+    def __iand__(self, other):
+        if self._mask.intersect(other._mask) != 0:
+            raise Error("mask shape mismatch")
+        return self
+
+    def __or__(self, other):
+        m = self.copy()
+        m |= other
+        return m
+
+    def __and__(self, other):
+        m = self.copy()
+        m &= other
+        return m
+
+    def __invert__(self):
+        m = self.copy()
+        m._mask.invert()
+        return m
+
+    def tile_coverage(self, tile_geom):
+        """Fraction of set pixels in each tile of a regular grid.
+
+        Args:
+            tile_geom (pair): (width, height) of the tiles; the right-most and
+                bottom-most tiles may be smaller
+
+        Returns:
+            numpy.array: (n_tiles_vert x n_tiles_horiz) float64 array
+        """
+        h, w = self.shape
+        tw, th = int(tile_geom[0]), int(tile_geom[1])
+        f = np.empty(((h + th - 1) // th, (w + tw - 1) // tw), dtype=np.float64)
+        if self._mask.tile_coverage(tw, th, f) != 0:
+            raise Error("invalid tile geometry")
+
+        return f
+
+    def morphology(self, op, radius, n_threads=0):
+        """Binary morphology with a disk, in place, 64 pixels at a time on the
+        packed bits (see SpanMask.morphology)."""
+        if op not in _MORPH_OPS:
+            raise Error("unknown morphological operation: " + op)
+        if self._mask.morphology(_MORPH_OPS[op], int(radius), int(n_threads)) != 0:
+            raise Error("Unknown error")
+        return self
+
+    def dilation(self, radius, n_threads=0):
+        return self.morphology('dilation', radius, n_threads)
+
+    def erosion(self, radius, n_threads=0):
+        return self.morphology('erosion', radius, n_threads)
+
+    def opening(self, radius, n_threads=0):
+        return self.morphology('opening', radius, n_threads)
+
+    def closing(self, radius, n_threads=0):
+        return self.morphology('closing', radius, n_threads)
+
+    def to_dense(self, x0=0, y0=0, width=None, height=None, value=1):
+        """Expand a window of the mask to a uint8 array (see SpanMask.to_dense)."""
+        if width is None:
+            width = self._mask.width - x0
+        if height is None:
+            height = self._mask.height - y0
+        dst = np.empty((int(height), int(width)), dtype=np.uint8)
+        if self._mask.to_dense(dst, int(x0), int(y0), int(value)) != 0:
+            raise Error("Unknown error")
+
+        return dst
+##-
+
+
+##-
+class CoverageMap(object):
+    """Foreground fraction of image windows, from a (usually low resolution)
+    tissue or annotation mask. The summed-area table of the mask answers each
+    query in constant time, for windows given at any level of the image
+    pyramid (a window is mapped onto the mask and its foreground area is
+    computed exactly, even if not aligned to the mask pixels).
+
+    Args:
+        mask (numpy.array): 2D mask, non-zero for foreground
+        downsample (float): downsample factor of the mask with respect to
+            level 0 of the image (e.g. the 'downsample_factor' of the level
+            it was computed from)
+        level_downsamples (list, optional): downsample factor of each level
+            of the image (e.g. from the WSIInfo, see the example); needed only
+            for windows at levels other than 0, as the factors of the slides'
+            levels are not always powers of 2
+
+    Example:
+        levels = wsi.info['levels']
+        cov = CoverageMap(tissue_mask, levels[k]['downsample_factor'],
+                          [levels[l]['downsample_factor'] for l in range(wsi.info['level_count'])])
+        f = cov.coverage([(x, y, 256, 256) for x, y in corners], level=1)
+    """
+
+    def __init__(self, mask, downsample=1.0, level_downsamples=None):
+        self._map = _CoverageMap()
+        if self._map.build(mask) != 0:
+            raise Error("invalid mask")
+        self._downsample = float(downsample)
+        self._level_downsamples = level_downsamples
+
+    @property
+    def shape(self):
+        """Shape of the mask."""
+        return self._map.height, self._map.width
+
+    def level_shape(self, level=0):
+        """Shape (height, width) of the image, at a given level, covered by the mask."""
+        s = self._scale(level)
+        return int(round(self._map.height / s)), int(round(self._map.width / s))
+
+    def _scale(self, level):
+        if level == 0:
+            return 1.0 / self._downsample
+        if self._level_downsamples is None:
+            raise Error("the downsample factors of the levels are needed for level != 0")
+        return float(self._level_downsamples[level]) / self._downsample
+
+    def coverage(self, windows, level=0):
+        """Foreground fraction of a batch of windows.
+
+        Args:
+            windows (numpy.array or list): n x 4 array of (x0, y0, width, height)
+                rows, in the coordinates of the given level
+            level (int): image level of the windows
+
+        Returns:
+            numpy.array: n float64 values in [0, 1]
+        """
+        windows = np.asarray(windows, dtype=np.float64).reshape((-1, 4))
+        f = np.empty(windows.shape[0], dtype=np.float64)
+        if self._map.coverage(windows, self._scale(level), f) != 0:
+            raise Error("invalid windows")
+
+        return f
+##-
+
+
+##-
+class ComponentLabeler(object):
+    """Streaming labelling of the (8-connected) foreground components of a
+    mask, replacing label/regionprops for large masks: the mask is passed in
+    bands of rows, top to bottom, and never held in memory. For each component,
+    the area, the bounding box, the centroid and the convex hull are computed
+    on the fly; the components smaller than min_area are dropped (as by
+    skimage.morphology.remove_small_objects).
+
+    Pixel (x, y) covers [x, x+1) x [y, y+1) (as for mask_to_polygons), so the
+    bounding boxes are (x0, y0, x1, y1), with x1 and y1 excluded, and the hull
+    vertices are pixel corners.
+
+    Args:
+        width (int): width of the mask
+        min_area (int): minimum number of pixels of a component to be kept
+
+    Example:
+        lab = ComponentLabeler(w, min_area=100)
+        for y in range(0, h, 1024):
+            lab.push(read_mask_band(y, 1024))
+        blobs = lab.finish()
+    """
+
+    def __init__(self, width, min_area=0):
+        self._labeler = _ComponentLabeler(int(width), int(max(min_area, 0)))
+
+    @property
+    def shape(self):
+        """Shape of the mask pushed so far."""
+        return self._labeler.height, self._labeler.width
+
+    def push(self, band):
+        """Label the next rows (numpy.array, rows x width, non-zero for foreground)."""
+        r = self._labeler.push_rows(band)
+        if r == -1:
+            raise Error("invalid band")
+        elif r != 0:
+            raise Error("labelling already finished", code=r)
+
+    def finish(self, flat=False):
+        """Complete the labelling.
+
+        Args:
+            flat (bool): return the statistics as arrays, with the hulls in flat
+                layout
+
+        Returns:
+            a list of dicts, one per component, in the raster order of their first
+            pixel, with the keys: 'area' (number of pixels), 'bbox' ((x0, y0, x1, y1)),
+            'centroid' ((x, y), the centre of mass of the pixel squares) and 'hull'
+            (numpy.array, n x 2, the vertices of the convex hull, counterclockwise).
+            If flat is True, (area, bbox, centroid, xy, offsets) instead, with
+            the hull of component k being xy[offsets[k]:offsets[k+1]].
+        """
+        r = []
+        if self._labeler.finish(r) != 0:
+            raise Error("labelling already finished")
+        if flat:
+            return tuple(r)
+        area, bbox, centroid, xy, offsets = r
+
+        return [{'area': int(area[k]),
+                 'bbox': tuple(int(v) for v in bbox[k]),
+                 'centroid': (centroid[k, 0], centroid[k, 1]),
+                 'hull': xy[offsets[k]:offsets[k+1]]}
+                for k in range(area.size)]
+##-
+
+
+##-
+def connected_components(mask, min_area=0, band_height=1024):
+    """Label the (8-connected) foreground components of a mask and return their
+    statistics (see ComponentLabeler).
+
+    Args:
+        mask (numpy.array): 2D mask, non-zero for foreground
+        min_area (int): minimum number of pixels of a component to be kept
+        band_height (int): number of rows labelled at once
+
+    Returns:
+        a list of dicts (see ComponentLabeler.finish)
+    """
+    lab = ComponentLabeler(mask.shape[1], min_area)
+    for y in range(0, mask.shape[0], band_height):
+        lab.push(mask[y:y + band_height, :])
+
+    return lab.finish()
+##-
@@ -0,0 +1,2582 @@
+//----------------------------------------------------------------------
+// masks_.cxx : Image masks for Python.
+//
+//              Binary masks of whole slide images at full resolution,
+//              too large to be stored as dense arrays. A SpanMask keeps,
+//              for each row, the sorted list of disjoint runs of set
+//              pixels (run-length encoding), hence its size depends on
+//              the length of the region boundaries, not on the image
+//              size. Also, fast kernels for applying (dense) masks to
+//              images, a summed-area table of a mask for window
+//              coverage queries, a bit-packed mask (1 bit/pixel), the
+//              vectorization of masks (contour tracing), a streaming
+//              labelling of connected components, the thresholding
+//              of images by their gray levels histogram and binary
+//              morphology on the run-length and bit-packed masks.
+// Author: Vlad Popovici
+//----------------------------------------------------------------------
+
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#include <boost/python.hpp>
+#include <numpy/ndarrayobject.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QPATH2_X86 1
+#endif
+
+
+namespace bp = boost::python;
+
+enum FillRule {
+    FILL_EVEN_ODD = 0,
+    FILL_NONZERO = 1
+};
+
+enum MorphOp {
+    MORPH_DILATE = 0,
+    MORPH_ERODE = 1,
+    MORPH_OPEN = 2,
+    MORPH_CLOSE = 3
+};
+
+// The runs of a row: [begin_0, end_0, begin_1, end_1, ...], with half-open,
+// sorted, disjoint and non-adjacent intervals [begin_k, end_k).
+typedef std::vector<int32_t> Runs;
+
+
+// UNITE_RUNS
+// Union of two rows of runs.
+//
+static void unite_runs(const Runs& a, const Runs& b, Runs& r)
+{
+    r.clear();
+    std::size_t i = 0, j = 0;
+    while (i < a.size() || j < b.size()) {
+        int32_t s, e;
+        if (j >= b.size() || (i < a.size() && a[i] <= b[j])) {
+            s = a[i]; e = a[i+1]; i += 2;
+        } else {
+            s = b[j]; e = b[j+1]; j += 2;
+        }
+        if (!r.empty() && s <= r.back())
+            r.back() = std::max(r.back(), e);
+        else {
+            r.push_back(s);
+            r.push_back(e);
+        }
+    }
+}
+
+
+// INTERSECT_RUNS
+// Intersection of two rows of runs.
+//
+static void intersect_runs(const Runs& a, const Runs& b, Runs& r)
+{
+    r.clear();
+    std::size_t i = 0, j = 0;
+    while (i < a.size() && j < b.size()) {
+        const int32_t s = std::max(a[i], b[j]), e = std::min(a[i+1], b[j+1]);
+        if (s < e) {
+            r.push_back(s);
+            r.push_back(e);
+        }
+        if (a[i+1] < b[j+1]) i += 2; else j += 2;
+    }
+}
+
+
+// COUNT_RUNS
+// Number of set pixels of a row within [x0, x1).
+//
+static uint64_t count_runs(const Runs& a, int32_t x0, int32_t x1)
+{
+    // first run ending after x0
+    std::size_t k = 0, n = a.size() / 2;
+    while (n > 0) {
+        std::size_t h = n / 2;
+        if (a[2 * (k + h) + 1] <= x0) {
+            k += h + 1;
+            n -= h + 1;
+        } else
+            n = h;
+    }
+
+    uint64_t c = 0;
+    for (k *= 2; k < a.size() && a[k] < x1; k += 2)
+        c += std::min(a[k+1], x1) - std::max(a[k], x0);
+
+    return c;
+}
+
+
+// READ_RINGS
+// Read a set of rings in flat layout (see core.polygons_to_flat): the (x, y)
+// vertex coordinates, by rows of an (n x 2) array, and the ring offsets (ring
+// k is xy[offsets[k]:offsets[k+1]]). Returns 0, or -1 for invalid xy and -2
+// for invalid offsets.
+//
+static int read_rings(PyObject* xy, PyObject* offsets, std::vector<double>& pts,
+                      std::vector<npy_int64>& off)
+{
+    PyArrayObject* arr = (PyArrayObject*)PyArray_FROMANY(xy, NPY_FLOAT64, 2, 2,
+                                                         NPY_ARRAY_IN_ARRAY);
+    if (!arr) {
+        PyErr_Clear();
+        return -1;
+    }
+    if (PyArray_DIM(arr, 1) != 2) {
+        Py_DECREF(arr);
+        return -1;
+    }
+    const std::size_t n = PyArray_DIM(arr, 0);
+    const double* p = (const double*)PyArray_DATA(arr);
+    pts.assign(p, p + 2 * n);
+    Py_DECREF(arr);
+
+    PyArrayObject* oarr = (PyArrayObject*)PyArray_FROMANY(offsets, NPY_INT64, 1, 1,
+                                                          NPY_ARRAY_IN_ARRAY);
+    if (!oarr) {
+        PyErr_Clear();
+        return -2;
+    }
+    const npy_int64* o = (const npy_int64*)PyArray_DATA(oarr);
+    off.assign(o, o + PyArray_DIM(oarr, 0));
+    Py_DECREF(oarr);
+    if (off.empty() || off.front() != 0 || off.back() != static_cast<npy_int64>(n))
+        return -2;
+    for (std::size_t k = 1; k < off.size(); ++k)
+        if (off[k] < off[k-1]) return -2;
+
+    return 0;
+}
+
+
+// RASTERIZE_RINGS
+// Scanline fill of the region bounded by a set of rings (see read_rings),
+// within a width x height raster. A pixel (x, y) is inside if its coordinates
+// are inside the region, under the given fill rule (FillRule), or on one of
+// its edges (the region is closed, as for skimage.draw.polygon). The rings
+// need not be closed. For each row with pixels inside, emit(y, runs) is called,
+// with the runs of the row in increasing order of y.
+//
+template <typename Emit>
+static void rasterize_rings(const std::vector<double>& pts, const std::vector<npy_int64>& off,
+                            int fill_rule, int32_t width, long height, Emit emit)
+{
+    // the edges, each covering the rows [y_begin, y_end): those whose y lies
+    // in [min(ya, yb), max(ya, yb)]; the horizontal ones cover only their row
+    struct Edge {
+        long y_begin, y_end;
+        double xa, ya, dx, dy, y_max;
+        int dir;
+
+        // x of the edge at row y (exact for the integer vertices, if it is
+        // an integer)
+        double x_at(long y) const { return xa + (y - ya) * dx / dy; }
+    };
+    std::vector<Edge> edges;
+    for (std::size_t k = 0; k + 1 < off.size(); ++k)
+        for (npy_int64 i = off[k]; i < off[k+1]; ++i) {
+            const npy_int64 j = i + 1 < off[k+1] ? i + 1 : off[k];
+            const double xa = pts[2*i], ya = pts[2*i+1], xb = pts[2*j], yb = pts[2*j+1];
+            Edge e;
+            e.y_begin = std::max(0L, static_cast<long>(std::ceil(std::min(ya, yb))));
+            e.y_end = std::min(height, static_cast<long>(std::floor(std::max(ya, yb))) + 1);
+            if (e.y_begin >= e.y_end)
+                continue;
+            e.xa = xa;
+            e.ya = ya;
+            e.dx = xb - xa;
+            e.dy = yb - ya;
+            e.y_max = std::max(ya, yb);
+            e.dir = yb > ya ? 1 : -1;
+            edges.push_back(e);
+        }
+    std::sort(edges.begin(), edges.end(),
+              [](const Edge& a, const Edge& b) { return a.y_begin < b.y_begin; });
+
+    std::vector<const Edge*> active;
+    std::vector<std::pair<double, int> > cross;
+    std::vector<std::pair<int32_t, int32_t> > segs;
+    Runs spans;
+    std::size_t next = 0;
+    for (long y = edges.empty() ? height : edges[0].y_begin; y < height; ++y) {
+        // update the active edges list
+        std::size_t m = 0;
+        for (std::size_t k = 0; k < active.size(); ++k)
+            if (active[k]->y_end > y)
+                active[m++] = active[k];
+        active.resize(m);
+        for (; next < edges.size() && edges[next].y_begin <= y; ++next)
+            active.push_back(&edges[next]);
+        if (active.empty()) {
+            if (next == edges.size())
+                break;
+            continue;
+        }
+
+        // the pixels on the edges, and the crossings of the edges whose
+        // [min(ya, yb), max(ya, yb)) holds y (each vertex counted once)
+        segs.clear();
+        cross.clear();
+        for (std::size_t k = 0; k < active.size(); ++k) {
+            const Edge& e = *active[k];
+            double s, t;
+            if (e.dy == 0) {
+                s = std::min(e.xa, e.xa + e.dx);
+                t = std::max(e.xa, e.xa + e.dx);
+            } else {
+                s = t = e.x_at(y);
+                if (y < e.y_max)
+                    cross.push_back(std::make_pair(s, e.dir));
+            }
+            s = std::max(0.0, std::ceil(s));
+            t = std::min(double(width), std::floor(t) + 1.0);
+            if (s < t)
+                segs.push_back(std::make_pair(static_cast<int32_t>(s), static_cast<int32_t>(t)));
+        }
+        std::sort(cross.begin(), cross.end());
+
+        // spans between crossings, inside w.r.t. the fill rule
+        int winding = 0;
+        for (std::size_t k = 0; k + 1 < cross.size(); ++k) {
+            winding += fill_rule == FILL_NONZERO ? cross[k].second : 1;
+            const bool inside = fill_rule == FILL_NONZERO ? winding != 0 : (winding & 1);
+            if (!inside)
+                continue;
+            const double s = std::max(0.0, std::ceil(cross[k].first));
+            const double e = std::min(double(width), std::floor(cross[k+1].first) + 1.0);
+            if (s < e)
+                segs.push_back(std::make_pair(static_cast<int32_t>(s), static_cast<int32_t>(e)));
+        }
+        if (segs.empty())
+            continue;
+
+        std::sort(segs.begin(), segs.end());
+        spans.clear();
+        for (std::size_t k = 0; k < segs.size(); ++k)
+            if (!spans.empty() && segs[k].first <= spans.back())
+                spans.back() = std::max(spans.back(), segs[k].second);
+            else {
+                spans.push_back(segs[k].first);
+                spans.push_back(segs[k].second);
+            }
+        emit(y, spans);
+    }
+}
+
+
+// SPAN_MASK
+// A binary mask stored as runs of set pixels, row by row.
+//
+class SpanMask
+{
+public:
+    SpanMask(unsigned long width, unsigned long height) :
+        w(static_cast<int32_t>(width)), rows(height) {}
+
+    unsigned long width() const { return w; }
+    unsigned long height() const { return rows.size(); }
+
+    // Number of set pixels.
+    unsigned long long area() const
+    {
+        uint64_t a = 0;
+        for (std::size_t y = 0; y < rows.size(); ++y)
+            a += count_runs(rows[y], 0, w);
+        return a;
+    }
+
+    // Number of runs (the storage is ~8 bytes per run).
+    unsigned long long n_runs() const
+    {
+        uint64_t n = 0;
+        for (std::size_t y = 0; y < rows.size(); ++y)
+            n += rows[y].size() / 2;
+        return n;
+    }
+
+    SpanMask copy() const { return *this; }
+
+    void clear()
+    {
+        for (std::size_t y = 0; y < rows.size(); ++y)
+            Runs().swap(rows[y]);
+    }
+
+    // ADD_POLYGONS
+    // Set the pixels inside a region bounded by one or more rings (e.g. a
+    // polygon and its holes), given in flat layout (see
+    // core.polygons_to_flat). A pixel (x, y) is set if it lies inside, under
+    // the given fill rule (FillRule), or on an edge (see rasterize_rings). The
+    // rings need not be closed.
+    //
+    // Args:
+    //  xy (PyObject): (n x 2) numpy.ndarray with the (x, y) vertex coordinates
+    //  offsets (PyObject): ring k is xy[offsets[k]:offsets[k+1]]
+    //  fill_rule (int): FILL_EVEN_ODD or FILL_NONZERO
+    //
+    // Returns:
+    //  0: success
+    // -1: invalid xy
+    // -2: invalid offsets
+    //
+    int add_polygons(PyObject* xy, PyObject* offsets, int fill_rule);
+
+    // Set this mask to its union/intersection with another one, of the same
+    // size. Return -3 on a size mismatch.
+    int unite(const SpanMask& m)
+    {
+        if (m.w != w || m.rows.size() != rows.size())
+            return -3;
+        Runs r;
+        for (std::size_t y = 0; y < rows.size(); ++y)
+            if (!m.rows[y].empty()) {
+                unite_runs(rows[y], m.rows[y], r);
+                rows[y].swap(r);
+            }
+        return 0;
+    }
+
+    int intersect(const SpanMask& m)
+    {
+        if (m.w != w || m.rows.size() != rows.size())
+            return -3;
+        Runs r;
+        for (std::size_t y = 0; y < rows.size(); ++y)
+            if (!rows[y].empty()) {
+                intersect_runs(rows[y], m.rows[y], r);
+                rows[y].swap(r);
+            }
+        return 0;
+    }
+
+    // COVERAGE
+    // Fraction of set pixels in each of a batch of windows; the parts of the
+    // windows outside the mask count as not set.
+    //
+    // Args:
+    //  windows (PyObject): (n x 4) numpy.ndarray with (x0, y0, width, height)
+    //      by rows
+    //  out (PyObject): PRE-ALLOCATED, C-contiguous float64 array with n elements
+    //
+    // Returns:
+    //  0: success
+    // -1: invalid windows or out
+    //
+    int coverage(PyObject* windows, PyObject* out);
+
+    // TO_DENSE
+    // Write the window of the mask with top-left corner (x0, y0) into a
+    // PRE-ALLOCATED, C-contiguous uint8 array (its shape giving the window
+    // size): set pixels get the given value, the others (including those
+    // outside the mask) 0.
+    //
+    // Returns:
+    //  0: success
+    // -1: invalid array
+    //
+    int to_dense(PyObject* dst, long x0, long y0, unsigned char value);
+
+    // MORPHOLOGY
+    // Binary dilation, erosion, opening or closing (MorphOp) with a disk of the
+    // given radius, on the runs, using n_threads threads (see the morphology
+    // section). Returns 0, or -1 for an unknown operation.
+    int morphology(int op, unsigned long radius, unsigned n_threads);
+
+private:
+    void dilate(unsigned long radius, unsigned n_threads);
+    void complement();
+
+    int32_t w;
+    std::vector<Runs> rows;
+};
+
+
+int SpanMask::add_polygons(PyObject* xy, PyObject* offsets, int fill_rule)
+{
+    std::vector<double> pts;
+    std::vector<npy_int64> off;
+    const int res = read_rings(xy, offsets, pts, off);
+    if (res != 0)
+        return res;
+
+    Py_BEGIN_ALLOW_THREADS
+    Runs r;
+    rasterize_rings(pts, off, fill_rule, w, rows.size(),
+                    [&](long y, const Runs& spans) {
+                        unite_runs(rows[y], spans, r);
+                        rows[y].swap(r);
+                    });
+    Py_END_ALLOW_THREADS
+
+    return 0;
+}
+
+
+int SpanMask::coverage(PyObject* windows, PyObject* out)
+{
+    PyArrayObject* win = (PyArrayObject*)PyArray_FROMANY(windows, NPY_INT64, 2, 2,
+                                                         NPY_ARRAY_IN_ARRAY);
+    if (!win) {
+        PyErr_Clear();
+        return -1;
+    }
+    const npy_intp n = PyArray_DIM(win, 0);
+    if (PyArray_DIM(win, 1) != 4 || !PyArray_Check(out) ||
+        PyArray_TYPE((PyArrayObject*)out) != NPY_FLOAT64 ||
+        !PyArray_IS_C_CONTIGUOUS((PyArrayObject*)out) ||
+        PyArray_SIZE((PyArrayObject*)out) != n) {
+        Py_DECREF(win);
+        return -1;
+    }
+    const npy_int64* q = (const npy_int64*)PyArray_DATA(win);
+    double* f = (double*)PyArray_DATA((PyArrayObject*)out);
+
+    Py_BEGIN_ALLOW_THREADS
+    const npy_int64 H = rows.size();
+    for (npy_intp k = 0; k < n; ++k, q += 4) {
+        if (q[2] <= 0 || q[3] <= 0) {
+            f[k] = 0.0;
+            continue;
+        }
+        const int32_t x0 = static_cast<int32_t>(std::max<npy_int64>(q[0], 0));
+        const int32_t x1 = static_cast<int32_t>(std::min<npy_int64>(q[0] + q[2], w));
+        const npy_int64 y1 = std::min(q[1] + q[3], H);
+        uint64_t c = 0;
+        if (x0 < x1)
+            for (npy_int64 y = std::max<npy_int64>(q[1], 0); y < y1; ++y)
+                c += count_runs(rows[y], x0, x1);
+        f[k] = double(c) / (double(q[2]) * double(q[3]));
+    }
+    Py_END_ALLOW_THREADS
+
+    Py_DECREF(win);
+
+    return 0;
+}
+
+
+int SpanMask::to_dense(PyObject* dst, long x0, long y0, unsigned char value)
+{
+    if (!PyArray_Check(dst))
+        return -1;
+    PyArrayObject* arr = (PyArrayObject*)dst;
+    if (PyArray_TYPE(arr) != NPY_UINT8 || PyArray_NDIM(arr) != 2 ||
+        !PyArray_IS_C_CONTIGUOUS(arr))
+        return -1;
+    const long dh = PyArray_DIM(arr, 0), dw = PyArray_DIM(arr, 1);
+    uint8_t* d = (uint8_t*)PyArray_DATA(arr);
+
+    Py_BEGIN_ALLOW_THREADS
+    std::memset(d, 0, std::size_t(dh) * dw);
+    const long H = rows.size();
+    for (long y = std::max(y0, 0L); y < std::min(y0 + dh, H); ++y) {
+        const Runs& a = rows[y];
+        uint8_t* row = d + std::size_t(y - y0) * dw;
+        for (std::size_t k = 0; k < a.size(); k += 2) {
+            const long s = std::max<long>(a[k], x0), e = std::min<long>(a[k+1], x0 + dw);
+            if (a[k] >= x0 + dw)
+                break;
+            if (s < e)
+                std::memset(row + (s - x0), value, e - s);
+        }
+    }
+    Py_END_ALLOW_THREADS
+
+    return 0;
+}
+
+
+//-- applying masks ---------------------------------------------------------
+
+// BLEND_SCALAR
+// dst[k] = keep[k] ? dst[k] : fill, for n elements.
+//
+template <typename T>
+static void blend_scalar(T* dst, const uint8_t* keep, std::size_t n, T fill)
+{
+    for (std::size_t k = 0; k < n; ++k)
+        if (!keep[k])
+            dst[k] = fill;
+}
+
+#ifdef QPATH2_X86
+// AVX2 versions of blend_scalar: select, 32 bytes at a time, between the
+// elements and the fill value, under the (byte) keep mask widened to the
+// element size.
+//
+__attribute__((target("avx2")))
+static void blend_avx2(uint8_t* dst, const uint8_t* keep, std::size_t n, uint8_t fill)
+{
+    const __m256i f = _mm256_set1_epi8(char(fill)), z = _mm256_setzero_si256();
+    std::size_t k = 0;
+    for (; k + 32 <= n; k += 32) {
+        __m256i m = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(keep + k)), z);
+        __m256i v = _mm256_loadu_si256((const __m256i*)(dst + k));
+        _mm256_storeu_si256((__m256i*)(dst + k), _mm256_blendv_epi8(v, f, m));
+    }
+    blend_scalar(dst + k, keep + k, n - k, fill);
+}
+
+__attribute__((target("avx2")))
+static void blend_avx2(uint16_t* dst, const uint8_t* keep, std::size_t n, uint16_t fill)
+{
+    const __m256i f = _mm256_set1_epi16(short(fill)), z = _mm256_setzero_si256();
+    std::size_t k = 0;
+    for (; k + 16 <= n; k += 16) {
+        __m256i m = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(keep + k)));
+        m = _mm256_cmpeq_epi16(m, z);
+        __m256i v = _mm256_loadu_si256((const __m256i*)(dst + k));
+        _mm256_storeu_si256((__m256i*)(dst + k), _mm256_blendv_epi8(v, f, m));
+    }
+    blend_scalar(dst + k, keep + k, n - k, fill);
+}
+
+__attribute__((target("avx2")))
+static void blend_avx2(float* dst, const uint8_t* keep, std::size_t n, float fill)
+{
+    const __m256 f = _mm256_set1_ps(fill);
+    const __m256i z = _mm256_setzero_si256();
+    std::size_t k = 0;
+    for (; k + 8 <= n; k += 8) {
+        __m256i m = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(keep + k)));
+        m = _mm256_cmpeq_epi32(m, z);
+        __m256 v = _mm256_loadu_ps(dst + k);
+        _mm256_storeu_ps(dst + k, _mm256_blendv_ps(v, f, _mm256_castsi256_ps(m)));
+    }
+    blend_scalar(dst + k, keep + k, n - k, fill);
+}
+
+// EXPAND3
+// Repeat each of 16 mask bytes 3 times (one per channel of RGB pixels).
+//
+__attribute__((target("avx2")))
+static void expand3(const uint8_t* m, uint8_t* e)
+{
+    const __m128i v = _mm_loadu_si128((const __m128i*)m);
+    _mm_storeu_si128((__m128i*)e, _mm_shuffle_epi8(v,
+        _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5)));
+    _mm_storeu_si128((__m128i*)(e + 16), _mm_shuffle_epi8(v,
+        _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10)));
+    _mm_storeu_si128((__m128i*)(e + 32), _mm_shuffle_epi8(v,
+        _mm_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15)));
+}
+
+static bool has_avx2()
+{
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+#endif
+
+
+// MASK_ROW
+// Apply the mask to a row of w pixels with c interleaved channels. The mask is
+// widened to one byte per channel in blocks of 16 pixels, kept on the stack,
+// so the row is traversed once.
+//
+template <typename T>
+static void mask_row(T* px, const uint8_t* m, std::size_t w, std::size_t c, T fill)
+{
+#ifdef QPATH2_X86
+    if (has_avx2()) {
+        if (c == 1) {
+            blend_avx2(px, m, w, fill);
+            return;
+        }
+        uint8_t e[16 * 4];
+        std::size_t x = 0;
+        if (c <= 4)
+            for (; x + 16 <= w; x += 16, px += 16 * c, m += 16) {
+                if (c == 3)
+                    expand3(m, e);
+                else
+                    for (std::size_t k = 0; k < 16 * c; ++k)
+                        e[k] = m[k / c];
+                blend_avx2(px, e, 16 * c, fill);
+            }
+        for (; x < w; ++x, px += c, ++m)
+            if (!*m)
+                for (std::size_t k = 0; k < c; ++k)
+                    px[k] = fill;
+        return;
+    }
+#endif
+    for (std::size_t x = 0; x < w; ++x, px += c)
+        if (!m[x])
+            for (std::size_t k = 0; k < c; ++k)
+                px[k] = fill;
+}
+
+
+template <typename T>
+static void mask_image(PyArrayObject* img, PyArrayObject* msk, double fill)
+{
+    const std::size_t h = PyArray_DIM(img, 0), w = PyArray_DIM(img, 1);
+    const std::size_t c = PyArray_NDIM(img) == 3 ? PyArray_DIM(img, 2) : 1;
+    const T f = static_cast<T>(fill);
+    for (std::size_t y = 0; y < h; ++y)
+        mask_row((T*)((char*)PyArray_DATA(img) + y * PyArray_STRIDE(img, 0)),
+                 (const uint8_t*)PyArray_DATA(msk) + y * PyArray_STRIDE(msk, 0),
+                 w, c, f);
+}
+
+
+// APPLY_MASK
+// Keep the pixels of an image where the mask is non-zero and set all their
+// channels to a fill value elsewhere, in place and in a single pass (AVX2
+// vectorized, if the CPU supports it).
+//
+// Args:
+//  img (PyObject): numpy.ndarray (uint8, uint16 or float32) of shape
+//      (height, width[, channels]), with contiguous (interleaved) pixels in
+//      each row
+//  mask (PyObject): numpy.ndarray (uint8 or bool) of shape (height, width),
+//      with contiguous rows
+//  fill (double): value set outside the mask
+//
+// Returns:
+//  0: success
+// -1: unsupported image type or layout
+// -2: unsupported mask type or layout
+// -3: shape mismatch
+//
+int apply_mask(PyObject* img, PyObject* mask, double fill)
+{
+    if (!PyArray_Check(img) || !PyArray_Check(mask))
+        return !PyArray_Check(img) ? -1 : -2;
+    PyArrayObject* a = (PyArrayObject*)img;
+    PyArrayObject* m = (PyArrayObject*)mask;
+
+    const int nd = PyArray_NDIM(a);
+    const npy_intp isz = PyArray_ITEMSIZE(a);
+    if ((nd != 2 && nd != 3) || !PyArray_ISWRITEABLE(a) ||
+        PyArray_STRIDE(a, nd - 1) != isz ||
+        (nd == 3 && PyArray_STRIDE(a, 1) != isz * PyArray_DIM(a, 2)))
+        return -1;
+    const int t = PyArray_TYPE(a);
+    if (t != NPY_UINT8 && t != NPY_UINT16 && t != NPY_FLOAT32)
+        return -1;
+    if (PyArray_NDIM(m) != 2 || PyArray_ITEMSIZE(m) != 1 || PyArray_STRIDE(m, 1) != 1 ||
+        (PyArray_TYPE(m) != NPY_UINT8 && PyArray_TYPE(m) != NPY_BOOL))
+        return -2;
+    if (PyArray_DIM(m, 0) != PyArray_DIM(a, 0) || PyArray_DIM(m, 1) != PyArray_DIM(a, 1))
+        return -3;
+
+    Py_BEGIN_ALLOW_THREADS
+    if (t == NPY_UINT8)
+        mask_image<uint8_t>(a, m, fill);
+    else if (t == NPY_UINT16)
+        mask_image<uint16_t>(a, m, fill);
+    else
+        mask_image<float>(a, m, fill);
+    Py_END_ALLOW_THREADS
+
+    return 0;
+}
+
+
+// NN_INDEX
+// Nearest neighbour map of the samples [first, first + n) of a dimension of
+// n_dst samples onto one of n_src samples (as skimage.transform.resize with
+// order=0): dst i <- src (i + 1/2) n_src / n_dst.
+//
+static void nn_index(std::size_t first, std::size_t n, std::size_t n_dst, std::size_t n_src,
+                     std::vector<std::size_t>& idx)
+{
+    idx.resize(n);
+    for (std::size_t i = 0; i < n; ++i)
+        idx[i] = std::min((2 * (first + i) + 1) * n_src / (2 * n_dst), n_src - 1);
+}
+
+
+template <typename T>
+static void mask_image_scaled(PyArrayObject* img, PyArrayObject* msk, std::size_t full_w,
+                              std::size_t full_h, std::size_t x0, std::size_t y0, double fill)
+{
+    const std::size_t h = PyArray_DIM(img, 0), w = PyArray_DIM(img, 1);
+    const std::size_t c = PyArray_NDIM(img) == 3 ? PyArray_DIM(img, 2) : 1;
+    const T f = static_cast<T>(fill);
+
+    std::vector<std::size_t> rows, cols;
+    nn_index(y0, h, full_h, PyArray_DIM(msk, 0), rows);
+    nn_index(x0, w, full_w, PyArray_DIM(msk, 1), cols);
+
+    // the upscaled mask row, rebuilt only when the mask row changes
+    std::vector<uint8_t> keep(w);
+    std::size_t last = rows.empty() ? 0 : rows[0] + 1;
+    for (std::size_t y = 0; y < h; ++y) {
+        if (rows[y] != last) {
+            last = rows[y];
+            const uint8_t* m = (const uint8_t*)PyArray_DATA(msk) + last * PyArray_STRIDE(msk, 0);
+            for (std::size_t x = 0; x < w; ++x)
+                keep[x] = m[cols[x]];
+        }
+        mask_row((T*)((char*)PyArray_DATA(img) + y * PyArray_STRIDE(img, 0)), &keep[0], w, c, f);
+    }
+}
+
+
+// APPLY_SCALED_MASK
+// Same as apply_mask, with a low resolution mask: img is the window with
+// top-left corner (x0, y0) of a (full_width x full_height) image covered by
+// the mask, which is upscaled on the fly, by nearest neighbour, one output
+// row at a time (the full resolution mask is never built).
+//
+// Returns:
+//  0: success
+// -1: unsupported image type or layout
+// -2: unsupported mask type or layout
+// -3: the window is not inside the full image
+//
+int apply_scaled_mask(PyObject* img, PyObject* mask, unsigned long full_width,
+                      unsigned long full_height, long x0, long y0, double fill)
+{
+    if (!PyArray_Check(img) || !PyArray_Check(mask))
+        return !PyArray_Check(img) ? -1 : -2;
+    PyArrayObject* a = (PyArrayObject*)img;
+    PyArrayObject* m = (PyArrayObject*)mask;
+
+    const int nd = PyArray_NDIM(a);
+    const npy_intp isz = PyArray_ITEMSIZE(a);
+    if ((nd != 2 && nd != 3) || !PyArray_ISWRITEABLE(a) ||
+        PyArray_STRIDE(a, nd - 1) != isz ||
+        (nd == 3 && PyArray_STRIDE(a, 1) != isz * PyArray_DIM(a, 2)))
+        return -1;
+    const int t = PyArray_TYPE(a);
+    if (t != NPY_UINT8 && t != NPY_UINT16 && t != NPY_FLOAT32)
+        return -1;
+    if (PyArray_NDIM(m) != 2 || PyArray_ITEMSIZE(m) != 1 || PyArray_STRIDE(m, 1) != 1 ||
+        (PyArray_TYPE(m) != NPY_UINT8 && PyArray_TYPE(m) != NPY_BOOL) || PyArray_SIZE(m) == 0)
+        return -2;
+    if (x0 < 0 || y0 < 0 ||
+        std::size_t(x0) + PyArray_DIM(a, 1) > full_width ||
+        std::size_t(y0) + PyArray_DIM(a, 0) > full_height)
+        return -3;
+
+    Py_BEGIN_ALLOW_THREADS
+    if (t == NPY_UINT8)
+        mask_image_scaled<uint8_t>(a, m, full_width, full_height, x0, y0, fill);
+    else if (t == NPY_UINT16)
+        mask_image_scaled<uint16_t>(a, m, full_width, full_height, x0, y0, fill);
+    else
+        mask_image_scaled<float>(a, m, full_width, full_height, x0, y0, fill);
+    Py_END_ALLOW_THREADS
+
+    return 0;
+}
+
+
+//-- coverage of windows --------------------------------------------------
+
+// COVERAGE_MAP
+// The summed-area table of a (low resolution) binary mask, answering "which
+// fraction of a window is foreground" in constant time. The windows may be
+// given in the coordinates of any level of the image the mask was computed
+// from, through a scale factor (mask pixels per window unit): the table is
+// interpolated bilinearly, which is exact for a mask of constant pixels, so
+// windows not aligned with the mask pixels are covered by the exact area.
+//
+class CoverageMap
+{
+public:
+    CoverageMap() : w(0), h(0) {}
+
+    unsigned long width() const { return w; }
+    unsigned long height() const { return h; }
+
+    // BUILD
+    // Compute the table from a mask (numpy.ndarray, 2D, any non-zero value being
+    // foreground).
+    //
+    // Returns:
+    //  0: success
+    // -1: invalid mask
+    //
+    int build(PyObject* mask)
+    {
+        PyArrayObject* arr = (PyArrayObject*)PyArray_FROMANY(mask, NPY_UINT8, 2, 2,
+                                                             NPY_ARRAY_IN_ARRAY);
+        if (!arr) {
+            PyErr_Clear();
+            return -1;
+        }
+        if (PyArray_SIZE(arr) == 0) {
+            Py_DECREF(arr);
+            return -1;
+        }
+        h = PyArray_DIM(arr, 0);
+        w = PyArray_DIM(arr, 1);
+        const uint8_t* m = (const uint8_t*)PyArray_DATA(arr);
+
+        Py_BEGIN_ALLOW_THREADS
+        sat.assign((h + 1) * (w + 1), 0);
+        for (std::size_t y = 0; y < h; ++y) {
+            uint32_t row = 0;
+            const uint32_t* up = &sat[y * (w + 1)];
+            uint32_t* s = &sat[(y + 1) * (w + 1)];
+            for (std::size_t x = 0; x < w; ++x) {
+                row += m[y * w + x] != 0;
+                s[x + 1] = up[x + 1] + row;
+            }
+        }
+        Py_END_ALLOW_THREADS
+
+        Py_DECREF(arr);
+
+        return 0;
+    }
+
+    // COVERAGE
+    // Foreground fraction of a batch of windows; the parts of the windows
+    // outside the mask count as background.
+    //
+    // Args:
+    //  windows (PyObject): (n x 4) numpy.ndarray with (x0, y0, width, height)
+    //      by rows
+    //  scale (double): size of a window unit, in mask pixels
+    //  out (PyObject): PRE-ALLOCATED, C-contiguous float64 array with n elements
+    //
+    // Returns:
+    //  0: success
+    // -1: invalid windows or out
+    // -3: no table built
+    //
+    int coverage(PyObject* windows, double scale, PyObject* out) const
+    {
+        if (sat.empty())
+            return -3;
+        PyArrayObject* win = (PyArrayObject*)PyArray_FROMANY(windows, NPY_FLOAT64, 2, 2,
+                                                             NPY_ARRAY_IN_ARRAY);
+        if (!win) {
+            PyErr_Clear();
+            return -1;
+        }
+        const npy_intp n = PyArray_DIM(win, 0);
+        if (PyArray_DIM(win, 1) != 4 || !PyArray_Check(out) ||
+            PyArray_TYPE((PyArrayObject*)out) != NPY_FLOAT64 ||
+            !PyArray_IS_C_CONTIGUOUS((PyArrayObject*)out) ||
+            PyArray_SIZE((PyArrayObject*)out) != n) {
+            Py_DECREF(win);
+            return -1;
+        }
+        const double* q = (const double*)PyArray_DATA(win);
+        double* f = (double*)PyArray_DATA((PyArrayObject*)out);
+
+        Py_BEGIN_ALLOW_THREADS
+        for (npy_intp k = 0; k < n; ++k, q += 4) {
+            const double a = q[2] * q[3] * scale * scale;
+            if (a <= 0.0) {
+                f[k] = 0.0;
+                continue;
+            }
+            const double x0 = q[0] * scale, y0 = q[1] * scale;
+            const double x1 = x0 + q[2] * scale, y1 = y0 + q[3] * scale;
+            f[k] = (area(x1, y1) - area(x0, y1) - area(x1, y0) + area(x0, y0)) / a;
+        }
+        Py_END_ALLOW_THREADS
+
+        Py_DECREF(win);
+
+        return 0;
+    }
+
+private:
+    // foreground area of [0, x) x [0, y)
+    double area(double x, double y) const
+    {
+        x = std::min(std::max(x, 0.0), double(w));
+        y = std::min(std::max(y, 0.0), double(h));
+        const std::size_t ix = std::min(std::size_t(x), w - 1), iy = std::min(std::size_t(y), h - 1);
+        const double fx = x - ix, fy = y - iy;      // in [0, 1]
+        const uint32_t* s0 = &sat[iy * (w + 1) + ix];
+        const uint32_t* s1 = s0 + (w + 1);
+        return (1 - fy) * ((1 - fx) * s0[0] + fx * s0[1]) + fy * ((1 - fx) * s1[0] + fx * s1[1]);
+    }
+
+    std::size_t w, h;
+    std::vector<uint32_t> sat;    // (h+1) x (w+1), with a leading row/column of 0s
+};
+
+
+//-- bit-packed masks ------------------------------------------------------
+
+enum BitOp {
+    BIT_AND = 0,
+    BIT_OR = 1,
+    BIT_NOT = 2
+};
+
+// BIT_OP
+// a = a op b (or a = ~a), over n words.
+//
+static void bit_op_scalar(uint64_t* a, const uint64_t* b, std::size_t n, int op)
+{
+    for (std::size_t k = 0; k < n; ++k)
+        a[k] = op == BIT_AND ? a[k] & b[k] : op == BIT_OR ? a[k] | b[k] : ~a[k];
+}
+
+static uint64_t popcount_scalar(const uint64_t* a, std::size_t n)
+{
+    uint64_t c = 0;
+    for (std::size_t k = 0; k < n; ++k)
+        c += __builtin_popcountll(a[k]);
+    return c;
+}
+
+#ifdef QPATH2_X86
+// n is a multiple of 4 and a, b are 32-byte aligned (see BitMask).
+__attribute__((target("avx2")))
+static void bit_op_avx2(uint64_t* a, const uint64_t* b, std::size_t n, int op)
+{
+    const __m256i ones = _mm256_set1_epi8(char(0xff));
+    for (std::size_t k = 0; k < n; k += 4) {
+        const __m256i va = _mm256_load_si256((const __m256i*)(a + k));
+        __m256i r;
+        if (op == BIT_AND)
+            r = _mm256_and_si256(va, _mm256_load_si256((const __m256i*)(b + k)));
+        else if (op == BIT_OR)
+            r = _mm256_or_si256(va, _mm256_load_si256((const __m256i*)(b + k)));
+        else
+            r = _mm256_xor_si256(va, ones);
+        _mm256_store_si256((__m256i*)(a + k), r);
+    }
+}
+
+__attribute__((target("popcnt")))
+static uint64_t popcount_hw(const uint64_t* a, std::size_t n)
+{
+    uint64_t c = 0;
+    for (std::size_t k = 0; k < n; ++k)
+        c += __builtin_popcountll(a[k]);
+    return c;
+}
+
+// PACK32_AVX2
+// 32 bits, one for each non-zero byte of m.
+__attribute__((target("avx2")))
+static uint32_t pack32_avx2(const uint8_t* m)
+{
+    const __m256i z = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)m),
+                                        _mm256_setzero_si256());
+    return ~static_cast<uint32_t>(_mm256_movemask_epi8(z));
+}
+
+static bool has_popcnt()
+{
+    static const bool popcnt = __builtin_cpu_supports("popcnt");
+    return popcnt;
+}
+#endif
+
+static void bit_op(uint64_t* a, const uint64_t* b, std::size_t n, int op)
+{
+#ifdef QPATH2_X86
+    if (has_avx2()) {
+        bit_op_avx2(a, b, n, op);
+        return;
+    }
+#endif
+    bit_op_scalar(a, b, n, op);
+}
+
+static uint64_t popcount(const uint64_t* a, std::size_t n)
+{
+#ifdef QPATH2_X86
+    if (has_popcnt())
+        return popcount_hw(a, n);
+#endif
+    return popcount_scalar(a, n);
+}
+
+
+// BIT_MASK
+// A binary mask with 1 bit per pixel: bit x of a row is bit (x % 64) of its
+// word x / 64. The rows are padded to a multiple of 256 bits and aligned on
+// 32 bytes, for AVX2 processing; the padding bits are always 0.
+//
+class BitMask
+{
+public:
+    BitMask(unsigned long width, unsigned long height) :
+        w(width), h(height), stride(4 * ((width + 255) / 256)), bits(0)
+    {
+        allocate();
+        std::memset(bits, 0, n_words() * sizeof(uint64_t));
+    }
+
+    BitMask(const BitMask& m) : w(m.w), h(m.h), stride(m.stride), bits(0)
+    {
+        allocate();
+        std::memcpy(bits, m.bits, n_words() * sizeof(uint64_t));
+    }
+
+    ~BitMask() { std::free(bits); }
+
+    unsigned long width() const { return w; }
+    unsigned long height() const { return h; }
+    unsigned long long nbytes() const { return n_words() * sizeof(uint64_t); }
+
+    BitMask copy() const { return *this; }
+
+    // Number of set pixels.
+    unsigned long long area() const { return popcount(bits, n_words()); }
+
+    // ADD_POLYGONS
+    // Set the pixels inside a region bounded by rings in flat layout (see
+    // SpanMask::add_polygons, with the same arguments and return codes).
+    int add_polygons(PyObject* xy, PyObject* offsets, int fill_rule)
+    {
+        std::vector<double> pts;
+        std::vector<npy_int64> off;
+        const int res = read_rings(xy, offsets, pts, off);
+        if (res != 0)
+            return res;
+
+        Py_BEGIN_ALLOW_THREADS
+        rasterize_rings(pts, off, fill_rule, static_cast<int32_t>(w), static_cast<long>(h),
+                        [&](long y, const Runs& spans) {
+                            for (std::size_t k = 0; k < spans.size(); k += 2)
+                                set_run(row(y), spans[k], spans[k+1]);
+                        });
+        Py_END_ALLOW_THREADS
+
+        return 0;
+    }
+
+    // FROM_DENSE
+    // Set the pixels corresponding to the non-zero elements of a (height x width)
+    // uint8 or bool array; the others are cleared.
+    //
+    // Returns:
+    //  0: success
+    // -1: invalid array
+    // -3: shape mismatch
+    //
+    int from_dense(PyObject* src)
+    {
+        if (!PyArray_Check(src))
+            return -1;
+        if (std::size_t(PyArray_DIM((PyArrayObject*)src, 0)) != h)
+            return -3;
+        return set_rows(src, 0);
+    }
+
+    // SET_ROWS
+    // Same as from_dense, for a band of rows (uint8 or bool array, rows x
+    // width) starting at row y0, e.g. for building the mask band by band.
+    //
+    // Returns:
+    //  0: success
+    // -1: invalid array
+    // -3: shape mismatch (or rows beyond the mask)
+    //
+    int set_rows(PyObject* src, unsigned long y0)
+    {
+        if (!PyArray_Check(src))
+            return -1;
+        PyArrayObject* arr = (PyArrayObject*)src;
+        if (PyArray_NDIM(arr) != 2 || PyArray_ITEMSIZE(arr) != 1 || PyArray_STRIDE(arr, 1) != 1 ||
+            (PyArray_TYPE(arr) != NPY_UINT8 && PyArray_TYPE(arr) != NPY_BOOL))
+            return -1;
+        const std::size_t n = PyArray_DIM(arr, 0);
+        if (y0 + n > h || std::size_t(PyArray_DIM(arr, 1)) != w)
+            return -3;
+
+        Py_BEGIN_ALLOW_THREADS
+        for (std::size_t y = 0; y < n; ++y) {
+            const uint8_t* m = (const uint8_t*)PyArray_DATA(arr) + y * PyArray_STRIDE(arr, 0);
+            uint64_t* r = row(y0 + y);
+            std::size_t x = 0;
+#ifdef QPATH2_X86
+            if (has_avx2())
+                for (; x + 64 <= w; x += 64)
+                    r[x >> 6] = uint64_t(pack32_avx2(m + x)) | (uint64_t(pack32_avx2(m + x + 32)) << 32);
+#endif
+            for (; x < w; x += 64) {
+                uint64_t b = 0;
+                for (std::size_t k = 0; k < 64 && x + k < w; ++k)
+                    b |= uint64_t(m[x + k] != 0) << k;
+                r[x >> 6] = b;
+            }
+        }
+        Py_END_ALLOW_THREADS
+
+        return 0;
+    }
+
+    // Set this mask to its intersection/union with another one, of the same
+    // size, or to its complement. Return -3 on a size mismatch.
+    int intersect(const BitMask& m) { return combine(m, BIT_AND); }
+    int unite(const BitMask& m) { return combine(m, BIT_OR); }
+
+    void invert()
+    {
+        bit_op(bits, 0, n_words(), BIT_NOT);
+        clear_padding();
+    }
+
+    // TILE_COVERAGE
+    // Fraction of set pixels of each tile of a regular grid (tiles of
+    // tile_width x tile_height, the right-most and bottom-most ones possibly
+    // smaller).
+    //
+    // Args:
+    //  tile_width, tile_height (unsigned long): tile size
+    //  out (PyObject): PRE-ALLOCATED, C-contiguous float64 array of shape
+    //      (n_tiles_vert, n_tiles_horiz)
+    //
+    // Returns:
+    //  0: success
+    // -1: invalid out or tile size
+    //
+    int tile_coverage(unsigned long tile_width, unsigned long tile_height, PyObject* out) const
+    {
+        if (tile_width == 0 || tile_height == 0 || !PyArray_Check(out))
+            return -1;
+        PyArrayObject* arr = (PyArrayObject*)out;
+        const std::size_t nh = (w + tile_width - 1) / tile_width, nv = (h + tile_height - 1) / tile_height;
+        if (PyArray_TYPE(arr) != NPY_FLOAT64 || !PyArray_IS_C_CONTIGUOUS(arr) ||
+            PyArray_NDIM(arr) != 2 || std::size_t(PyArray_DIM(arr, 0)) != nv ||
+            std::size_t(PyArray_DIM(arr, 1)) != nh)
+            return -1;
+        double* f = (double*)PyArray_DATA(arr);
+
+        Py_BEGIN_ALLOW_THREADS
+        std::vector<uint64_t> c(nh);
+        for (std::size_t i = 0; i < nv; ++i) {
+            std::fill(c.begin(), c.end(), 0);
+            const std::size_t y1 = std::min(h, (i + 1) * tile_height);
+            for (std::size_t y = i * tile_height; y < y1; ++y)
+                for (std::size_t j = 0; j < nh; ++j)
+                    c[j] += count_range(row(y), j * tile_width, std::min(w, (j + 1) * tile_width));
+            for (std::size_t j = 0; j < nh; ++j)
+                f[i * nh + j] = double(c[j]) /
+                    (double(std::min(w, (j + 1) * tile_width) - j * tile_width) * (y1 - i * tile_height));
+        }
+        Py_END_ALLOW_THREADS
+
+        return 0;
+    }
+
+    // MORPHOLOGY
+    // As SpanMask::morphology, bit-parallel.
+    int morphology(int op, unsigned long radius, unsigned n_threads);
+
+    // TO_DENSE
+    // Expand the window of the mask with top-left corner (x0, y0) into a
+    // PRE-ALLOCATED, C-contiguous uint8 array (its shape giving the window
+    // size): set pixels get the given value, the others (including those
+    // outside the mask) 0. Bits are expanded 8 at a time, by table lookup.
+    //
+    // Returns:
+    //  0: success
+    // -1: invalid array
+    //
+    int to_dense(PyObject* dst, long x0, long y0, unsigned char value) const
+    {
+        if (!PyArray_Check(dst))
+            return -1;
+        PyArrayObject* arr = (PyArrayObject*)dst;
+        if (PyArray_TYPE(arr) != NPY_UINT8 || PyArray_NDIM(arr) != 2 ||
+            !PyArray_IS_C_CONTIGUOUS(arr))
+            return -1;
+        const long dh = PyArray_DIM(arr, 0), dw = PyArray_DIM(arr, 1);
+        uint8_t* d = (uint8_t*)PyArray_DATA(arr);
+
+        Py_BEGIN_ALLOW_THREADS
+        uint64_t lut[256];
+        for (unsigned b = 0; b < 256; ++b) {
+            lut[b] = 0;
+            for (unsigned k = 0; k < 8; ++k)
+                if (b & (1u << k))
+                    lut[b] |= uint64_t(value) << (8 * k);   // little endian
+        }
+
+        std::memset(d, 0, std::size_t(dh) * dw);
+        const long xb = std::max(x0, 0L), xe = std::min(x0 + dw, long(w));
+        for (long y = std::max(y0, 0L); y < std::min(y0 + dh, long(h)); ++y) {
+            const uint64_t* r = row(y);
+            uint8_t* o = d + std::size_t(y - y0) * dw - x0;
+            long x = xb;
+            for (; x + 8 <= xe; x += 8)
+                std::memcpy(o + x, &lut[bits8(r, x)], 8);
+            for (; x < xe; ++x)
+                if ((r[x >> 6] >> (x & 63)) & 1)
+                    o[x] = value;
+        }
+        Py_END_ALLOW_THREADS
+
+        return 0;
+    }
+
+private:
+    BitMask& operator=(const BitMask&);
+
+    void dilate(unsigned long radius, unsigned n_threads);
+
+    std::size_t n_words() const { return stride * h; }
+
+    void allocate()
+    {
+        void* p = 0;
+        if (posix_memalign(&p, 32, std::max<std::size_t>(n_words(), 4) * sizeof(uint64_t)) != 0)
+            throw std::bad_alloc();
+        bits = static_cast<uint64_t*>(p);
+    }
+
+    uint64_t* row(std::size_t y) { return bits + y * stride; }
+    const uint64_t* row(std::size_t y) const { return bits + y * stride; }
+
+    // set the bits [s, e) of a row
+    static void set_run(uint64_t* r, std::size_t s, std::size_t e)
+    {
+        if (s >= e)
+            return;
+        const std::size_t ws = s >> 6, we = (e - 1) >> 6;
+        const uint64_t ms = ~uint64_t(0) << (s & 63);
+        const uint64_t me = ~uint64_t(0) >> (63 - ((e - 1) & 63));
+        if (ws == we) {
+            r[ws] |= ms & me;
+            return;
+        }
+        r[ws] |= ms;
+        for (std::size_t k = ws + 1; k < we; ++k)
+            r[k] = ~uint64_t(0);
+        r[we] |= me;
+    }
+
+    // number of set bits [s, e) of a row
+    static uint64_t count_range(const uint64_t* r, std::size_t s, std::size_t e)
+    {
+        if (s >= e)
+            return 0;
+        const std::size_t ws = s >> 6, we = (e - 1) >> 6;
+        const uint64_t ms = ~uint64_t(0) << (s & 63);
+        const uint64_t me = ~uint64_t(0) >> (63 - ((e - 1) & 63));
+        if (ws == we)
+            return __builtin_popcountll(r[ws] & ms & me);
+        return __builtin_popcountll(r[ws] & ms) + popcount(r + ws + 1, we - ws - 1) +
+               __builtin_popcountll(r[we] & me);
+    }
+
+    // the 8 bits starting at x (x + 8 <= w)
+    static unsigned bits8(const uint64_t* r, std::size_t x)
+    {
+        const unsigned sh = x & 63;
+        uint64_t b = r[x >> 6] >> sh;
+        if (sh > 56)
+            b |= r[(x >> 6) + 1] << (64 - sh);
+        return unsigned(b & 0xff);
+    }
+
+    int combine(const BitMask& m, int op)
+    {
+        if (m.w != w || m.h != h)
+            return -3;
+        bit_op(bits, m.bits, n_words(), op);
+        return 0;
+    }
+
+    void clear_padding()
+    {
+        if (w == stride * 64)
+            return;
+        for (std::size_t y = 0; y < h; ++y) {
+            uint64_t* r = row(y);
+            if (w & 63)
+                r[w >> 6] &= ~uint64_t(0) >> (64 - (w & 63));
+            for (std::size_t k = (w + 63) >> 6; k < stride; ++k)
+                r[k] = 0;
+        }
+    }
+
+    std::size_t w, h, stride;   // stride in words
+    uint64_t* bits;
+};
+
+
+//-- morphology -------------------------------------------------------------
+
+// The structuring element is a disk: the offsets (dx, dy) with dx^2 + dy^2 <=
+// radius^2 (as skimage.morphology.disk), decomposed into horizontal runs. The
+// pixels outside the mask are background for the dilation and foreground for
+// the erosion (as for skimage.morphology.binary_erosion), so an erosion is the
+// complement of the dilation of the complement. The rows are split among
+// n_threads threads (0: one per CPU core).
+
+// DISK_HALF_WIDTHS
+// Row dy of the disk spans dx in [-hw[|dy|], hw[|dy|]]; hw is non-increasing.
+//
+static std::vector<long> disk_half_widths(unsigned long radius)
+{
+    std::vector<long> hw(radius + 1);
+    const long long r2 = (long long)radius * radius;
+    long k = radius;
+    for (unsigned long dy = 0; dy <= radius; ++dy) {
+        while ((long long)k * k > r2 - (long long)dy * dy)
+            --k;
+        hw[dy] = k;
+    }
+    return hw;
+}
+
+
+// PARALLEL_ROWS
+// Call fn(y0, y1) on contiguous ranges of the rows [0, h), in parallel.
+//
+template <typename Fn>
+static void parallel_rows(std::size_t h, unsigned n_threads, Fn fn)
+{
+    if (n_threads == 0)
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+    n_threads = static_cast<unsigned>(std::min<std::size_t>(n_threads, (h + 255) / 256));
+    if (n_threads <= 1) {
+        fn(std::size_t(0), h);
+        return;
+    }
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < n_threads; ++t)
+        pool.push_back(std::thread(fn, h * t / n_threads, h * (t + 1) / n_threads));
+    for (std::size_t t = 0; t < pool.size(); ++t)
+        pool[t].join();
+}
+
+
+// SpanMask: each row of the result is the union of the runs of the rows
+// y - radius ... y + radius, widened by the half width of the disk row.
+//
+void SpanMask::dilate(unsigned long radius, unsigned n_threads)
+{
+    const std::vector<long> hw = disk_half_widths(radius);
+    const long r = static_cast<long>(radius), h = static_cast<long>(rows.size());
+    std::vector<Runs> out(rows.size());
+
+    parallel_rows(rows.size(), n_threads, [&](std::size_t y0, std::size_t y1) {
+        std::vector<std::pair<int32_t, int32_t> > iv;
+        for (long y = long(y0); y < long(y1); ++y) {
+            iv.clear();
+            for (long yy = std::max(y - r, 0L); yy <= std::min(y + r, h - 1); ++yy) {
+                const int32_t k = static_cast<int32_t>(hw[std::labs(yy - y)]);
+                const Runs& a = rows[yy];
+                for (std::size_t i = 0; i < a.size(); i += 2)
+                    iv.push_back(std::make_pair(std::max(a[i] - k, 0), std::min(a[i+1] + k, w)));
+            }
+            std::sort(iv.begin(), iv.end());
+            Runs& o = out[y];
+            for (std::size_t i = 0; i < iv.size(); ++i)
+                if (!o.empty() && iv[i].first <= o.back())
+                    o.back() = std::max(o.back(), iv[i].second);
+                else {
+                    o.push_back(iv[i].first);
+                    o.push_back(iv[i].second);
+                }
+        }
+    });
+
+    rows.swap(out);
+}
+
+void SpanMask::complement()
+{
+    Runs c;
+    for (std::size_t y = 0; y < rows.size(); ++y) {
+        const Runs& a = rows[y];
+        c.clear();
+        int32_t x = 0;
+        for (std::size_t i = 0; i < a.size(); i += 2) {
+            if (a[i] > x) {
+                c.push_back(x);
+                c.push_back(a[i]);
+            }
+            x = a[i+1];
+        }
+        if (x < w) {
+            c.push_back(x);
+            c.push_back(w);
+        }
+        rows[y].swap(c);
+    }
+}
+
+int SpanMask::morphology(int op, unsigned long radius, unsigned n_threads)
+{
+    if (op < MORPH_DILATE || op > MORPH_CLOSE)
+        return -1;
+    if (radius == 0)
+        return 0;
+
+    Py_BEGIN_ALLOW_THREADS
+    for (int step = 0; step < 2; ++step) {
+        // opening: erode, dilate; closing: dilate, erode
+        const bool erode = op == MORPH_ERODE || (op == MORPH_OPEN && step == 0) ||
+            (op == MORPH_CLOSE && step == 1);
+        if (erode)
+            complement();
+        dilate(radius, n_threads);
+        if (erode)
+            complement();
+        if (op == MORPH_DILATE || op == MORPH_ERODE)
+            break;
+    }
+    Py_END_ALLOW_THREADS
+
+    return 0;
+}
+
+
+// BitMask: bit-parallel, 64 pixels per word operation. Each input row is
+// widened one pixel at a time (a shift by one bit in both directions), and
+// ORed into the output rows at the distances whose disk row has the current
+// half width.
+//
+void BitMask::dilate(unsigned long radius, unsigned n_threads)
+{
+    const std::vector<long> hw = disk_half_widths(radius);
+    const long r = static_cast<long>(radius);
+    void* p = 0;
+    if (posix_memalign(&p, 32, std::max<std::size_t>(n_words(), 4) * sizeof(uint64_t)) != 0)
+        throw std::bad_alloc();
+    uint64_t* out = static_cast<uint64_t*>(p);
+    std::memset(out, 0, n_words() * sizeof(uint64_t));
+
+    parallel_rows(h, n_threads, [&](std::size_t y0, std::size_t y1) {
+        // the widened row, with a 0 word on each side
+        std::vector<uint64_t> cur(stride + 2, 0), nxt(stride + 2, 0);
+        const long yb = std::max(long(y0) - r, 0L), ye = std::min(long(y1) + r, long(h));
+        for (long yi = yb; yi < ye; ++yi) {
+            const uint64_t* src = row(yi);
+            std::size_t n = stride;
+            while (n > 0 && src[n-1] == 0)
+                --n;
+            if (n == 0)
+                continue;
+            std::copy(src, src + stride, cur.begin() + 1);
+            long d = r;
+            for (long k = 0; ; ++k) {
+                for (; d >= 0 && hw[d] == k; --d) {
+                    const long ya = yi - d, yz = yi + d;
+                    if (ya >= long(y0) && ya < long(y1))
+                        for (std::size_t i = 0; i < stride; ++i)
+                            out[ya * stride + i] |= cur[i+1];
+                    if (d > 0 && yz >= long(y0) && yz < long(y1))
+                        for (std::size_t i = 0; i < stride; ++i)
+                            out[yz * stride + i] |= cur[i+1];
+                }
+                if (d < 0)
+                    break;
+                for (std::size_t i = 1; i <= stride; ++i)
+                    nxt[i] = cur[i] | (cur[i] << 1) | (cur[i-1] >> 63) | (cur[i] >> 1) | (cur[i+1] << 63);
+                cur.swap(nxt);
+            }
+        }
+    });
+
+    std::free(bits);
+    bits = out;
+    clear_padding();
+}
+
+int BitMask::morphology(int op, unsigned long radius, unsigned n_threads)
+{
+    if (op < MORPH_DILATE || op > MORPH_CLOSE)
+        return -1;
+    if (radius == 0)
+        return 0;
+
+    Py_BEGIN_ALLOW_THREADS
+    for (int step = 0; step < 2; ++step) {
+        const bool erode = op == MORPH_ERODE || (op == MORPH_OPEN && step == 0) ||
+            (op == MORPH_CLOSE && step == 1);
+        if (erode)
+            invert();
+        dilate(radius, n_threads);
+        if (erode)
+            invert();
+        if (op == MORPH_DILATE || op == MORPH_ERODE)
+            break;
+    }
+    Py_END_ALLOW_THREADS
+
+    return 0;
+}
+
+
+//-- contours ---------------------------------------------------------------
+
+// Directions along the pixel edges (y axis pointing down).
+enum CrackDir {
+    DIR_E = 0,
+    DIR_S = 1,
+    DIR_W = 2,
+    DIR_N = 3
+};
+
+static const int DIR_DX[4] = {1, 0, -1, 0};
+static const int DIR_DY[4] = {0, 1, 0, -1};
+
+typedef std::vector<std::pair<double, double> > Ring;
+
+
+// LABEL_COMPONENTS
+// Label the 8-connected foreground components of a (w x h) mask, in two
+// passes with union-find: labels are 0 for the background and 1...n for the
+// components, numbered in the raster order of their first pixel. Returns n.
+//
+static uint32_t find_root(std::vector<uint32_t>& parent, uint32_t a)
+{
+    while (parent[a] != a) {
+        parent[a] = parent[parent[a]];
+        a = parent[a];
+    }
+    return a;
+}
+
+static uint32_t unite_roots(std::vector<uint32_t>& parent, uint32_t a, uint32_t b)
+{
+    a = find_root(parent, a);
+    b = find_root(parent, b);
+    if (a < b) std::swap(a, b);
+    parent[a] = b;      // keep the smallest label as root
+    return b;
+}
+
+static uint32_t label_components(const uint8_t* m, long w, long h, std::vector<uint32_t>& labels)
+{
+    labels.assign(std::size_t(w) * h, 0);
+    std::vector<uint32_t> parent(1, 0);
+    for (long y = 0; y < h; ++y) {
+        const uint8_t* r = m + std::size_t(y) * w;
+        uint32_t* l = &labels[std::size_t(y) * w];
+        const uint32_t* u = y > 0 ? l - w : 0;
+        for (long x = 0; x < w; ++x) {
+            if (!r[x])
+                continue;
+            // already labelled neighbours: W, NW, N, NE
+            uint32_t c = x > 0 ? l[x - 1] : 0;
+            if (u) {
+                const uint32_t nb[3] = {x > 0 ? u[x - 1] : 0, u[x], x + 1 < w ? u[x + 1] : 0};
+                for (int k = 0; k < 3; ++k)
+                    if (nb[k])
+                        c = c ? unite_roots(parent, c, nb[k]) : nb[k];
+            }
+            if (!c) {
+                c = static_cast<uint32_t>(parent.size());
+                parent.push_back(c);
+            }
+            l[x] = c;
+        }
+    }
+
+    // final, consecutive labels
+    std::vector<uint32_t> final_label(parent.size(), 0);
+    uint32_t n = 0;
+    for (std::size_t k = 1; k < parent.size(); ++k) {
+        const uint32_t r = find_root(parent, static_cast<uint32_t>(k));
+        final_label[k] = r == k ? ++n : final_label[r];
+    }
+    for (std::size_t k = 0; k < labels.size(); ++k)
+        labels[k] = final_label[labels[k]];
+
+    return n;
+}
+
+
+// CRACK_TRACER
+// Follows the boundaries between foreground and background pixels along the
+// pixel edges ("cracks"), with the foreground on the right (on screen), so
+// the outer boundaries have a positive signed area (counterclockwise, in the
+// compgeom sense) and the holes a negative one. The foreground is 8-connected
+// (and the background 4-connected): at a vertex shared by two diagonal
+// foreground pixels, the boundary turns left, keeping them in the same ring.
+//
+class CrackTracer
+{
+public:
+    CrackTracer(const uint8_t* m, long w, long h) : mask(m), w(w), h(h),
+        visited(std::size_t(w) * (h + 1), 0) {}
+
+    // Trace all the rings: the outer ones and the holes, each with a
+    // foreground pixel along it (identifying the region it bounds).
+    void trace(std::vector<Ring>& outer, std::vector<std::size_t>& outer_pixels,
+               std::vector<Ring>& holes, std::vector<std::size_t>& hole_pixels)
+    {
+        // each ring is found at its top-most, left-most horizontal edge: going
+        // east (foreground below) for outer rings, west (foreground above) for
+        // holes
+        for (long y = 0; y <= h; ++y)
+            for (long x = 0; x < w; ++x) {
+                if (visited[std::size_t(y) * w + x])
+                    continue;
+                const bool above = fg(x, y - 1), below = fg(x, y);
+                if (below && !above) {
+                    outer.push_back(ring(x, y, DIR_E));
+                    outer_pixels.push_back(std::size_t(y) * w + x);
+                } else if (above && !below) {
+                    holes.push_back(ring(x + 1, y, DIR_W));
+                    hole_pixels.push_back(std::size_t(y - 1) * w + x);
+                }
+            }
+    }
+
+private:
+    bool fg(long x, long y) const
+    {
+        return x >= 0 && y >= 0 && x < w && y < h && mask[std::size_t(y) * w + x];
+    }
+
+    // the direction leaving vertex (x, y), arriving along d
+    int next_dir(long x, long y, int d) const
+    {
+        const bool tl = fg(x - 1, y - 1), tr = fg(x, y - 1), bl = fg(x - 1, y), br = fg(x, y);
+        const bool out[4] = {br && !tr, bl && !br, tl && !bl, tr && !tl};
+        const int left = (d + 3) & 3;
+        if (out[left])
+            return left;    // including the saddles
+        if (out[d])
+            return d;
+        return (d + 1) & 3;
+    }
+
+    Ring ring(long x, long y, int d)
+    {
+        const long x0 = x, y0 = y;
+        const int d0 = d;
+        Ring r;
+        do {
+            if (d == DIR_E)
+                visited[std::size_t(y) * w + x] = 1;
+            else if (d == DIR_W)
+                visited[std::size_t(y) * w + x - 1] = 1;
+            x += DIR_DX[d];
+            y += DIR_DY[d];
+            const int nd = next_dir(x, y, d);
+            if (nd != d)
+                r.push_back(std::make_pair(double(x), double(y)));
+            d = nd;
+        } while (x != x0 || y != y0 || d != d0);
+
+        return r;
+    }
+
+    const uint8_t* mask;
+    long w, h;
+    std::vector<uint8_t> visited;   // horizontal edges already traced
+};
+
+
+// SIMPLIFY_RING
+// Douglas-Peucker simplification of a closed ring, with the given tolerance
+// (maximum distance of the dropped vertices to the simplified boundary). The
+// ring is split at its first vertex and the vertex farthest from it. Rings
+// which would be reduced to less than 3 vertices are kept unchanged.
+//
+static void simplify_ring(Ring& r, double tol)
+{
+    const std::size_t n = r.size();
+    if (tol <= 0.0 || n <= 3)
+        return;
+
+    std::size_t far = 0;
+    double dmax = -1.0;
+    for (std::size_t i = 1; i < n; ++i) {
+        const double dx = r[i].first - r[0].first, dy = r[i].second - r[0].second;
+        if (dx * dx + dy * dy > dmax) {
+            dmax = dx * dx + dy * dy;
+            far = i;
+        }
+    }
+
+    std::vector<uint8_t> keep(n + 1, 0);
+    keep[0] = keep[far] = keep[n] = 1;
+    std::vector<std::pair<std::size_t, std::size_t> > stack;
+    stack.push_back(std::make_pair(std::size_t(0), far));
+    stack.push_back(std::make_pair(far, n));
+    while (!stack.empty()) {
+        const std::size_t a = stack.back().first, b = stack.back().second;
+        stack.pop_back();
+        const std::pair<double, double>& pa = r[a];
+        const std::pair<double, double>& pb = r[b % n];
+        const double dx = pb.first - pa.first, dy = pb.second - pa.second;
+        const double len = std::sqrt(dx * dx + dy * dy);
+        std::size_t k = 0;
+        double dk = tol;
+        for (std::size_t i = a + 1; i < b; ++i) {
+            const double ex = r[i].first - pa.first, ey = r[i].second - pa.second;
+            const double d = len > 0 ? std::fabs(dx * ey - dy * ex) / len
+                                     : std::sqrt(ex * ex + ey * ey);
+            if (d > dk) {
+                dk = d;
+                k = i;
+            }
+        }
+        if (k != 0) {
+            keep[k] = 1;
+            stack.push_back(std::make_pair(a, k));
+            stack.push_back(std::make_pair(k, b));
+        }
+    }
+
+    Ring s;
+    for (std::size_t i = 0; i < n; ++i)
+        if (keep[i])
+            s.push_back(r[i]);
+    if (s.size() >= 3)
+        r.swap(s);
+}
+
+
+// MASK_CONTOURS
+// Vectorize a binary mask: the boundaries of its (8-connected) foreground
+// regions, as polygons with holes, in the flat layout of compgeom (see
+// polygons_with_holes_to_flat in compgeom.cxx): the numpy.ndarrays xy (n x 2),
+// ring_offsets and polygon_offsets are appended to R. The vertices lie on the
+// pixel corners (pixel (x, y) being the square [x, x+1) x [y, y+1)), mapped to
+// (x0 + scale * x, y0 + scale * y), and only the corners of the boundaries
+// are kept. The outer rings are counterclockwise, the holes clockwise.
+//
+// Args:
+//  mask (PyObject): numpy.ndarray, 2D, any non-zero value being foreground
+//  tolerance (double): if > 0, the rings are simplified (Douglas-Peucker) with
+//      this tolerance (in pixels)
+//  scale, x0, y0 (double): mapping of the pixel coordinates
+//  R (list): receives the result
+//
+// Returns:
+//  0: success
+// -1: invalid mask
+//
+int mask_contours(PyObject* mask, double tolerance, double scale, double x0, double y0,
+                  bp::list R)
+{
+    PyArrayObject* arr = (PyArrayObject*)PyArray_FROMANY(mask, NPY_UINT8, 2, 2,
+                                                         NPY_ARRAY_IN_ARRAY);
+    if (!arr) {
+        PyErr_Clear();
+        return -1;
+    }
+
+    std::vector<Ring> outer, holes;
+    std::vector<std::size_t> outer_pixels, hole_pixels;
+    std::vector<std::vector<std::size_t> > poly_holes;
+
+    Py_BEGIN_ALLOW_THREADS
+    const uint8_t* m = (const uint8_t*)PyArray_DATA(arr);
+    const long w = PyArray_DIM(arr, 1), h = PyArray_DIM(arr, 0);
+    CrackTracer tracer(m, w, h);
+    tracer.trace(outer, outer_pixels, holes, hole_pixels);
+
+    // a hole belongs to the outer ring of the foreground component along it
+    std::vector<uint32_t> labels;
+    const uint32_t n = label_components(m, w, h, labels);
+    std::vector<std::size_t> owner(n + 1, 0);
+    for (std::size_t k = 0; k < outer.size(); ++k)
+        owner[labels[outer_pixels[k]]] = k;
+    poly_holes.resize(outer.size());
+    for (std::size_t k = 0; k < holes.size(); ++k)
+        poly_holes[owner[labels[hole_pixels[k]]]].push_back(k);
+    std::vector<uint32_t>().swap(labels);
+
+    for (std::size_t k = 0; k < outer.size(); ++k)
+        simplify_ring(outer[k], tolerance);
+    for (std::size_t k = 0; k < holes.size(); ++k)
+        simplify_ring(holes[k], tolerance);
+    Py_END_ALLOW_THREADS
+
+    Py_DECREF(arr);
+
+    std::vector<const Ring*> rings;
+    std::vector<npy_int64> poly_off(1, 0);
+    for (std::size_t k = 0; k < outer.size(); ++k) {
+        rings.push_back(&outer[k]);
+        for (std::size_t i = 0; i < poly_holes[k].size(); ++i)
+            rings.push_back(&holes[poly_holes[k][i]]);
+        poly_off.push_back(static_cast<npy_int64>(rings.size()));
+    }
+
+    npy_intp n_rings = static_cast<npy_intp>(rings.size()) + 1;
+    npy_intp n_polys = static_cast<npy_intp>(poly_off.size());
+    PyObject* ring_offsets = PyArray_SimpleNew(1, &n_rings, NPY_INT64);
+    PyObject* polygon_offsets = PyArray_SimpleNew(1, &n_polys, NPY_INT64);
+    npy_int64* ro = (npy_int64*)PyArray_DATA((PyArrayObject*)ring_offsets);
+    std::copy(poly_off.begin(), poly_off.end(),
+              (npy_int64*)PyArray_DATA((PyArrayObject*)polygon_offsets));
+
+    ro[0] = 0;
+    for (std::size_t k = 0; k < rings.size(); ++k)
+        ro[k+1] = ro[k] + static_cast<npy_int64>(rings[k]->size());
+
+    npy_intp dims[2] = {static_cast<npy_intp>(ro[rings.size()]), 2};
+    PyObject* xy = PyArray_SimpleNew(2, dims, NPY_FLOAT64);
+    double* pxy = (double*)PyArray_DATA((PyArrayObject*)xy);
+    for (std::size_t k = 0; k < rings.size(); ++k)
+        for (std::size_t i = 0; i < rings[k]->size(); ++i) {
+            *pxy++ = x0 + scale * (*rings[k])[i].first;
+            *pxy++ = y0 + scale * (*rings[k])[i].second;
+        }
+
+    R.append(bp::object(bp::handle<>(xy)));
+    R.append(bp::object(bp::handle<>(ring_offsets)));
+    R.append(bp::object(bp::handle<>(polygon_offsets)));
+
+    return 0;
+}
+
+
+//-- connected components ---------------------------------------------------
+
+typedef std::pair<int32_t, int32_t> IPoint;
+
+static inline int64_t cross(const IPoint& o, const IPoint& a, const IPoint& b)
+{
+    return int64_t(a.first - o.first) * (b.second - o.second) -
+           int64_t(a.second - o.second) * (b.first - o.first);
+}
+
+
+// CONVEX_HULL
+// Convex hull of a set of integer points (Andrew's monotone chain), in place:
+// the vertices, without the collinear ones, counterclockwise (in the compgeom
+// sense, i.e. with positive signed area).
+//
+static void convex_hull(std::vector<IPoint>& p)
+{
+    std::sort(p.begin(), p.end());
+    p.erase(std::unique(p.begin(), p.end()), p.end());
+    if (p.size() < 3)
+        return;
+
+    std::vector<IPoint> h(2 * p.size());
+    std::size_t k = 0;
+    for (std::size_t i = 0; i < p.size(); ++i) {
+        while (k >= 2 && cross(h[k-2], h[k-1], p[i]) <= 0)
+            --k;
+        h[k++] = p[i];
+    }
+    for (std::size_t i = p.size() - 1, t = k + 1; i > 0; --i) {
+        while (k >= t && cross(h[k-2], h[k-1], p[i-1]) <= 0)
+            --k;
+        h[k++] = p[i-1];
+    }
+    h.resize(k - 1);
+    p.swap(h);
+}
+
+
+// COMPONENT_LABELER
+// Streaming labelling of the 8-connected foreground components of a mask,
+// with union-find over the runs of consecutive rows: the mask is pushed in
+// bands of rows, top to bottom, and only the runs of the last row are kept,
+// so the mask never needs to be held in memory. For each component, the
+// area, the bounding box, the centroid and the convex hull are accumulated
+// on the fly; a component is complete as soon as a row does not touch it,
+// and it is then either kept or, if smaller than min_area, dropped. After
+// each row, the labels of the open components are compacted (those of the
+// closed ones being recycled), so the memory used is proportional to the
+// width and to the number of open components, whatever the mask's height.
+//
+// As for the contours, pixel (x, y) is the square [x, x+1) x [y, y+1): the
+// bounding boxes are (x0, y0, x1, y1), with x1 and y1 excluded, the centroid
+// is the centre of mass of the pixel squares and the hull vertices are pixel
+// corners (the hull covers the pixels entirely).
+//
+class ComponentLabeler
+{
+public:
+    ComponentLabeler(unsigned long width, unsigned long min_area) :
+        w(width), min_area(min_area), y(0), n_created(0), finished(false), parent(1, 0),
+        stats(1) {}
+
+    unsigned long width() const { return w; }
+    unsigned long height() const { return y; }
+
+    // PUSH_ROWS
+    // Label the next band of rows.
+    //
+    // Args:
+    //  band (PyObject): numpy.ndarray (rows x width), any non-zero value being
+    //      foreground
+    //
+    // Returns:
+    //  0: success
+    // -1: invalid band
+    // -3: labelling already finished
+    //
+    int push_rows(PyObject* band)
+    {
+        if (finished)
+            return -3;
+        PyArrayObject* arr = (PyArrayObject*)PyArray_FROMANY(band, NPY_UINT8, 2, 2,
+                                                             NPY_ARRAY_IN_ARRAY);
+        if (!arr) {
+            PyErr_Clear();
+            return -1;
+        }
+        if (static_cast<unsigned long>(PyArray_DIM(arr, 1)) != w) {
+            Py_DECREF(arr);
+            return -1;
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        const uint8_t* m = (const uint8_t*)PyArray_DATA(arr);
+        for (npy_intp i = 0; i < PyArray_DIM(arr, 0); ++i)
+            push_row(m + i * w);
+        Py_END_ALLOW_THREADS
+
+        Py_DECREF(arr);
+
+        return 0;
+    }
+
+    // FINISH
+    // Complete the labelling (no more rows can be pushed) and return the
+    // components not smaller than min_area, in the raster order of their
+    // first pixel. The numpy.ndarrays appended to R are: area (n, int64),
+    // bbox (n x 4, int64), centroid (n x 2, float64, (x, y)) and the hulls in
+    // the flat layout of compgeom: xy (m x 2, float64) and offsets (n+1,
+    // int64), hull k being xy[offsets[k]:offsets[k+1]].
+    //
+    // Returns:
+    //  0: success
+    // -3: labelling already finished
+    //
+    int finish(bp::list R)
+    {
+        if (finished)
+            return -3;
+        finished = true;
+
+        Py_BEGIN_ALLOW_THREADS
+        close_components(true);
+        std::sort(done.begin(), done.end(), Component::by_first);
+        Py_END_ALLOW_THREADS
+
+        npy_intp n = static_cast<npy_intp>(done.size()), n1 = n + 1;
+        npy_intp dims_bbox[2] = {n, 4}, dims_c[2] = {n, 2};
+        PyObject* area = PyArray_SimpleNew(1, &n, NPY_INT64);
+        PyObject* bbox = PyArray_SimpleNew(2, dims_bbox, NPY_INT64);
+        PyObject* centroid = PyArray_SimpleNew(2, dims_c, NPY_FLOAT64);
+        PyObject* offsets = PyArray_SimpleNew(1, &n1, NPY_INT64);
+        npy_int64* pa = (npy_int64*)PyArray_DATA((PyArrayObject*)area);
+        npy_int64* pb = (npy_int64*)PyArray_DATA((PyArrayObject*)bbox);
+        double* pc = (double*)PyArray_DATA((PyArrayObject*)centroid);
+        npy_int64* po = (npy_int64*)PyArray_DATA((PyArrayObject*)offsets);
+
+        po[0] = 0;
+        for (std::size_t k = 0; k < done.size(); ++k) {
+            const Component& c = done[k];
+            pa[k] = static_cast<npy_int64>(c.area);
+            pb[4*k] = c.x0; pb[4*k+1] = c.y0; pb[4*k+2] = c.x1; pb[4*k+3] = c.y1;
+            pc[2*k] = c.sx / c.area + 0.5;
+            pc[2*k+1] = c.sy / c.area + 0.5;
+            po[k+1] = po[k] + static_cast<npy_int64>(c.hull.size());
+        }
+
+        npy_intp dims_xy[2] = {static_cast<npy_intp>(po[n]), 2};
+        PyObject* xy = PyArray_SimpleNew(2, dims_xy, NPY_FLOAT64);
+        double* pxy = (double*)PyArray_DATA((PyArrayObject*)xy);
+        for (std::size_t k = 0; k < done.size(); ++k)
+            for (std::size_t i = 0; i < done[k].hull.size(); ++i) {
+                *pxy++ = done[k].hull[i].first;
+                *pxy++ = done[k].hull[i].second;
+            }
+
+        R.append(bp::object(bp::handle<>(area)));
+        R.append(bp::object(bp::handle<>(bbox)));
+        R.append(bp::object(bp::handle<>(centroid)));
+        R.append(bp::object(bp::handle<>(xy)));
+        R.append(bp::object(bp::handle<>(offsets)));
+
+        std::vector<Component>().swap(done);
+        std::vector<uint32_t>().swap(parent);
+        std::vector<Component>().swap(stats);
+
+        return 0;
+    }
+
+private:
+    static const std::size_t NO_POINT = std::size_t(-1);
+
+    struct Component {
+        Component() : first(0), area(0), x0(0), y0(0), x1(0), y1(0), sx(0), sy(0),
+            last_row(-1), n_hull(0), right(NO_POINT) {}
+
+        static bool by_first(const Component& a, const Component& b) { return a.first < b.first; }
+
+        uint64_t first;             // creation order, i.e. raster order
+        uint64_t area;
+        int32_t x0, y0, x1, y1;
+        double sx, sy;              // sums of the pixel coordinates
+        long last_row;              // last row with pixels of the component
+        std::size_t n_hull;         // hull size after the last reduction
+        std::size_t right;          // right-most points of the last row, in hull
+        std::vector<IPoint> hull;   // hull vertices and candidates
+    };
+
+    void add_run(uint32_t c, int32_t s, int32_t e)
+    {
+        Component& k = stats[c];
+        const int32_t yy = static_cast<int32_t>(y);
+        if (k.area == 0) {
+            k.x0 = s; k.x1 = e;
+            k.y0 = yy;
+        } else {
+            k.x0 = std::min(k.x0, s);
+            k.x1 = std::max(k.x1, e);
+        }
+        k.y1 = yy + 1;
+        k.area += e - s;
+        k.sx += 0.5 * (double(s) + e - 1) * (e - s);
+        k.sy += double(y) * (e - s);
+
+        // only the left- and right-most pixels of a row can be hull vertices
+        if (k.last_row == y && k.right != NO_POINT) {
+            k.hull[k.right].first = k.hull[k.right + 1].first = e;
+            return;
+        }
+        k.last_row = y;
+        k.hull.push_back(IPoint(s, yy));
+        k.hull.push_back(IPoint(s, yy + 1));
+        k.hull.push_back(IPoint(e, yy));
+        k.hull.push_back(IPoint(e, yy + 1));
+        k.right = k.hull.size() - 2;
+        if (k.hull.size() > 2 * k.n_hull + 256) {
+            convex_hull(k.hull);
+            k.n_hull = k.hull.size();
+            k.right = NO_POINT;
+        }
+    }
+
+    // unite the components of two roots; returns the new root
+    uint32_t unite(uint32_t a, uint32_t b)
+    {
+        if (a == b)
+            return a;
+        const uint32_t r = unite_roots(parent, a, b);
+        Component& t = stats[r];
+        Component& u = stats[r == a ? b : a];
+        t.x0 = std::min(t.x0, u.x0);
+        t.y0 = std::min(t.y0, u.y0);
+        t.x1 = std::max(t.x1, u.x1);
+        t.y1 = std::max(t.y1, u.y1);
+        t.area += u.area;
+        t.sx += u.sx;
+        t.sy += u.sy;
+        t.last_row = std::max(t.last_row, u.last_row);
+        t.first = std::min(t.first, u.first);
+        if (t.hull.size() < u.hull.size())
+            t.hull.swap(u.hull);
+        t.hull.insert(t.hull.end(), u.hull.begin(), u.hull.end());
+        t.n_hull = std::max(t.n_hull, u.n_hull);
+        t.right = NO_POINT;
+        std::vector<IPoint>().swap(u.hull);
+
+        return r;
+    }
+
+    void push_row(const uint8_t* m)
+    {
+        runs.clear();
+        for (unsigned long x = 0; x < w; ) {
+            if (!m[x]) {
+                ++x;
+                continue;
+            }
+            const unsigned long s = x;
+            while (x < w && m[x])
+                ++x;
+            runs.push_back(static_cast<int32_t>(s));
+            runs.push_back(static_cast<int32_t>(x));
+        }
+
+        // the runs of the previous row touching [s-1, e] are 8-connected to [s, e)
+        labels.resize(runs.size() / 2);
+        std::size_t j = 0;
+        for (std::size_t i = 0; i < runs.size(); i += 2) {
+            const int32_t s = runs[i], e = runs[i+1];
+            while (j < prev_runs.size() && prev_runs[j+1] < s)
+                j += 2;
+            uint32_t c = 0;
+            for (std::size_t k = j; k < prev_runs.size() && prev_runs[k] <= e; k += 2) {
+                const uint32_t r = find_root(parent, prev_labels[k/2]);
+                c = c ? unite(c, r) : r;
+            }
+            if (!c) {
+                c = static_cast<uint32_t>(parent.size());
+                parent.push_back(c);
+                stats.push_back(Component());
+                stats.back().first = n_created++;
+            }
+            add_run(c, s, e);
+            labels[i/2] = c;
+        }
+
+        ++y;
+        close_components(false);
+        compact_labels();
+        prev_runs.swap(runs);
+        prev_labels.swap(labels);
+    }
+
+    // the components of the previous row not continued by the current one are
+    // complete (at the end, all of them)
+    void close_components(bool all)
+    {
+        for (std::size_t k = 0; k < prev_labels.size(); ++k) {
+            const uint32_t r = find_root(parent, prev_labels[k]);
+            Component& c = stats[r];
+            if (c.last_row == long(y) - 1 && !all)
+                continue;
+            if (c.area == 0)
+                continue;       // already closed
+            if (c.area >= min_area) {
+                convex_hull(c.hull);
+                done.push_back(Component());
+                std::swap(done.back(), c);
+            }
+            c.area = 0;
+            std::vector<IPoint>().swap(c.hull);
+        }
+    }
+
+    // relabel the components of the current row 1, 2, ..., keeping the order
+    // of their labels, and drop all the others (merged or closed)
+    void compact_labels()
+    {
+        new_label.assign(parent.size(), 0);
+        for (std::size_t k = 0; k < labels.size(); ++k) {
+            labels[k] = find_root(parent, labels[k]);
+            new_label[labels[k]] = 1;
+        }
+        uint32_t n = 1;
+        for (uint32_t r = 1; r < new_label.size(); ++r)
+            if (new_label[r]) {
+                new_label[r] = n;
+                if (n != r)
+                    std::swap(stats[n], stats[r]);
+                ++n;
+            }
+        for (std::size_t k = 0; k < labels.size(); ++k)
+            labels[k] = new_label[labels[k]];
+        stats.resize(n);
+        parent.resize(n);
+        for (uint32_t k = 0; k < n; ++k)
+            parent[k] = k;
+    }
+
+    unsigned long w, min_area;
+    long y;                             // rows pushed so far
+    uint64_t n_created;                 // components created so far
+    bool finished;
+    std::vector<uint32_t> parent;       // union-find over the provisional labels
+    std::vector<Component> stats;       // accumulated at the roots
+    std::vector<Component> done;        // completed components
+    Runs runs, prev_runs;               // runs of the current and previous rows
+    std::vector<uint32_t> labels, prev_labels;  // provisional labels of the runs
+    std::vector<uint32_t> new_label;    // see compact_labels
+};
+
+
+//-- thresholding -----------------------------------------------------------
+
+enum ChannelOrder {
+    CHANNELS_RGB = 0,
+    CHANNELS_BGR = 1        // e.g. OpenSlide's ARGB pixels, as bytes
+};
+
+
+// GRAY_ROW
+// Luminance of a row of n pixels with nc channels (1, 3 or 4; the 4th one
+// being alpha), with the weights of skimage.color.rgb2gray (0.2125, 0.7154,
+// 0.0721), in 16 bit fixed point: g[i] in [0, 255]. The transparent pixels
+// (alpha 0) are marked in valid (if not null) with 0.
+//
+static void gray_row(const uint8_t* p, long n, int nc, int order, uint8_t* g, uint8_t* valid)
+{
+    if (nc == 1) {
+        std::memcpy(g, p, n);
+        if (valid)
+            std::memset(valid, 1, n);
+        return;
+    }
+    const int ir = order == CHANNELS_BGR ? 2 : 0, ib = 2 - ir;
+    for (long i = 0; i < n; ++i, p += nc) {
+        g[i] = static_cast<uint8_t>((13926u * p[ir] + 46884u * p[1] + 4725u * p[ib] + 32768u) >> 16);
+        if (valid)
+            valid[i] = nc < 4 || p[3] != 0;
+    }
+}
+
+
+// GET_IMAGE
+// The image argument of the thresholding functions: a numpy.ndarray, uint8,
+// (h x w) or (h x w x nc), with nc in {1, 3, 4}. Returns null if invalid.
+//
+static PyArrayObject* get_image(PyObject* img, long& w, long& h, int& nc)
+{
+    PyArrayObject* arr = (PyArrayObject*)PyArray_FROMANY(img, NPY_UINT8, 2, 3, NPY_ARRAY_IN_ARRAY);
+    if (!arr) {
+        PyErr_Clear();
+        return 0;
+    }
+    h = PyArray_DIM(arr, 0);
+    w = PyArray_DIM(arr, 1);
+    nc = PyArray_NDIM(arr) == 3 ? static_cast<int>(PyArray_DIM(arr, 2)) : 1;
+    if (nc != 1 && nc != 3 && nc != 4) {
+        Py_DECREF(arr);
+        return 0;
+    }
+    return arr;
+}
+
+
+// GRAY_HISTOGRAM
+// Histogram of the gray levels (see gray_row) of an image passed in bands or
+// tiles, in any order, hence never held in memory. The transparent pixels are
+// not counted. The thresholds split the gray levels into classes, [0, t_1],
+// (t_1, t_2], ..., (t_k, 255], as skimage.filters.threshold_otsu (for which
+// the foreground is then g > t).
+//
+class GrayHistogram
+{
+public:
+    GrayHistogram() : hist(256, 0) {}
+
+    uint64_t count() const
+    {
+        uint64_t n = 0;
+        for (int i = 0; i < 256; ++i)
+            n += hist[i];
+        return n;
+    }
+
+    void clear() { std::fill(hist.begin(), hist.end(), 0); }
+
+    // ADD
+    // Count the pixels of an image (band or tile).
+    //
+    // Args:
+    //  img (PyObject): numpy.ndarray, uint8, (h x w [x nc]), nc in {1, 3, 4}
+    //  order (int): order of the color channels (ChannelOrder)
+    //
+    // Returns:
+    //  0: success
+    // -1: invalid image
+    //
+    int add(PyObject* img, int order)
+    {
+        long w, h;
+        int nc;
+        PyArrayObject* arr = get_image(img, w, h, nc);
+        if (!arr)
+            return -1;
+
+        Py_BEGIN_ALLOW_THREADS
+        const uint8_t* p = (const uint8_t*)PyArray_DATA(arr);
+        std::vector<uint8_t> g(w), valid(w);
+        uint64_t c[4][256];     // interleaved counters, against store-to-load stalls
+        std::memset(c, 0, sizeof(c));
+        for (long y = 0; y < h; ++y, p += std::size_t(w) * nc) {
+            gray_row(p, w, nc, order, &g[0], &valid[0]);
+            if (nc < 4) {
+                long x = 0;
+                for (; x + 4 <= w; x += 4) {
+                    ++c[0][g[x]]; ++c[1][g[x+1]]; ++c[2][g[x+2]]; ++c[3][g[x+3]];
+                }
+                for (; x < w; ++x)
+                    ++c[0][g[x]];
+            } else
+                for (long x = 0; x < w; ++x)
+                    c[x & 3][g[x]] += valid[x];
+        }
+        for (int i = 0; i < 256; ++i)
+            hist[i] += c[0][i] + c[1][i] + c[2][i] + c[3][i];
+        Py_END_ALLOW_THREADS
+
+        Py_DECREF(arr);
+
+        return 0;
+    }
+
+    // MERGE
+    // Add the counts of another histogram (e.g. of another part of the image).
+    //
+    void merge(const GrayHistogram& other)
+    {
+        for (int i = 0; i < 256; ++i)
+            hist[i] += other.hist[i];
+    }
+
+    // COUNTS
+    // Copy the histogram into out (PRE-ALLOCATED, C-contiguous int64 array with
+    // 256 elements). Returns 0, or -1 for invalid out.
+    //
+    int counts(PyObject* out) const
+    {
+        if (!PyArray_Check(out) || PyArray_TYPE((PyArrayObject*)out) != NPY_INT64 ||
+            !PyArray_IS_C_CONTIGUOUS((PyArrayObject*)out) ||
+            PyArray_SIZE((PyArrayObject*)out) != 256)
+            return -1;
+        std::copy(hist.begin(), hist.end(), (npy_int64*)PyArray_DATA((PyArrayObject*)out));
+        return 0;
+    }
+
+    // OTSU
+    // Otsu's threshold (maximum between-class variance). Returns t in
+    // [0, 254], or -3 for an empty histogram (or with a single gray level).
+    //
+    int otsu() const
+    {
+        int t[1];
+        return multi_otsu_(2, t) == 0 ? t[0] : -3;
+    }
+
+    // TRIANGLE
+    // Zack's triangle threshold, as skimage.filters.threshold_triangle: the
+    // gray level farthest from the line joining the histogram peak to the end
+    // of its longer tail. Returns t in [0, 255], or -3 for an empty histogram
+    // (or with a single gray level).
+    //
+    int triangle() const
+    {
+        int lo = 0, hi = 255, peak = 0;
+        while (lo < 256 && hist[lo] == 0) ++lo;
+        while (hi >= 0 && hist[hi] == 0) --hi;
+        if (lo >= hi)
+            return -3;
+        for (int i = 1; i < 256; ++i)
+            if (hist[i] > hist[peak])
+                peak = i;
+
+        // the line runs from the low end to the peak, in the (possibly flipped)
+        // histogram
+        const bool flip = peak - lo < hi - peak;
+        std::vector<double> f(256);
+        for (int i = 0; i < 256; ++i)
+            f[i] = double(hist[flip ? 255 - i : i]);
+        if (flip) {
+            lo = 255 - hi;
+            peak = 255 - peak;
+        }
+
+        const int width = peak - lo;
+        double ph = f[peak], wd = width;
+        const double norm = std::sqrt(ph * ph + wd * wd);
+        ph /= norm;
+        wd /= norm;
+        int best = 0;
+        double dmax = -1.0e300;
+        for (int x = 0; x < std::max(width, 1); ++x) {
+            const double d = ph * x - wd * f[x + lo];
+            if (d > dmax) {
+                dmax = d;
+                best = x;
+            }
+        }
+        best += lo;
+
+        return flip ? 255 - best : best;
+    }
+
+    // MULTI_OTSU
+    // Multi-level Otsu thresholds: the n_classes - 1 thresholds maximizing the
+    // between-class variance, found exactly by dynamic programming over the
+    // histogram.
+    //
+    // Args:
+    //  n_classes (int): number of classes, in [2, 16]
+    //  out (PyObject): PRE-ALLOCATED, C-contiguous int64 array with n_classes - 1
+    //      elements, receiving the increasing thresholds
+    //
+    // Returns:
+    //  0: success
+    // -1: invalid out or n_classes
+    // -3: not enough gray levels in the histogram
+    //
+    int multi_otsu(unsigned n_classes, PyObject* out) const
+    {
+        if (n_classes < 2 || n_classes > 16 || !PyArray_Check(out) ||
+            PyArray_TYPE((PyArrayObject*)out) != NPY_INT64 ||
+            !PyArray_IS_C_CONTIGUOUS((PyArrayObject*)out) ||
+            PyArray_SIZE((PyArrayObject*)out) != npy_intp(n_classes - 1))
+            return -1;
+        int t[15];
+        const int r = multi_otsu_(n_classes, t);
+        if (r != 0)
+            return r;
+        std::copy(t, t + n_classes - 1, (npy_int64*)PyArray_DATA((PyArrayObject*)out));
+        return 0;
+    }
+
+private:
+    int multi_otsu_(unsigned k, int* t) const
+    {
+        // the non-empty gray levels, with cumulative weights and sums
+        std::vector<int> level;
+        std::vector<double> P(1, 0.0), S(1, 0.0);
+        for (int i = 0; i < 256; ++i)
+            if (hist[i]) {
+                level.push_back(i);
+                P.push_back(P.back() + double(hist[i]));
+                S.push_back(S.back() + double(hist[i]) * i);
+            }
+        const int n = static_cast<int>(level.size());
+        if (n < int(k))
+            return -3;
+
+        // v[j][b]: best sum of w * mu^2 for splitting the levels [0, b) into
+        // j + 1 classes; the last class starting at arg[j][b]
+        std::vector<std::vector<double> > v(k, std::vector<double>(n + 1, -1.0));
+        std::vector<std::vector<int> > arg(k, std::vector<int>(n + 1, 0));
+        for (int b = 1; b <= n; ++b)
+            v[0][b] = S[b] * S[b] / P[b];
+        for (unsigned j = 1; j < k; ++j)
+            for (int b = j + 1; b <= n; ++b)
+                for (int a = j; a < b; ++a) {
+                    const double s = S[b] - S[a];
+                    const double u = v[j-1][a] + s * s / (P[b] - P[a]);
+                    if (u > v[j][b]) {
+                        v[j][b] = u;
+                        arg[j][b] = a;
+                    }
+                }
+
+        // a class ends at its last non-empty level
+        for (int j = int(k) - 1, b = n; j > 0; --j) {
+            b = arg[j][b];
+            t[j-1] = level[b - 1];
+        }
+
+        return 0;
+    }
+
+    std::vector<uint64_t> hist;
+};
+
+
+// BINARIZE
+// Threshold an image (band or tile) by its gray levels (see gray_row): the
+// foreground is g > threshold (or g <= threshold, for a dark foreground, as for
+// tissue on a bright background); transparent pixels are background.
+//
+// Args:
+//  img (PyObject): numpy.ndarray, uint8, (h x w [x nc]), nc in {1, 3, 4}
+//  order (int): order of the color channels (ChannelOrder)
+//  threshold (int): gray level threshold
+//  dark (bool): is the foreground below the threshold?
+//  out (PyObject): PRE-ALLOCATED, C-contiguous uint8 array (h x w), receiving
+//      1 for the foreground and 0 for the background
+//
+// Returns:
+//  0: success
+// -1: invalid image
+// -2: invalid out
+//
+int binarize(PyObject* img, int order, int threshold, bool dark, PyObject* out)
+{
+    long w, h;
+    int nc;
+    PyArrayObject* arr = get_image(img, w, h, nc);
+    if (!arr)
+        return -1;
+    if (!PyArray_Check(out) || PyArray_TYPE((PyArrayObject*)out) != NPY_UINT8 ||
+        !PyArray_IS_C_CONTIGUOUS((PyArrayObject*)out) ||
+        PyArray_NDIM((PyArrayObject*)out) != 2 || PyArray_DIM((PyArrayObject*)out, 0) != h ||
+        PyArray_DIM((PyArrayObject*)out, 1) != w) {
+        Py_DECREF(arr);
+        return -2;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    // lookup table of the gray levels
+    uint8_t lut[256];
+    for (int i = 0; i < 256; ++i)
+        lut[i] = dark ? i <= threshold : i > threshold;
+    const uint8_t* p = (const uint8_t*)PyArray_DATA(arr);
+    uint8_t* q = (uint8_t*)PyArray_DATA((PyArrayObject*)out);
+    std::vector<uint8_t> valid(w);
+    for (long y = 0; y < h; ++y, p += std::size_t(w) * nc, q += w) {
+        gray_row(p, w, nc, order, q, &valid[0]);
+        for (long x = 0; x < w; ++x)
+            q[x] = lut[q[x]] & valid[x];
+    }
+    Py_END_ALLOW_THREADS
+
+    Py_DECREF(arr);
+
+    return 0;
+}
+
+
+BOOST_PYTHON_MODULE(masks_){
+    import_array();
+
+    bp::def("apply_mask_", apply_mask);
+    bp::def("apply_scaled_mask_", apply_scaled_mask);
+    bp::def("mask_contours_", mask_contours);
+    bp::def("binarize_", binarize);
+
+    bp::class_<SpanMask>("SpanMask", bp::init<unsigned long, unsigned long>())
+        .def("add_polygons", &SpanMask::add_polygons)
+        .def("unite", &SpanMask::unite)
+        .def("intersect", &SpanMask::intersect)
+        .def("coverage", &SpanMask::coverage)
+        .def("to_dense", &SpanMask::to_dense)
+        .def("copy", &SpanMask::copy)
+        .def("clear", &SpanMask::clear)
+        .def("morphology", &SpanMask::morphology)
+        .add_property("width", &SpanMask::width)
+        .add_property("height", &SpanMask::height)
+        .add_property("area", &SpanMask::area)
+        .add_property("n_runs", &SpanMask::n_runs);
+
+    bp::class_<BitMask>("BitMask", bp::init<unsigned long, unsigned long>())
+        .def("add_polygons", &BitMask::add_polygons)
+        .def("from_dense", &BitMask::from_dense)
+        .def("set_rows", &BitMask::set_rows)
+        .def("intersect", &BitMask::intersect)
+        .def("unite", &BitMask::unite)
+        .def("invert", &BitMask::invert)
+        .def("tile_coverage", &BitMask::tile_coverage)
+        .def("morphology", &BitMask::morphology)
+        .def("to_dense", &BitMask::to_dense)
+        .def("copy", &BitMask::copy)
+        .add_property("width", &BitMask::width)
+        .add_property("height", &BitMask::height)
+        .add_property("area", &BitMask::area)
+        .add_property("nbytes", &BitMask::nbytes);
+
+    bp::class_<CoverageMap, boost::noncopyable>("CoverageMap")
+        .def("build", &CoverageMap::build)
+        .def("coverage", &CoverageMap::coverage)
+        .add_property("width", &CoverageMap::width)
+        .add_property("height", &CoverageMap::height);
+
+    bp::class_<ComponentLabeler, boost::noncopyable>("ComponentLabeler",
+                                                     bp::init<unsigned long, unsigned long>())
+        .def("push_rows", &ComponentLabeler::push_rows)
+        .def("finish", &ComponentLabeler::finish)
+        .add_property("width", &ComponentLabeler::width)
+        .add_property("height", &ComponentLabeler::height);
+
+    bp::class_<GrayHistogram>("GrayHistogram")
+        .def("add", &GrayHistogram::add)
+        .def("merge", &GrayHistogram::merge)
+        .def("counts", &GrayHistogram::counts)
+        .def("otsu", &GrayHistogram::otsu)
+        .def("triangle", &GrayHistogram::triangle)
+        .def("multi_otsu", &GrayHistogram::multi_otsu)
+        .def("clear", &GrayHistogram::clear)
+        .add_property("count", &GrayHistogram::count);
+}
@@ -0,0 +1,302 @@
+#
+# QPATH2 - a quantitative pathology toolkit
+#
+# (c) 2017 Vlad Popovici
+#
+
+"""TISSUE: detection of the tissue in whole slide images.
+
+The levels of a slide are read in bands of rows (see io.reader), so that the
+detection can run on levels too large to be held in memory (e.g. small
+biopsies, needing a higher resolution than the thumbnail). The gray levels
+are computed on the fly, accumulated into a histogram which gives the
+threshold (Otsu, triangle or multi-Otsu), and the binary mask is then produced
+band by band. The tissue blobs are then found as the convex hulls of the
+large enough connected components of the mask (see detect_tissue).
+"""
+
+from __future__ import (absolute_import, division, print_function, unicode_literals)
+
+__all__ = ['GrayHistogram', 'binarize', 'read_level_bands', 'level_histogram', 'binarize_level',
+           'detect_tissue']
+
+import numpy as np
+
+from qpath2.core import Error
+from qpath2.io.reader import openslide_read_region_px
+from qpath2.masks import SpanMask, BitMask, ComponentLabeler
+from qpath2.masks_ import GrayHistogram as _GrayHistogram, binarize_
+
+
+# codes as in masks_.cxx (ChannelOrder)
+_CHANNEL_ORDER = {'rgb': 0, 'bgr': 1}
+
+
+##-
+class GrayHistogram(object):
+    """Histogram of the gray levels of an image passed in parts (bands or
+    tiles, in any order). The gray level is the luminance of skimage's rgb2gray,
+    scaled to [0, 255]; transparent pixels (alpha 0) are not counted.
+
+    The thresholds t split the gray levels into [0, t] and (t, 255] (as
+    skimage.filters.threshold_otsu), i.e. the bright foreground is g > t.
+
+    Example:
+        h = GrayHistogram()
+        for y0, band in read_level_bands(wsi, level):
+            h.add(band, channels='bgr')
+        th = h.otsu()
+    """
+
+    def __init__(self):
+        self._hist = _GrayHistogram()
+
+    @property
+    def count(self):
+        """Number of pixels counted."""
+        return self._hist.count
+
+    @property
+    def counts(self):
+        """The histogram (numpy.array, 256 int64 counts)."""
+        c = np.empty(256, dtype=np.int64)
+        self._hist.counts(c)
+        return c
+
+    def add(self, img, channels='rgb'):
+        """Count the pixels of an image part.
+
+        Args:
+            img (numpy.array): uint8 image, gray (h x w) or color (h x w x 3
+                or 4, the 4th channel being alpha)
+            channels (string): order of the color channels, 'rgb' or 'bgr'
+                (e.g. for the regions read by io.reader)
+        """
+        if channels not in _CHANNEL_ORDER:
+            raise Error("unknown channel order: " + channels)
+        if self._hist.add(img, _CHANNEL_ORDER[channels]) != 0:
+            raise Error("invalid image")
+
+    def merge(self, other):
+        """Add the counts of another GrayHistogram."""
+        self._hist.merge(other._hist)
+
+    def clear(self):
+        self._hist.clear()
+
+    def otsu(self):
+        """Otsu's threshold."""
+        t = self._hist.otsu()
+        if t < 0:
+            raise Error("not enough gray levels for a threshold", code=t)
+        return t
+
+    def triangle(self):
+        """Triangle threshold (as skimage.filters.threshold_triangle)."""
+        t = self._hist.triangle()
+        if t < 0:
+            raise Error("not enough gray levels for a threshold", code=t)
+        return t
+
+    def multi_otsu(self, n_classes=3):
+        """Multi-level Otsu thresholds (exact optimum).
+
+        Args:
+            n_classes (int): number of classes (2...16)
+
+        Returns:
+            a list of n_classes - 1 increasing thresholds: class k has the gray
+            levels in (t_k-1, t_k]
+        """
+        t = np.empty(n_classes - 1, dtype=np.int64)
+        r = self._hist.multi_otsu(int(n_classes), t)
+        if r == -1:
+            raise Error("invalid number of classes")
+        elif r != 0:
+            raise Error("not enough gray levels for the thresholds", code=r)
+        return [int(_t) for _t in t]
+
+    def threshold(self, method='otsu'):
+        """Threshold by the given method: 'otsu' or 'triangle'."""
+        if method == 'otsu':
+            return self.otsu()
+        elif method == 'triangle':
+            return self.triangle()
+        raise Error("unknown threshold method: " + method)
+##-
+
+
+##-
+def binarize(img, threshold, dark=False, channels='rgb'):
+    """Threshold an image (or a part of it) by its gray levels (see GrayHistogram).
+
+    Args:
+        img (numpy.array): uint8 image, gray (h x w) or color (h x w x 3 or 4)
+        threshold (int): gray level threshold
+        dark (bool): the foreground is g <= threshold (e.g. tissue on a bright
+            background), instead of g > threshold
+        channels (string): order of the color channels, 'rgb' or 'bgr'
+
+    Returns:
+        numpy.array (h x w, uint8): 1 for foreground, 0 for background (and
+        for the transparent pixels)
+    """
+    if channels not in _CHANNEL_ORDER:
+        raise Error("unknown channel order: " + channels)
+    out = np.empty(img.shape[:2], dtype=np.uint8)
+    r = binarize_(img, _CHANNEL_ORDER[channels], int(threshold), bool(dark), out)
+    if r != 0:
+        raise Error("invalid image", code=r)
+
+    return out
+##-
+
+
+##-
+def read_level_bands(wsi, level, band_height=1024):
+    """Read a level of a slide in bands of rows, top to bottom.
+
+    Args:
+        wsi (WSIInfo): the slide
+        level (int): the level to read
+        band_height (int): number of rows per band
+
+    Yields:
+        (y0, band): the first row of the band and the band itself (numpy.array,
+        rows x width x 4, uint8, BGRA; see io.reader.openslide_read_region_px)
+    """
+    width = wsi.info['levels'][level]['x_size']
+    height = wsi.info['levels'][level]['y_size']
+    ds = wsi.info['levels'][level]['downsample_factor']
+    for y in range(0, height, band_height):
+        h = min(band_height, height - y)
+        yield y, openslide_read_region_px(wsi, 0, long(y * ds), width, h, level)
+##-
+
+
+##-
+def level_histogram(wsi, level, band_height=1024):
+    """Gray levels histogram of a slide level, read in bands.
+
+    Returns:
+        a GrayHistogram
+    """
+    h = GrayHistogram()
+    for _, band in read_level_bands(wsi, level, band_height):
+        h.add(band, channels='bgr')
+
+    return h
+##-
+
+
+##-
+def binarize_level(wsi, level, threshold, dark=False, band_height=1024):
+    """Threshold a slide level band by band (see binarize).
+
+    Yields:
+        (y0, mask): the first row of the band and its mask (numpy.array,
+        rows x width, uint8)
+    """
+    for y, band in read_level_bands(wsi, level, band_height):
+        yield y, binarize(band, threshold, dark, channels='bgr')
+##-
+
+
+##-
+def detect_tissue(wsi, level=-1, method='otsu', dark=False, min_area=4096, dilation=0,
+                  band_height=1024, return_mask=False):
+    """Detect the tissue blobs (e.g. the sections) on a slide: the level is
+    thresholded by its gray levels histogram, optionally dilated (joining the
+    close fragments of a section), the connected components (8-connected) of
+    at least min_area pixels are replaced by their convex hulls,
+    and the overlapping hulls are merged into a single blob. All the steps are
+    native and the level is read in bands (only once, if it fits in a band),
+    so that the detection can run at ingest, or on a higher resolution level
+    for small biopsies.
+
+    Args:
+        wsi (WSIInfo): the slide
+        level (int): the level to detect the tissue at (negative: from the
+            lowest resolution, i.e. -1 is the thumbnail)
+        method (string): threshold, 'otsu' or 'triangle' (see GrayHistogram)
+        dark (bool): is the tissue darker than the background? (by default, the
+            tissue is brighter, as on the black background of the transparent,
+            not scanned, areas)
+        min_area (int): area (in pixels, at the detection level) of the smallest
+            object to keep
+        dilation (int): radius of the disk the mask is dilated with (0: no
+            dilation); the mask is then held in memory, bit-packed (see
+            masks.BitMask)
+        band_height (int): number of rows read at once
+        return_mask (bool): also return the mask of the blobs
+
+    Returns:
+        a list of dicts, one per blob, from the top-most to the bottom-most,
+        with the keys:
+            'bbox': (x0, y0, x1, y1), the bounding box at level 0 (x1 and y1
+                excluded)
+            'hull': numpy.array (n x 2), the blob's outline (convex polygon,
+                counterclockwise) at level 0
+            'area': the blob's area, in level 0 pixels
+            'level_bbox': the bounding box at the detection level
+            'mask': numpy.array (uint8), the blob's mask at the detection level,
+                within level_bbox
+        and, if return_mask is True, the mask of all the blobs at the detection
+        level (a masks.SpanMask).
+    """
+    if level < 0:
+        level += wsi.info['level_count']
+    if level < 0 or level >= wsi.info['level_count']:
+        raise Error("requested level does not exist")
+    width = wsi.info['levels'][level]['x_size']
+    height = wsi.info['levels'][level]['y_size']
+    ds = wsi.info['levels'][level]['downsample_factor']
+
+    if height <= band_height:
+        bands = list(read_level_bands(wsi, level, band_height))  # read only once
+        read_bands = lambda: bands
+    else:
+        read_bands = lambda: read_level_bands(wsi, level, band_height)
+
+    hist = GrayHistogram()
+    for _, band in read_bands():
+        hist.add(band, channels='bgr')
+    th = hist.threshold(method)
+
+    lab = ComponentLabeler(width, min_area)
+    if dilation > 0:
+        msk = BitMask((height, width))
+        for y, band in read_bands():
+            msk.set_rows(y, binarize(band, th, dark, channels='bgr'))
+        msk.dilation(dilation)
+        for y in range(0, height, band_height):
+            lab.push(msk.to_dense(0, y, width, min(band_height, height - y)))
+        msk = None
+    else:
+        for _, band in read_bands():
+            lab.push(binarize(band, th, dark, channels='bgr'))
+
+    # the hulls of the objects, then the blobs (the overlapping hulls making a
+    # single one)
+    _, _, _, xy, offsets = lab.finish(flat=True)
+    hulls = SpanMask((height, width))
+    hulls.add_flat(xy - 0.5, offsets, fill_rule='nonzero')  # the pixels with the centre inside
+    lab = ComponentLabeler(width)
+    for y in range(0, height, band_height):
+        lab.push(hulls.to_dense(0, y, width, min(band_height, height - y)))
+
+    blobs = []
+    for b in lab.finish():
+        x0, y0, x1, y1 = b['bbox']
+        msk = hulls.to_dense(x0, y0, x1 - x0, y1 - y0) & \
+            SpanMask((y1 - y0, x1 - x0)).add_region(b['hull'] - (x0 + 0.5, y0 + 0.5)).to_dense()
+        blobs.append({'bbox': (x0 * ds, y0 * ds, x1 * ds, y1 * ds),
+                      'hull': b['hull'] * ds,
+                      'area': b['area'] * ds * ds,
+                      'level_bbox': b['bbox'],
+                      'mask': msk})
+
+    if return_mask:
+        return blobs, hulls
+    return blobs
+##-
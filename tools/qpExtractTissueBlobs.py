@@ -17,20 +17,16 @@ import openslide as osl
 import argparse as opt
 import numpy as np
 import simplejson as json
-import subprocess as sp
 import re
 import os, os.path
 
-from skimage.transform import resize
-from skimage.morphology import remove_small_objects, convex_hull_object
-from skimage.filters import threshold_otsu
-from skimage.color import rgb2gray
-from skimage.measure import label, regionprops
-from skimage.external import tifffile
-from skimage.io import imsave, imread
+from skimage.io import imsave
 
 from qpath2.core import WSIInfo, MRI
-from qpath2.io.tiled import save_tiled_image
+from qpath2.io.tiled import TiledPyramidWriter, tiled_level_complete, extract_slide_region
+from qpath2.io.tiff import BigTiffWriter
+from qpath2.masks import mask_to_polygons
+from qpath2.tissue import detect_tissue
 
 import warnings
 
@@ -43,8 +39,12 @@ def main():
     p = opt.ArgumentParser(description="Extracts tissue blobs from a WSI and stores them as tile images.")
     p.add_argument('img_file', action='store', help='WSI file name')
     p.add_argument('--prefix', action='store', help='path where to store the results', default='./')
-    p.add_argument('--min_area', action='store', help='area of the smallest object to keep (in px)',
-                   default=4096)
+    p.add_argument('--min_area', action='store', type=int,
+                   help='area of the smallest object to keep (in px)', default=4096)
+    p.add_argument('--dilation', action='store', type=int,
+                   help='radius of the disk the tissue mask is dilated with (in px, at the lowest ' +
+                        'resolution; default: 0, no dilation)',
+                   default=0)
     p.add_argument('--level', action='store', type=int,
                    help='magnification level (0: maximum resolution, default: lowest)',
                    default=-1)
@@ -53,6 +53,10 @@ def main():
     p.add_argument('--tile', action='store', help='tile geometry: (w,h)', default='(128,128)')
     p.add_argument('--format', action='store', help='output image format',
                    choices=['ppm', 'tiff', 'jpeg'], default='ppm')
+    p.add_argument('--max_fg', action='store', type=float,
+                   help='tiles with at most this fraction of foreground (non-zero) pixels are ' +
+                        'not stored, but read as background (default: 0, only empty tiles)',
+                   default=0.0)
     p.add_argument('-v', '--verbose', action='store_true', help='verbose')
     p.add_argument('-m', '--mask', action='store_true', help='save mask at image resolution?')
     p.add_argument('-n', '--names', action='store', help='a list of tissue blob names (e.g. stains)', nargs='+')
@@ -81,37 +85,21 @@ def main():
     if args.level == -1 or args.level >= img.info['level_count']:
         args.level = img.info['level_count'] - 1
 
-    # read the lowest resolution and try to detect the tissue pieces
+    # detect the tissue pieces at the lowest resolution (black background): the convex
+    # hulls of the objects of at least min_area pixels, ordered from the top-most to the
+    # bottom-most
     lowest_res_level = img.info['level_count'] - 1
-    #img_full = img.read_region((0, 0), lowest_res_level,
-    #                           img.level_dimensions[lowest_res_level])  # mask automatically applied, background is 0
-    #img_data = np.asarray(img_full)
-    img_data = mri.get_region_px(0, 0,
-                                 img.info['levels'][lowest_res_level]['x_size'],
-                                 img.info['levels'][lowest_res_level]['y_size'],
-                                 lowest_res_level, as_type=np.uint8)
-
-    if img_data.ndim == 3 and img_data.shape[2] > 3:
-        img_data = img_data[..., :3]  # drop alpha channel
-
-    if img_data.ndim ==3:
-        img_gray = rgb2gray(img_data)
-    else:
-        img_gray = img_data
-
-    th = threshold_otsu(img_gray)
-    img_bin = img_gray >= th  # black background
-    # img_bin = dilation(img_bin, selem=disk(3))
-    img_bin = remove_small_objects(img_bin, args.min_area)
-    img_bin = convex_hull_object(img_bin)
-
-    labels = label(img_bin, neighbors=8, background=0)
-    props = regionprops(labels)
+    blobs, blob_mask = detect_tissue(img, lowest_res_level, min_area=args.min_area, dilation=args.dilation,
+                                     return_mask=True)
 
     if args.verbose:
-        print("Number of tissue blobs: {:d}".format(len(props)))
-        imsave(args.prefix + os.path.sep + 'whole_slide.jpeg', img_data)
-        imsave(args.prefix + os.path.sep + 'whole_slide_blobs.jpeg', 255*labels)
+        print("Number of tissue blobs: {:d}".format(len(blobs)))
+        img_data = mri.get_region_px(0, 0,
+                                     img.info['levels'][lowest_res_level]['x_size'],
+                                     img.info['levels'][lowest_res_level]['y_size'],
+                                     lowest_res_level, as_type=np.uint8)
+        imsave(args.prefix + os.path.sep + 'whole_slide.jpeg', img_data[..., :3])
+        imsave(args.prefix + os.path.sep + 'whole_slide_blobs.jpeg', blob_mask.to_dense(value=255))
 
     # extract tissue regions:
     s = img.info['levels'][lowest_res_level]['downsample_factor'] / \
@@ -120,19 +108,16 @@ def main():
 
     mri = None
 
-    # order the regions, from the top-most (smaller y coordinate of the bounding box) to the
-    # bottom-most:
-    props = sorted(props, key=lambda _pr: _pr.bbox[0])
-
     k = 0
-    for pr in props:
+    for b in blobs:
+        x0, y0, x1, y1 = b['level_bbox']
         # get mask:
-        msk = img_bin[pr.bbox[0]:pr.bbox[2], pr.bbox[1]:pr.bbox[3]].astype(np.uint8)
+        msk = b['mask']
         # get image at highest resolution:
-        start_x = np.int64(max(s0 * pr.bbox[1], 0))
-        start_y = np.int64(max(s0 * pr.bbox[0], 0))
-        width = np.int64(s * (pr.bbox[3] - pr.bbox[1]))
-        height = np.int64(s * (pr.bbox[2] - pr.bbox[0]))
+        start_x = np.int64(max(s0 * x0, 0))
+        start_y = np.int64(max(s0 * y0, 0))
+        width = np.int64(s * (x1 - x0))
+        height = np.int64(s * (y1 - y0))
 
         # store meta:
         if args.names is not None and k < len(args.names):
@@ -145,92 +130,86 @@ def main():
         if not os.path.exists(dst_path):
             os.mkdir(dst_path)
 
-        meta[tname] = dict({"name": dst_path + os.path.sep + tname + '_level_{:d}.png'.format(args.level),
+        # the blob's outline (polygons with holes), at the extraction level and
+        # relative to the blob image, in the pixel centres convention (see
+        # masks.mask_to_polygons): masks.add_region (or SpanMask.add_region)
+        # rasterizes it into the blob's mask, without growing it
+        outline = mask_to_polygons(msk, tolerance=0.5, scale=s, offset=(-0.5, -0.5))
+
+        prev_meta = meta.get(tname)  # from a previous run, if any
+        meta[tname] = dict({"name": dst_path + os.path.sep + tname + '_level_{:d}.tiff'.format(args.level),
                             "mask": dst_path + os.path.sep + tname + '_mask_level_{:d}.tiff'.format(args.level),
                             "from_original_level": args.level,
-                            "from_original_x": s * pr.bbox[1],
-                            "from_original_y": s * pr.bbox[0],
+                            "from_original_x": s * x0,
+                            "from_original_y": s * y0,
                             "from_original_width": width,
-                            "from_original_height": height})
-
-        # Currently (May 2017), a bug in PIL library leads to errors in the case of very
-        # large regions. Hence, we rely on the OpenSlide's utility to export the .PNG
-        # file. Then re-read it and continue with processing.
-
+                            "from_original_height": height,
+                            "tile_geom": list(tile_geom),
+                            "tile_type": args.format,
+                            "tile_max_fg": args.max_fg,
+                            "outline": [[_r.tolist() for _r in _p] for _p in outline]})
+
+        # skip the blobs completely extracted by a previous run with the same
+        # parameters; the other ones are (re)extracted, but only the tiles which
+        # are missing or have changed are re-encoded
+        if prev_meta is not None and \
+                all([prev_meta.get(_k) == meta[tname][_k] for _k in meta[tname] if _k != 'name']) and \
+                tiled_level_complete(dst_path, args.level, tile_geom, args.format) and \
+                (not args.mask or os.path.exists(meta[tname]['mask'])):
+            print("Tissue blob {:d} already extracted, skipping".format(k+1))
+            meta[tname]['name'] = prev_meta['name']
+            k += 1
+            continue
+
+        # The blob is streamed from the slide straight to the tiled storage (and
+        # to the BigTIFF files, if asked), one band of tiles at a time: the mask
+        # is upscaled and applied on the fly, and the pixels outside the scanned
+        # area (transparent) are masked out as well.
         print("Extract tissue blob {:d}".format(k+1))
 
-        # check whether the image already exists - hopefully the correct one, from a
-        # previous run
-        if not os.path.exists(meta[tname]['name']):
-            sp.check_call(["openslide-write-png", args.img_file,
-                           '{:d}'.format(start_x),
-                           '{:d}'.format(start_y),
-                           '{:d}'.format(args.level),
-                           '{:d}'.format(width),
-                           '{:d}'.format(height),
-                           meta[tname]['name']])
-
-        print('reading '+ meta[tname]['name'])
-        img_data = imread(meta[tname]['name'])
-
-        # img_tissue = img.read_region((start_x, start_y), args.level,
-        #                              (width, height))
-        # img_data = mri.get_region_px(s * pr.bbox[1], s * pr.bbox[0], width, height, args.level, as_type=np.uint8)
-
-        msk_from_scanner = None
-        if img_data.ndim == 3 and img_data.shape[2] == 4:
-            # has alpha-channel
-            msk_from_scanner = img_data[:,:,3].astype(np.uint8)  # alpha-channel: 255 for the tissue region, 0 elsewhere
-            msk_from_scanner[msk_from_scanner == 255] = 1  # img 0/1
-            small_mask = resize(msk_from_scanner, msk.shape, order=0, mode='constant', cval=0, preserve_range=True)
-            small_mask[small_mask < 1] = 0
-            small_mask *= msk  # 'AND' the masks
-            small_mask = small_mask.astype(np.uint8)
-
-            img_data = img_data[:,:,:3]  # drop alpha-channel from image data
-
-        # up-scale the mask and set "True" for foreground
-        msk = resize(msk, img_data.shape[:2], mode='constant', order=0, cval=0, preserve_range=True)
-        msk[msk < 1] = 0  # drop values due to aliasing
-
-        if msk_from_scanner is not None:
-            msk *= msk_from_scanner   # 'AND' the two masks
-
-        msk = msk.astype(np.uint8)
-
-        if img_data.ndim == 2:
-            img_data *= msk
-        else:
-            for ch in np.arange(img_data.shape[2]):
-                img_data[:, :, ch] *= msk
+        # the background (outside the mask) is 0: background tiles are not stored
+        img_writer = TiledPyramidWriter(dst_path, args.level, (height, width, 3), tile_geom, n_levels=1,
+                                        img_type=args.format, fill=0, max_foreground=args.max_fg,
+                                        downsample_factor=img.info['levels'][args.level]['downsample_factor'])
+        writers = [img_writer]
+        if args.keep_whole_image:
+            writers.append(BigTiffWriter(meta[tname]['name'], (height, width, 3), tile_geom=(512, 512),
+                                         compression='jpeg', n_levels=1))
+        msk_writers = []
+        if args.mask:
+            # the large mask is saved only if asked:
+            msk_writers.append(BigTiffWriter(meta[tname]['mask'], (height, width), tile_geom=(512, 512),
+                                             compression='deflate', quality=9, fill=0))
 
-        # save
-        save_tiled_image(img_data, dst_path, args.level, tile_geom, img_type=args.format)
+        small_mask = np.zeros(msk.shape, dtype=np.uint8)
+        extract_slide_region(args.img_file, start_x, start_y, args.level, width, height, writers,
+                             mask=msk, mask_writers=msk_writers, small_mask=small_mask)
+        for w in writers + msk_writers:
+            w.close()
 
         # save, anyway, the small mask:
         imsave(dst_path + os.path.sep + tname + '_level_{:d}.ppm'.format(lowest_res_level), 255*small_mask)
 
-        # the large mask is saved only if asked:
-        if args.mask:
-            with tifffile.TiffWriter(meta[tname]['mask'], bigtiff=True) as tif:
-                tif.save(255 * msk, compress=9, tile=(512, 512))
-
         if not args.keep_whole_image:
-           os.remove(meta[tname]['name'])
-           meta[tname]['name'] = ''
-        # if args.keep_whole_image:
-        #     with tifffile.TiffWriter(meta[tname]['name'], bigtiff=True) as tif:
-        #         tif.save(img_data, compress=9, tile=(512, 512))
+            meta[tname]['name'] = ''
 
         k += 1
+
+        # save the meta-data after each blob, such that an interrupted run can
+        # be resumed
+        save_meta(args.prefix + '/meta.json', meta)
     # end for
 
-    with open(args.prefix + '/meta.json', 'w') as fp:
-        json.dump(meta, fp, separators=(',', ':'), indent='  ', sort_keys=True)
+    save_meta(args.prefix + '/meta.json', meta)
 
     return
 
 
+def save_meta(file_name, meta):
+    with open(file_name, 'w') as fp:
+        json.dump(meta, fp, separators=(',', ':'), indent='  ', sort_keys=True)
+
+
 ## MAIN ##
 if __name__ == '__main__':
     main()
\ No newline at end of file